@@ -0,0 +1,53 @@
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+/*
+  Host stand-in for the Arduino-ESP32 core, just what the sources built by env:native use (see platformio.ini). It is
+  single-threaded: mutexes and critical sections do nothing. Test hooks, e.g. to move the clock, are in NativeArduino.h.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "WString.h"
+#include "Print.h"
+#include "Stream.h"
+#include "HardwareSerial.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x02
+#define INPUT_PULLUP 0x05
+#define INPUT_PULLDOWN 0x09
+
+#define IRAM_ATTR
+#define F(string) (string)
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void digitalWrite(uint8_t pin, uint8_t value);
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+extern "C" size_t strlcpy(char *destination, const char *source, size_t size);
+#endif
+
+#endif
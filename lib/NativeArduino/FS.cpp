@@ -0,0 +1,114 @@
+#include "FS.h"
+
+namespace fs {
+
+std::vector<uint8_t> *File::data() {
+  if (!state || state->directory)
+    return NULL;
+  FileMap::iterator file = state->files->find(state->path);
+  return file == state->files->end() ? NULL : &file->second; // NULL once the file was removed
+}
+
+size_t File::write(const uint8_t *buffer, size_t size) {
+  std::vector<uint8_t> *bytes = data();
+  if (!bytes || !state->writable)
+    return 0;
+  if (state->position > bytes->size())
+    state->position = bytes->size();
+  size_t overlap = std::min(size, bytes->size() - state->position);
+  std::copy(buffer, buffer + overlap, bytes->begin() + state->position);
+  bytes->insert(bytes->end(), buffer + overlap, buffer + size);
+  state->position += size;
+  return size;
+}
+
+int File::available() {
+  std::vector<uint8_t> *bytes = data();
+  return (bytes && state->position < bytes->size()) ? bytes->size() - state->position : 0;
+}
+
+int File::read() {
+  uint8_t value;
+  return read(&value, 1) ? value : -1;
+}
+
+int File::peek() {
+  std::vector<uint8_t> *bytes = data();
+  return (bytes && state->position < bytes->size()) ? (*bytes)[state->position] : -1;
+}
+
+size_t File::read(uint8_t *buffer, size_t size) {
+  size_t length = std::min(size, (size_t)available());
+  if (length) {
+    memcpy(buffer, data()->data() + state->position, length);
+    state->position += length;
+  }
+  return length;
+}
+
+bool File::seek(uint32_t position, SeekMode mode) {
+  std::vector<uint8_t> *bytes = data();
+  if (!bytes)
+    return false;
+  size_t target = mode == SeekSet ? position : mode == SeekCur ? state->position + position : bytes->size() + position;
+  if (target > bytes->size())
+    return false;
+  state->position = target;
+  return true;
+}
+
+size_t File::size() {
+  std::vector<uint8_t> *bytes = data();
+  return bytes ? bytes->size() : 0;
+}
+
+File File::openNextFile(const char *mode) {
+  if (!isDirectory() || state->next >= state->listing.size())
+    return File();
+  std::shared_ptr<FileState> file = std::make_shared<FileState>();
+  file->files = state->files;
+  file->path = state->listing[state->next++];
+  return File(file);
+}
+
+File FS::open(const char *path, const char *mode, const bool create) {
+  std::shared_ptr<FileState> file = std::make_shared<FileState>();
+  file->files = files;
+  file->path = path;
+  if (strcmp(path, "/") == 0) {
+    file->directory = true;
+    for (FileMap::iterator i = files->begin(); i != files->end(); i++)
+      file->listing.push_back(i->first);
+    return File(file);
+  }
+  if (mode[0] == 'r') {
+    if (!exists(path))
+      return File();
+  } else {
+    file->writable = true;
+    if (mode[0] == 'w')
+      (*files)[path].clear();
+    else
+      file->position = (*files)[path].size();
+  }
+  return File(file);
+}
+
+bool FS::rename(const char *from, const char *to) {
+  FileMap::iterator file = files->find(from);
+  if (file == files->end())
+    return false;
+  std::vector<uint8_t> bytes = file->second;
+  files->erase(file);
+  (*files)[to] = bytes;
+  return true;
+}
+
+size_t FS::usedBytes() {
+  size_t bytes = 0;
+  for (FileMap::iterator i = files->begin(); i != files->end(); i++)
+    bytes += i->second.size();
+  return bytes;
+}
+
+}
@@ -0,0 +1,81 @@
+#ifndef FS_H
+#define FS_H
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+// Flat filesystem in RAM like SPIFFS: no directories, a path is just the name of a file. Opening "/" lists all files.
+namespace fs {
+
+enum SeekMode { SeekSet, SeekCur, SeekEnd };
+
+typedef std::map<std::string, std::vector<uint8_t>> FileMap;
+
+struct FileState {
+  std::shared_ptr<FileMap> files;
+  std::string path;
+  size_t position = 0;
+  bool writable = false;
+  bool directory = false;
+  std::vector<std::string> listing; // of a directory
+  size_t next = 0;
+};
+
+class File : public Stream {
+  private:
+    std::shared_ptr<FileState> state;
+    std::vector<uint8_t> *data();
+
+  public:
+    File() {}
+    File(std::shared_ptr<FileState> state) : state(state) {}
+
+    size_t write(uint8_t data) override { return write(&data, 1); }
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t read(uint8_t *buffer, size_t size);
+    bool seek(uint32_t position, SeekMode mode = SeekSet);
+    size_t position() const { return state ? state->position : 0; }
+    size_t size();
+    void close() { state.reset(); }
+    operator bool() const { return (bool)state; }
+    const char *name() const { return state ? state->path.c_str() : ""; }
+    bool isDirectory() const { return state && state->directory; }
+    File openNextFile(const char *mode = FILE_READ);
+};
+
+class FS {
+  private:
+    std::shared_ptr<FileMap> files = std::make_shared<FileMap>();
+
+  public:
+    File open(const char *path, const char *mode = FILE_READ, const bool create = false);
+    File open(const String &path, const char *mode = FILE_READ) { return open(path.c_str(), mode); }
+    bool exists(const char *path) { return files->count(path) > 0; }
+    bool exists(const String &path) { return exists(path.c_str()); }
+    bool remove(const char *path) { return files->erase(path) > 0; }
+    bool remove(const String &path) { return remove(path.c_str()); }
+    bool rename(const char *from, const char *to);
+    size_t usedBytes();
+};
+
+}
+
+using fs::FS;
+using fs::File;
+using fs::SeekMode;
+using fs::SeekSet;
+using fs::SeekCur;
+using fs::SeekEnd;
+
+#endif
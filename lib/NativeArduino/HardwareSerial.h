@@ -0,0 +1,26 @@
+#ifndef HARDWARESERIAL_H
+#define HARDWARESERIAL_H
+
+#include "Stream.h"
+
+#define SERIAL_8N1 0x800001c
+
+// Serial prints to stdout and never receives anything
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rxPin = -1, int8_t txPin = -1) {}
+    void end() {}
+    void updateBaudRate(unsigned long baud) {}
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    size_t write(uint8_t data) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Print::write;
+    void flush() override;
+    operator bool() const { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
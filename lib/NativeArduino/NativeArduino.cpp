@@ -0,0 +1,73 @@
+#include "NativeArduino.h"
+#include <chrono>
+#include <thread>
+
+static const auto clockStart = std::chrono::steady_clock::now();
+static uint64_t clockOffsetMicros = 0;
+static uint8_t pinLevels[64];
+static bool pinLevelsSet = false;
+
+static uint64_t clockMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - clockStart).count() + clockOffsetMicros;
+}
+
+// 32 bit like on the ESP32, so overflows behave the same
+unsigned long millis() {
+  return (uint32_t)(clockMicros() / 1000);
+}
+
+unsigned long micros() {
+  return (uint32_t)clockMicros();
+}
+
+void delay(uint32_t ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+void nativeAdvanceClock(uint32_t ms) {
+  clockOffsetMicros += (uint64_t)ms * 1000;
+}
+
+static uint8_t *levels() {
+  if (!pinLevelsSet) {
+    memset(pinLevels, HIGH, sizeof(pinLevels));
+    pinLevelsSet = true;
+  }
+  return pinLevels;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < sizeof(pinLevels) ? levels()[pin] : LOW;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  nativeSetPinLevel(pin, value);
+}
+
+void nativeSetPinLevel(uint8_t pin, uint8_t level) {
+  if (pin < sizeof(pinLevels))
+    levels()[pin] = level ? HIGH : LOW;
+}
+
+int64_t esp_timer_get_time() {
+  return (int64_t)clockMicros();
+}
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+extern "C" size_t strlcpy(char *destination, const char *source, size_t size) {
+  size_t length = strlen(source);
+  if (size) {
+    size_t n = min(length, size - 1);
+    memcpy(destination, source, n);
+    destination[n] = '\0';
+  }
+  return length;
+}
+#endif
@@ -0,0 +1,11 @@
+#ifndef NATIVEARDUINO_H
+#define NATIVEARDUINO_H
+
+#include <Arduino.h>
+
+// test hooks of the host stand-in, see Arduino.h
+void nativeAdvanceClock(uint32_t ms); // millis()/micros() jump ahead without waiting, e.g. to expire queued events
+void nativeSetPinLevel(uint8_t pin, uint8_t level); // level digitalRead() returns for an input, HIGH by default
+void nativeClearPreferences(); // all namespaces, like a freshly erased NVS
+
+#endif
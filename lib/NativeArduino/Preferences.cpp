@@ -0,0 +1,81 @@
+#include "Preferences.h"
+#include "NativeArduino.h"
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::map<std::string, std::vector<uint8_t>> PreferencesNamespace;
+
+static std::map<std::string, PreferencesNamespace> &storage() {
+  static std::map<std::string, PreferencesNamespace> namespaces;
+  return namespaces;
+}
+
+void nativeClearPreferences() {
+  storage().clear();
+}
+
+bool Preferences::begin(const char *name, bool readOnly, const char *partition) {
+  this->name = name;
+  this->readOnly = readOnly;
+  opened = true;
+  return true;
+}
+
+void Preferences::end() {
+  opened = false;
+}
+
+bool Preferences::clear() {
+  if (!opened || readOnly)
+    return false;
+  storage()[name.c_str()].clear();
+  return true;
+}
+
+bool Preferences::remove(const char *key) {
+  if (!opened || readOnly)
+    return false;
+  return storage()[name.c_str()].erase(key) > 0;
+}
+
+bool Preferences::isKey(const char *key) {
+  return opened && storage()[name.c_str()].count(key) > 0;
+}
+
+size_t Preferences::put(const char *key, const void *value, size_t length) {
+  if (!opened || readOnly)
+    return 0;
+  const uint8_t *bytes = (const uint8_t*)value;
+  storage()[name.c_str()][key].assign(bytes, bytes + length);
+  return length;
+}
+
+size_t Preferences::get(const char *key, void *value, size_t length) {
+  if (!isKey(key))
+    return 0;
+  std::vector<uint8_t> &stored = storage()[name.c_str()][key];
+  if (stored.size() != length)
+    return 0; // stored with another type
+  memcpy(value, stored.data(), length);
+  return length;
+}
+
+String Preferences::getString(const char *key, const String &defaultValue) {
+  if (!isKey(key))
+    return defaultValue;
+  std::vector<uint8_t> &stored = storage()[name.c_str()][key];
+  return String(std::string(stored.begin(), stored.end()).c_str());
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+  return isKey(key) ? storage()[name.c_str()][key].size() : 0;
+}
+
+size_t Preferences::getBytes(const char *key, void *buffer, size_t length) {
+  size_t stored = getBytesLength(key);
+  if (stored == 0 || stored > length)
+    return 0;
+  memcpy(buffer, storage()[name.c_str()][key].data(), stored);
+  return stored;
+}
@@ -0,0 +1,39 @@
+#ifndef PREFERENCES_H
+#define PREFERENCES_H
+
+#include <Arduino.h>
+
+// NVS in RAM, kept as long as the process runs, see nativeClearPreferences()
+class Preferences {
+  private:
+    String name;
+    bool opened = false;
+    bool readOnly = false;
+
+    size_t put(const char *key, const void *value, size_t length);
+    size_t get(const char *key, void *value, size_t length);
+
+  public:
+    bool begin(const char *name, bool readOnly = false, const char *partition = NULL);
+    void end();
+    bool clear();
+    bool remove(const char *key);
+    bool isKey(const char *key);
+
+    size_t putBool(const char *key, bool value) { return put(key, &value, sizeof(value)); }
+    bool getBool(const char *key, bool defaultValue = false) { bool value = defaultValue; get(key, &value, sizeof(value)); return value; }
+    size_t putUChar(const char *key, uint8_t value) { return put(key, &value, sizeof(value)); }
+    uint8_t getUChar(const char *key, uint8_t defaultValue = 0) { uint8_t value = defaultValue; get(key, &value, sizeof(value)); return value; }
+    size_t putUShort(const char *key, uint16_t value) { return put(key, &value, sizeof(value)); }
+    uint16_t getUShort(const char *key, uint16_t defaultValue = 0) { uint16_t value = defaultValue; get(key, &value, sizeof(value)); return value; }
+    size_t putUInt(const char *key, uint32_t value) { return put(key, &value, sizeof(value)); }
+    uint32_t getUInt(const char *key, uint32_t defaultValue = 0) { uint32_t value = defaultValue; get(key, &value, sizeof(value)); return value; }
+    size_t putString(const char *key, const char *value) { return put(key, value, strlen(value) + 1); }
+    size_t putString(const char *key, const String &value) { return putString(key, value.c_str()); }
+    String getString(const char *key, const String &defaultValue = String());
+    size_t putBytes(const char *key, const void *value, size_t length) { return put(key, value, length); }
+    size_t getBytes(const char *key, void *buffer, size_t length);
+    size_t getBytesLength(const char *key);
+};
+
+#endif
@@ -0,0 +1,25 @@
+#include "Print.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <vector>
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t written = 0;
+  while (size-- && write(*buffer++))
+    written++;
+  return written;
+}
+
+size_t Print::printf(const char *format, ...) {
+  va_list arguments;
+  va_start(arguments, format);
+  int length = vsnprintf(NULL, 0, format, arguments);
+  va_end(arguments);
+  if (length <= 0)
+    return 0;
+  std::vector<char> buffer(length + 1);
+  va_start(arguments, format);
+  vsnprintf(buffer.data(), buffer.size(), format, arguments);
+  va_end(arguments);
+  return write((const uint8_t*)buffer.data(), length);
+}
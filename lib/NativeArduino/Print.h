@@ -0,0 +1,37 @@
+#ifndef PRINT_H
+#define PRINT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "WString.h"
+
+#define DEC 10
+#define HEX 16
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t data) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *text) { return text ? write((const uint8_t*)text, strlen(text)) : 0; }
+    virtual void flush() {}
+
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    size_t print(const String &text) { return write((const uint8_t*)text.c_str(), text.length()); }
+    size_t print(const char *text) { return write(text); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char number, int base = DEC) { return print(String(number, base)); }
+    size_t print(int number, int base = DEC) { return print(String(number, base)); }
+    size_t print(unsigned int number, int base = DEC) { return print(String(number, base)); }
+    size_t print(long number, int base = DEC) { return print(String(number, base)); }
+    size_t print(unsigned long number, int base = DEC) { return print(String(number, base)); }
+    size_t print(long long number, int base = DEC) { return print(String(number, base)); }
+    size_t print(unsigned long long number, int base = DEC) { return print(String(number, base)); }
+    size_t print(double number, int decimals = 2) { return print(String(number, decimals)); }
+    template <typename T> size_t println(const T &value) { return print(value) + println(); }
+    template <typename T> size_t println(const T &value, int format) { return print(value, format) + println(); }
+    size_t println() { return write("\r\n"); }
+};
+
+#endif
@@ -0,0 +1,17 @@
+#include "Arduino.h"
+
+size_t Stream::readBytes(uint8_t *buffer, size_t length) {
+  size_t count = 0;
+  unsigned long start = millis();
+  while (count < length) {
+    int data = read();
+    if (data < 0) {
+      if (millis() - start >= timeout)
+        break;
+      yield();
+      continue;
+    }
+    buffer[count++] = data;
+  }
+  return count;
+}
@@ -0,0 +1,104 @@
+#include "WString.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+static std::string formatNumber(unsigned long long number, bool negative, unsigned char base) {
+  if (base < 2 || base > 36)
+    base = 10;
+  char digits[66];
+  char *p = digits + sizeof(digits);
+  *--p = '\0';
+  do {
+    int digit = number % base;
+    *--p = digit < 10 ? '0' + digit : 'a' + digit - 10;
+    number /= base;
+  } while (number);
+  if (negative)
+    *--p = '-';
+  return p;
+}
+
+static std::string formatSigned(long long number, unsigned char base) {
+  if (base == 10 && number < 0)
+    return formatNumber(-(unsigned long long)number, true, base);
+  return formatNumber((unsigned long long)number, false, base);
+}
+
+String::String(const char *text) : value(text ? text : "") {}
+String::String(const std::string &text) : value(text) {}
+String::String(char c) : value(1, c) {}
+String::String(unsigned char number, unsigned char base) : value(formatNumber(number, false, base)) {}
+String::String(int number, unsigned char base) : value(base == 10 ? formatSigned(number, base) : formatNumber((unsigned int)number, false, base)) {}
+String::String(unsigned int number, unsigned char base) : value(formatNumber(number, false, base)) {}
+String::String(long number, unsigned char base) : value(base == 10 ? formatSigned(number, base) : formatNumber((unsigned long)number, false, base)) {}
+String::String(unsigned long number, unsigned char base) : value(formatNumber(number, false, base)) {}
+String::String(long long number, unsigned char base) : value(formatSigned(number, base)) {}
+String::String(unsigned long long number, unsigned char base) : value(formatNumber(number, false, base)) {}
+String::String(float number, unsigned int decimals) : String((double)number, decimals) {}
+
+String::String(double number, unsigned int decimals) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%.*f", decimals, number);
+  value = buffer;
+}
+
+bool String::endsWith(const String &suffix) const {
+  return value.length() >= suffix.value.length() && value.compare(value.length() - suffix.value.length(), suffix.value.length(), suffix.value) == 0;
+}
+
+int String::indexOf(char c, unsigned int from) const {
+  size_t position = value.find(c, from);
+  return position == std::string::npos ? -1 : (int)position;
+}
+
+int String::indexOf(const String &text, unsigned int from) const {
+  size_t position = value.find(text.value, from);
+  return position == std::string::npos ? -1 : (int)position;
+}
+
+String String::substring(unsigned int from) const {
+  return substring(from, value.length());
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+  if (from > to)
+    std::swap(from, to);
+  if (from >= value.length())
+    return String();
+  return String(value.substr(from, to - from));
+}
+
+void String::trim() {
+  size_t start = 0, end = value.length();
+  while (start < end && isspace((unsigned char)value[start]))
+    start++;
+  while (end > start && isspace((unsigned char)value[end - 1]))
+    end--;
+  value = value.substr(start, end - start);
+}
+
+void String::toLowerCase() {
+  for (char &c : value)
+    c = tolower((unsigned char)c);
+}
+
+void String::toUpperCase() {
+  for (char &c : value)
+    c = toupper((unsigned char)c);
+}
+
+void String::toCharArray(char *buffer, unsigned int size, unsigned int index) const {
+  if (size == 0)
+    return;
+  size_t length = index < value.length() ? std::min((size_t)size - 1, value.length() - index) : 0;
+  memcpy(buffer, value.c_str() + index, length);
+  buffer[length] = '\0';
+}
+
+String operator+(const char *left, const String &right) {
+  String sum(left);
+  sum += right;
+  return sum;
+}
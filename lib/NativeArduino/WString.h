@@ -0,0 +1,63 @@
+#ifndef WSTRING_H
+#define WSTRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+// Arduino String on top of std::string
+class String {
+  private:
+    std::string value;
+
+  public:
+    String(const char *text = "");
+    String(const std::string &text);
+    String(char c);
+    String(unsigned char number, unsigned char base = 10);
+    String(int number, unsigned char base = 10);
+    String(unsigned int number, unsigned char base = 10);
+    String(long number, unsigned char base = 10);
+    String(unsigned long number, unsigned char base = 10);
+    String(long long number, unsigned char base = 10);
+    String(unsigned long long number, unsigned char base = 10);
+    String(float number, unsigned int decimals = 2);
+    String(double number, unsigned int decimals = 2);
+
+    const char *c_str() const { return value.c_str(); }
+    unsigned int length() const { return value.length(); }
+    bool isEmpty() const { return value.empty(); }
+    bool reserve(unsigned int size) { value.reserve(size); return true; }
+    char operator[](unsigned int index) const { return index < value.length() ? value[index] : 0; }
+    char charAt(unsigned int index) const { return (*this)[index]; }
+
+    bool concat(const String &text) { value += text.value; return true; }
+    bool concat(const char *text, unsigned int length) { value.append(text, length); return true; }
+    template <typename T> String &operator+=(const T &other) { concat(String(other)); return *this; }
+
+    bool equals(const String &other) const { return value == other.value; }
+    bool operator==(const String &other) const { return value == other.value; }
+    bool operator!=(const String &other) const { return value != other.value; }
+    bool operator==(const char *other) const { return value == other; }
+    bool operator!=(const char *other) const { return value != other; }
+    bool operator<(const String &other) const { return value < other.value; }
+    int compareTo(const String &other) const { return value.compare(other.value); }
+    bool startsWith(const String &prefix) const { return value.compare(0, prefix.value.length(), prefix.value) == 0; }
+    bool endsWith(const String &suffix) const;
+
+    int indexOf(char c, unsigned int from = 0) const;
+    int indexOf(const String &text, unsigned int from = 0) const;
+    String substring(unsigned int from) const;
+    String substring(unsigned int from, unsigned int to) const;
+    void trim();
+    void toLowerCase();
+    void toUpperCase();
+    long toInt() const { return atol(value.c_str()); }
+    float toFloat() const { return atof(value.c_str()); }
+    void toCharArray(char *buffer, unsigned int size, unsigned int index = 0) const;
+};
+
+template <typename T> String operator+(const String &left, const T &right) { String sum(left); sum += right; return sum; }
+String operator+(const char *left, const String &right);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SEMPHR_H
+#define SEMPHR_H
+
+#include "FreeRTOS.h"
+
+// single-threaded host: a mutex is always free
+typedef void *SemaphoreHandle_t;
+
+#define xSemaphoreCreateMutex() ((SemaphoreHandle_t)1)
+#define xSemaphoreTake(semaphore, ticks) ((void)(semaphore), (void)(ticks), pdTRUE)
+#define xSemaphoreGive(semaphore) ((void)(semaphore), pdTRUE)
+
+#endif
@@ -0,0 +1,21 @@
+#include "crc.h"
+
+uint32_t crc32_le(uint32_t crc, const uint8_t *buffer, uint32_t length) {
+  crc = ~crc;
+  for (uint32_t i=0; i<length; i++) {
+    crc ^= buffer[i];
+    for (int bit=0; bit<8; bit++)
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+uint16_t crc16_le(uint16_t crc, const uint8_t *buffer, uint32_t length) {
+  crc = ~crc;
+  for (uint32_t i=0; i<length; i++) {
+    crc ^= buffer[i];
+    for (int bit=0; bit<8; bit++)
+      crc = (crc >> 1) ^ (0x8408 & -(crc & 1));
+  }
+  return ~crc;
+}
@@ -0,0 +1,10 @@
+#ifndef ROM_CRC_H
+#define ROM_CRC_H
+
+#include <stdint.h>
+
+// same results as the ROM functions of the ESP32, crc is the result of the previous block (0 to start)
+uint32_t crc32_le(uint32_t crc, const uint8_t *buffer, uint32_t length);
+uint16_t crc16_le(uint16_t crc, const uint8_t *buffer, uint32_t length);
+
+#endif
@@ -0,0 +1,561 @@
+#include "R503Emulator.h"
+
+R503Emulator::R503Emulator(uint16_t capacity, uint32_t baudRate) {
+  this->capacity = (capacity > R503_MAX_CAPACITY) ? R503_MAX_CAPACITY : capacity;
+  this->baudRate = baudRate;
+  memset(library, 0, sizeof(library));
+  memset(charBuffer, 0, sizeof(charBuffer));
+  memset(notepad, 0, sizeof(notepad));
+
+  // rough processing times of a real R503, can be overridden by setCommandMicros()
+  for (int i=0; i<256; i++)
+    commandMicros[i] = 1000;
+  commandMicros[R503_GETIMAGE] = 60000;
+  commandMicros[R503_GENCHAR] = 50000;
+  commandMicros[R503_SEARCH] = 40000;
+  commandMicros[R503_HIGHSPEEDSEARCH] = 20000;
+  commandMicros[R503_REGMODEL] = 40000;
+  commandMicros[R503_STORE] = 30000;
+  commandMicros[R503_LOADCHAR] = 20000;
+  commandMicros[R503_DELETCHAR] = 30000;
+  commandMicros[R503_EMPTY] = 60000;
+  commandMicros[R503_SETSYSPARA] = 30000;
+  commandMicros[R503_WRITENOTEPAD] = 30000;
+  commandMicros[R503_UPCHAR] = 5000;
+  commandMicros[R503_DOWNCHAR] = 5000;
+}
+
+
+///////////////////////////////////////////////////////////
+// Scripting
+///////////////////////////////////////////////////////////
+
+void R503Emulator::queueFrames(R503Frame frame, uint16_t count, uint16_t fingerId) {
+  if (scriptLength >= R503_MAX_SCRIPT_STEPS || count == 0)
+    return;
+  R503ScriptStep &step = script[(scriptHead + scriptLength) % R503_MAX_SCRIPT_STEPS];
+  step.frame = frame;
+  step.fingerId = fingerId;
+  step.count = count;
+  scriptLength++;
+}
+
+bool R503Emulator::loadScript(const char *text) {
+  clearScript();
+  const char *p = text;
+  while (*p) {
+    if (*p == ' ' || *p == ',') {
+      p++;
+      continue;
+    }
+
+    R503Frame frame;
+    uint16_t fingerId = 0;
+    switch (*p++) {
+      case 'N': frame = R503Frame::noFinger; break;
+      case 'R': frame = R503Frame::raindrop; break;
+      case 'F':
+        frame = R503Frame::finger;
+        fingerId = strtoul(p, (char**)&p, 10);
+        if (fingerId == 0) {
+          clearScript();
+          return false;
+        }
+        break;
+      default:
+        clearScript();
+        return false;
+    }
+
+    uint16_t count = 1;
+    if (*p == '*') {
+      p++;
+      count = strtoul(p, (char**)&p, 10);
+    }
+    queueFrames(frame, count, fingerId);
+  }
+  return true;
+}
+
+void R503Emulator::clearScript() {
+  scriptHead = 0;
+  scriptLength = 0;
+}
+
+void R503Emulator::storeTemplate(uint16_t page, uint16_t fingerId) {
+  if (page < capacity)
+    library[page] = fingerId;
+}
+
+void R503Emulator::setCommandMicros(uint8_t instruction, uint32_t micros) {
+  commandMicros[instruction] = micros;
+}
+
+void R503Emulator::takeFrame() {
+  if (scriptLength == 0) {
+    lastFrame = R503Frame::noFinger;
+    lastFingerId = 0;
+    return;
+  }
+  R503ScriptStep &step = script[scriptHead];
+  lastFrame = step.frame;
+  lastFingerId = step.fingerId;
+  if (--step.count == 0) {
+    scriptHead = (scriptHead + 1) % R503_MAX_SCRIPT_STEPS;
+    scriptLength--;
+  }
+}
+
+
+///////////////////////////////////////////////////////////
+// Statistics
+///////////////////////////////////////////////////////////
+
+uint32_t R503Emulator::getBaudRate() {
+  return baudRate;
+}
+
+void R503Emulator::printStats(Print &out) {
+  out.printf("R503 emulator @ %u baud\n", baudRate);
+  out.println("instr  count   avg_us   max_us");
+  for (int i=0; i<256; i++) {
+    if (stats[i].count == 0)
+      continue;
+    out.printf("0x%02X %7u %8u %8u\n", i, stats[i].count, stats[i].totalMicros / stats[i].count, stats[i].maxMicros);
+  }
+}
+
+void R503Emulator::resetStats() {
+  for (int i=0; i<256; i++)
+    stats[i] = R503CommandStats();
+}
+
+
+///////////////////////////////////////////////////////////
+// Packet level
+///////////////////////////////////////////////////////////
+
+uint32_t R503Emulator::byteMicros() {
+  // 8N1 = 10 bits on the wire per byte
+  return (10000000UL + baudRate / 2) / baudRate;
+}
+
+uint16_t R503Emulator::txReadyCount() {
+  if (txHead == txTail)
+    return 0;
+  int32_t elapsed = (int32_t)(micros() - txScheduleStart);
+  if (elapsed < 0)
+    return 0;
+  int32_t arrived = (int32_t)txScheduleIndex + 1 + elapsed / (int32_t)byteMicros();
+  if (arrived > txTail)
+    arrived = txTail;
+  return (arrived > txHead) ? arrived - txHead : 0;
+}
+
+void R503Emulator::receiveByte(uint8_t data) {
+  // resync on start code
+  if ((rxLength == 0 && data != 0xEF) || (rxLength == 1 && data != 0x01)) {
+    rxLength = 0;
+    return;
+  }
+  if (rxLength >= R503_RX_BUFFER_SIZE) {
+    rxLength = 0; // oversized packet, drop it
+    return;
+  }
+  rxBuffer[rxLength++] = data;
+  if (rxLength < 9)
+    return;
+
+  uint16_t length = ((uint16_t)rxBuffer[7] << 8) | rxBuffer[8];
+  if (length < 2 || 9 + length > R503_RX_BUFFER_SIZE) {
+    rxLength = 0;
+    return;
+  }
+  if (rxLength < 9 + length)
+    return;
+
+  // complete packet received
+  uint16_t sum = rxBuffer[6] + rxBuffer[7] + rxBuffer[8];
+  for (uint16_t i=9; i<7+length; i++)
+    sum += rxBuffer[i];
+  uint16_t checksum = ((uint16_t)rxBuffer[7+length] << 8) | rxBuffer[8+length];
+  uint16_t packetLength = rxLength;
+  rxLength = 0;
+
+  if (rxBuffer[6] == R503_DATAPACKET || rxBuffer[6] == R503_ENDDATAPACKET) {
+    if (sum == checksum)
+      receiveTemplateData(&rxBuffer[9], length - 2, rxBuffer[6] == R503_ENDDATAPACKET);
+    else
+      downcharValid = false;
+    return;
+  }
+  if (rxBuffer[6] != R503_COMMANDPACKET || length < 3)
+    return;
+  if (sum != checksum) {
+    sendAck(rxBuffer[9], packetLength, R503_PACKETRECIEVEERR, NULL, 0);
+    return;
+  }
+  handleCommand(&rxBuffer[9], length - 2);
+}
+
+// Append a packet to the tx buffer. If the buffer is empty its first byte arrives after delayMicros, otherwise it
+// follows the bytes already scheduled.
+bool R503Emulator::sendPacket(uint8_t type, const uint8_t *payload, uint16_t length, uint32_t delayMicros) {
+  uint16_t packetLength = 9 + length + 2; // header + payload + checksum
+  if (txHead == txTail) {
+    txHead = 0;
+    txTail = 0;
+  } else if (txTail + packetLength > R503_TX_BUFFER_SIZE) {
+    memmove(txBuffer, &txBuffer[txHead], txTail - txHead);
+    txScheduleIndex -= txHead;
+    txTail -= txHead;
+    txHead = 0;
+  }
+  if (txTail + packetLength > R503_TX_BUFFER_SIZE)
+    return false; // host is not reading its responses
+
+  if (txHead == txTail) {
+    txScheduleStart = micros() + delayMicros + byteMicros();
+    txScheduleIndex = txTail;
+  }
+
+  uint16_t wireLength = length + 2;
+  uint8_t *p = &txBuffer[txTail];
+  *p++ = 0xEF; *p++ = 0x01;
+  *p++ = 0xFF; *p++ = 0xFF; *p++ = 0xFF; *p++ = 0xFF;
+  *p++ = type;
+  *p++ = wireLength >> 8; *p++ = wireLength & 0xFF;
+  if (length)
+    memcpy(p, payload, length);
+  p += length;
+  uint16_t sum = type + (wireLength >> 8) + (wireLength & 0xFF);
+  for (uint8_t *q = &txBuffer[txTail + 9]; q < p; q++)
+    sum += *q;
+  *p++ = sum >> 8; *p++ = sum & 0xFF;
+  txTail += packetLength;
+  return true;
+}
+
+void R503Emulator::sendAck(uint8_t instruction, uint16_t commandLength, uint8_t code, const uint8_t *data, uint16_t length) {
+  uint8_t payload[R503_NOTEPAD_PAGE_SIZE + 2];
+  payload[0] = code;
+  if (length)
+    memcpy(&payload[1], data, length);
+
+  // response starts after the command has been transferred and processed
+  uint32_t bt = byteMicros();
+  if (!sendPacket(R503_ACKPACKET, payload, length + 1, commandLength * bt + commandMicros[instruction]))
+    return;
+
+  uint32_t roundTrip = (commandLength + 9 + length + 3) * bt + commandMicros[instruction];
+  R503CommandStats &s = stats[instruction];
+  s.count++;
+  s.totalMicros += roundTrip;
+  if (roundTrip > s.maxMicros)
+    s.maxMicros = roundTrip;
+}
+
+uint16_t R503Emulator::dataPacketSize() {
+  return 32 << packetSizeCode;
+}
+
+uint8_t R503Emulator::templateByte(uint16_t fingerId, uint16_t offset) {
+  switch (offset) {
+    case 0: return 'E';
+    case 1: return 'T';
+    case 2: return fingerId >> 8;
+    case 3: return fingerId & 0xFF;
+    default: return (fingerId * 31 + offset * 7) & 0xFF;
+  }
+}
+
+void R503Emulator::sendTemplateData() {
+  uint8_t payload[256];
+  while (upcharActive) {
+    uint16_t length = min((int)dataPacketSize(), R503_TEMPLATE_SIZE - upcharOffset);
+    for (uint16_t i=0; i<length; i++)
+      payload[i] = templateByte(upcharIdentity, upcharOffset + i);
+    bool last = (upcharOffset + length >= R503_TEMPLATE_SIZE);
+    if (!sendPacket(last ? R503_ENDDATAPACKET : R503_DATAPACKET, payload, length, 0))
+      return; // no room yet, continue when the host has read more
+    upcharOffset += length;
+    upcharActive = !last;
+  }
+}
+
+void R503Emulator::receiveTemplateData(const uint8_t *payload, uint16_t length, bool last) {
+  if (!downcharActive)
+    return;
+  for (uint16_t i=0; i<length; i++, downcharSize++) {
+    if (downcharSize == 2)
+      downcharIdentity = (uint16_t)payload[i] << 8;
+    else if (downcharSize == 3)
+      downcharIdentity |= payload[i];
+    if (downcharSize >= R503_TEMPLATE_SIZE || (downcharSize != 2 && downcharSize != 3 && payload[i] != templateByte(downcharIdentity, downcharSize)))
+      downcharValid = false;
+  }
+  if (last) {
+    downcharActive = false;
+    if (downcharValid && downcharSize == R503_TEMPLATE_SIZE)
+      charBuffer[downcharBuffer] = downcharIdentity;
+  }
+}
+
+uint8_t R503Emulator::search(uint8_t bufferId, uint16_t startPage, uint16_t pageCount, uint16_t *pageId, uint16_t *score) {
+  if (bufferId < 1 || bufferId > R503_CHAR_BUFFERS || charBuffer[bufferId] == 0)
+    return R503_NOTFOUND;
+  for (uint32_t page = startPage; page < (uint32_t)startPage + pageCount && page < capacity; page++) {
+    if (library[page] == charBuffer[bufferId]) {
+      *pageId = page;
+      *score = 50 + (library[page] * 37) % 150;
+      return R503_OK;
+    }
+  }
+  return R503_NOTFOUND;
+}
+
+void R503Emulator::handleCommand(const uint8_t *payload, uint16_t length) {
+  uint8_t instruction = payload[0];
+  uint16_t commandLength = 9 + length + 2;
+  uint8_t reply[R503_NOTEPAD_PAGE_SIZE + 1] = {};
+  uint16_t replyLength = 0;
+  uint8_t code = R503_OK;
+
+  switch (instruction) {
+    case R503_GETIMAGE:
+      takeFrame();
+      if (lastFrame == R503Frame::noFinger)
+        code = R503_NOFINGER;
+      break;
+
+    case R503_GENCHAR: {
+      uint8_t bufferId = payload[1];
+      if (bufferId < 1 || bufferId > R503_CHAR_BUFFERS) {
+        code = R503_PACKETRECIEVEERR;
+        break;
+      }
+      charBuffer[bufferId] = 0;
+      if (lastFrame == R503Frame::raindrop)
+        code = R503_IMAGEMESS;
+      else if (lastFrame == R503Frame::noFinger)
+        code = 0x15; // no valid primary image
+      else
+        charBuffer[bufferId] = lastFingerId;
+      break;
+    }
+
+    case R503_SEARCH:
+    case R503_HIGHSPEEDSEARCH: {
+      uint16_t pageId = 0, score = 0;
+      code = search(payload[1], ((uint16_t)payload[2] << 8) | payload[3], ((uint16_t)payload[4] << 8) | payload[5], &pageId, &score);
+      reply[0] = pageId >> 8; reply[1] = pageId & 0xFF;
+      reply[2] = score >> 8; reply[3] = score & 0xFF;
+      replyLength = 4;
+      break;
+    }
+
+    case R503_REGMODEL: {
+      // all feature buffers of the enrollment have to come from the same finger
+      uint16_t fingerId = 0;
+      uint8_t samples = 0;
+      for (int i=1; i<=R503_CHAR_BUFFERS; i++) {
+        if (charBuffer[i] == 0)
+          continue;
+        if (fingerId != 0 && charBuffer[i] != fingerId) {
+          fingerId = 0xFFFF;
+          break;
+        }
+        fingerId = charBuffer[i];
+        samples++;
+      }
+      if (fingerId == 0 || fingerId == 0xFFFF || samples < 2)
+        code = R503_ENROLLMISMATCH;
+      else
+        charBuffer[1] = fingerId;
+      break;
+    }
+
+    case R503_STORE: {
+      uint16_t page = ((uint16_t)payload[2] << 8) | payload[3];
+      if (page >= capacity)
+        code = R503_BADLOCATION;
+      else
+        library[page] = charBuffer[payload[1] <= R503_CHAR_BUFFERS ? payload[1] : 1];
+      break;
+    }
+
+    case R503_LOADCHAR: {
+      uint16_t page = ((uint16_t)payload[2] << 8) | payload[3];
+      if (page >= capacity || payload[1] < 1 || payload[1] > R503_CHAR_BUFFERS)
+        code = R503_BADLOCATION;
+      else if (library[page] == 0)
+        code = 0x0C; // error when reading template from library
+      else
+        charBuffer[payload[1]] = library[page];
+      break;
+    }
+
+    case R503_UPCHAR:
+      if (payload[1] < 1 || payload[1] > R503_CHAR_BUFFERS || charBuffer[payload[1]] == 0) {
+        code = 0x0D; // error when uploading template
+      } else {
+        upcharIdentity = charBuffer[payload[1]];
+        upcharOffset = 0;
+        upcharActive = true;
+      }
+      break;
+
+    case R503_DOWNCHAR:
+      if (payload[1] < 1 || payload[1] > R503_CHAR_BUFFERS) {
+        code = 0x0E; // cannot receive the following data packets
+      } else {
+        downcharBuffer = payload[1];
+        charBuffer[downcharBuffer] = 0;
+        downcharIdentity = 0;
+        downcharSize = 0;
+        downcharValid = true;
+        downcharActive = true;
+      }
+      break;
+
+    case R503_READINDEXTABLE:
+      // one bit per page, 256 pages per index page
+      memset(reply, 0, 32);
+      for (uint16_t i=0; i<256; i++) {
+        uint16_t page = payload[1] * 256 + i;
+        if (page < capacity && library[page] != 0)
+          reply[i / 8] |= 1 << (i % 8);
+      }
+      replyLength = 32;
+      break;
+
+    case R503_DELETCHAR: {
+      uint16_t page = ((uint16_t)payload[1] << 8) | payload[2];
+      uint16_t count = ((uint16_t)payload[3] << 8) | payload[4];
+      if ((uint32_t)page + count > capacity)
+        code = 0x10; // failed to delete templates
+      else
+        memset(&library[page], 0, count * sizeof(library[0]));
+      break;
+    }
+
+    case R503_EMPTY:
+      memset(library, 0, sizeof(library));
+      break;
+
+    case R503_SETSYSPARA:
+      switch (payload[1]) {
+        case 4: // baud rate control, N * 9600
+          if (payload[2] < 1 || payload[2] > 12)
+            code = R503_INVALIDREG;
+          break;
+        case 5: // security level
+          if (payload[2] < 1 || payload[2] > 5)
+            code = R503_INVALIDREG;
+          else
+            securityLevel = payload[2];
+          break;
+        case 6: // data package length
+          if (payload[2] > 3)
+            code = R503_INVALIDREG;
+          else
+            packetSizeCode = payload[2];
+          break;
+        default:
+          code = R503_INVALIDREG;
+      }
+      break;
+
+    case R503_READSYSPARA:
+      memset(reply, 0, 16);
+      reply[4] = capacity >> 8; reply[5] = capacity & 0xFF;
+      reply[7] = securityLevel;
+      reply[8] = 0xFF; reply[9] = 0xFF; reply[10] = 0xFF; reply[11] = 0xFF; // device address
+      reply[13] = packetSizeCode;
+      reply[15] = baudRate / 9600;
+      replyLength = 16;
+      break;
+
+    case R503_VFYPWD: {
+      uint32_t given = ((uint32_t)payload[1] << 24) | ((uint32_t)payload[2] << 16) | ((uint32_t)payload[3] << 8) | payload[4];
+      if (given != password)
+        code = R503_PASSFAIL;
+      break;
+    }
+
+    case R503_WRITENOTEPAD:
+      if (payload[1] >= R503_NOTEPAD_PAGES)
+        code = R503_PACKETRECIEVEERR;
+      else
+        memcpy(notepad[payload[1]], &payload[2], R503_NOTEPAD_PAGE_SIZE);
+      break;
+
+    case R503_READNOTEPAD:
+      if (payload[1] >= R503_NOTEPAD_PAGES) {
+        code = R503_PACKETRECIEVEERR;
+      } else {
+        memcpy(reply, notepad[payload[1]], R503_NOTEPAD_PAGE_SIZE);
+        replyLength = R503_NOTEPAD_PAGE_SIZE;
+      }
+      break;
+
+    case R503_TEMPLATENUM: {
+      uint16_t count = 0;
+      for (uint16_t i=0; i<capacity; i++)
+        if (library[i] != 0)
+          count++;
+      reply[0] = count >> 8; reply[1] = count & 0xFF;
+      replyLength = 2;
+      break;
+    }
+
+    case R503_AURALEDCONFIG:
+      break;
+
+    case R503_SLEEP:
+      // the real sensor wakes up on touch, the emulator just answers the next command
+      break;
+
+    default:
+      code = R503_PACKETRECIEVEERR;
+  }
+
+  sendAck(instruction, commandLength, code, reply, replyLength);
+  sendTemplateData();
+
+  // a new baud rate takes effect after the acknowledge was sent with the old one
+  if (instruction == R503_SETSYSPARA && payload[1] == 4 && code == R503_OK)
+    baudRate = payload[2] * 9600UL;
+}
+
+
+///////////////////////////////////////////////////////////
+// Stream
+///////////////////////////////////////////////////////////
+
+int R503Emulator::available() {
+  sendTemplateData();
+  return txReadyCount();
+}
+
+int R503Emulator::read() {
+  sendTemplateData();
+  if (txReadyCount() == 0)
+    return -1;
+  return txBuffer[txHead++];
+}
+
+int R503Emulator::peek() {
+  sendTemplateData();
+  if (txReadyCount() == 0)
+    return -1;
+  return txBuffer[txHead];
+}
+
+size_t R503Emulator::write(uint8_t data) {
+  receiveByte(data);
+  return 1;
+}
+
+void R503Emulator::flush() {
+}
@@ -0,0 +1,162 @@
+#ifndef R503EMULATOR_H
+#define R503EMULATOR_H
+
+#include <Arduino.h>
+
+/*
+  Software emulation of a Grow R503 fingerprint sensor on packet level. It is a Stream, so it can be plugged into
+  FingerprintManager instead of the UART. Command and response packets are timed as if they were transferred at the
+  emulated baud rate, plus a configurable processing time per instruction.
+
+  What the "finger" on the sensor does is controlled by a script of frames, each getImage() consumes one frame:
+    N      no finger
+    R      raindrop (image can be taken, but no features can be extracted)
+    F<id>  finger with the given identity, e.g. F3. A finger matches if a template of the same identity is stored.
+  Every token can be repeated with *<count>, tokens are separated by blanks or commas, e.g. "N*10 F3*4 N R*2".
+  If the script is exhausted no finger is on the sensor.
+
+  Templates can be transferred with UpChar/DownChar. Their content is generated from the finger identity, so a template
+  exported from one emulator and imported into another one matches the same finger.
+*/
+
+#define R503_MAX_CAPACITY 200
+#define R503_NOTEPAD_PAGES 16
+#define R503_NOTEPAD_PAGE_SIZE 32
+#define R503_CHAR_BUFFERS 6
+#define R503_MAX_SCRIPT_STEPS 32
+#define R503_RX_BUFFER_SIZE 160
+#define R503_TX_BUFFER_SIZE 256
+#define R503_TEMPLATE_SIZE 1536
+
+// instruction codes
+#define R503_GETIMAGE 0x01
+#define R503_GENCHAR 0x02
+#define R503_SEARCH 0x04
+#define R503_REGMODEL 0x05
+#define R503_STORE 0x06
+#define R503_LOADCHAR 0x07
+#define R503_UPCHAR 0x08
+#define R503_DOWNCHAR 0x09
+#define R503_DELETCHAR 0x0C
+#define R503_EMPTY 0x0D
+#define R503_SETSYSPARA 0x0E
+#define R503_READSYSPARA 0x0F
+#define R503_VFYPWD 0x13
+#define R503_WRITENOTEPAD 0x18
+#define R503_READNOTEPAD 0x19
+#define R503_HIGHSPEEDSEARCH 0x1B
+#define R503_TEMPLATENUM 0x1D
+#define R503_READINDEXTABLE 0x1F
+#define R503_SLEEP 0x33
+#define R503_AURALEDCONFIG 0x35
+
+// confirmation codes
+#define R503_OK 0x00
+#define R503_PACKETRECIEVEERR 0x01
+#define R503_NOFINGER 0x02
+#define R503_IMAGEMESS 0x06
+#define R503_NOTFOUND 0x09
+#define R503_ENROLLMISMATCH 0x0A
+#define R503_BADLOCATION 0x0B
+#define R503_PASSFAIL 0x13
+#define R503_INVALIDREG 0x1A
+
+// packet identifiers
+#define R503_COMMANDPACKET 0x01
+#define R503_DATAPACKET 0x02
+#define R503_ACKPACKET 0x07
+#define R503_ENDDATAPACKET 0x08
+
+enum class R503Frame : uint8_t { noFinger, raindrop, finger };
+
+struct R503ScriptStep {
+  R503Frame frame = R503Frame::noFinger;
+  uint16_t fingerId = 0;
+  uint16_t count = 0;
+};
+
+struct R503CommandStats {
+  uint32_t count = 0;
+  uint32_t totalMicros = 0; // emulated round trip: command transfer + processing + response transfer
+  uint32_t maxMicros = 0;
+};
+
+class R503Emulator : public Stream {
+  private:
+    uint16_t capacity;
+    uint32_t baudRate;
+    uint32_t password = 0;
+    uint8_t securityLevel = 3;
+    uint8_t packetSizeCode = 2; // 0=32, 1=64, 2=128, 3=256 bytes
+
+    uint16_t library[R503_MAX_CAPACITY + 1]; // finger identity stored per page, 0 = empty
+    uint16_t charBuffer[R503_CHAR_BUFFERS + 1]; // finger identity per character buffer, 0 = empty/no features
+    uint8_t notepad[R503_NOTEPAD_PAGES][R503_NOTEPAD_PAGE_SIZE];
+    R503Frame lastFrame = R503Frame::noFinger;
+    uint16_t lastFingerId = 0;
+
+    R503ScriptStep script[R503_MAX_SCRIPT_STEPS];
+    uint8_t scriptHead = 0;
+    uint8_t scriptLength = 0;
+
+    uint32_t commandMicros[256]; // processing time per instruction code
+    R503CommandStats stats[256];
+
+    uint8_t rxBuffer[R503_RX_BUFFER_SIZE];
+    uint16_t rxLength = 0;
+
+    uint8_t txBuffer[R503_TX_BUFFER_SIZE];
+    uint16_t txHead = 0;
+    uint16_t txTail = 0;
+    uint32_t txScheduleStart = 0; // arrival time of byte txScheduleIndex
+    int32_t txScheduleIndex = 0;
+
+    // UpChar: data packets are generated as the host reads them, the tx buffer is smaller than a template
+    uint16_t upcharIdentity = 0;
+    uint16_t upcharOffset = 0;
+    bool upcharActive = false;
+
+    // DownChar: data packets received from the host
+    uint8_t downcharBuffer = 0;
+    uint16_t downcharIdentity = 0;
+    uint16_t downcharSize = 0;
+    bool downcharValid = false;
+    bool downcharActive = false;
+
+    uint32_t byteMicros();
+    uint16_t txReadyCount();
+    void receiveByte(uint8_t data);
+    void handleCommand(const uint8_t *payload, uint16_t length);
+    bool sendPacket(uint8_t type, const uint8_t *payload, uint16_t length, uint32_t delayMicros);
+    void sendAck(uint8_t instruction, uint16_t commandLength, uint8_t code, const uint8_t *data, uint16_t length);
+    void sendTemplateData();
+    void receiveTemplateData(const uint8_t *payload, uint16_t length, bool last);
+    uint8_t templateByte(uint16_t fingerId, uint16_t offset);
+    uint16_t dataPacketSize();
+    void takeFrame();
+    uint8_t search(uint8_t bufferId, uint16_t startPage, uint16_t pageCount, uint16_t *pageId, uint16_t *score);
+
+  public:
+    R503Emulator(uint16_t capacity = R503_MAX_CAPACITY, uint32_t baudRate = 57600);
+
+    // scripting
+    void queueFrames(R503Frame frame, uint16_t count = 1, uint16_t fingerId = 0);
+    bool loadScript(const char *script);
+    void clearScript();
+    void storeTemplate(uint16_t page, uint16_t fingerId);
+    void setCommandMicros(uint8_t instruction, uint32_t micros);
+
+    uint32_t getBaudRate();
+    void printStats(Print &out);
+    void resetStats();
+
+    // Stream
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t data) override;
+    using Print::write;
+    void flush() override;
+};
+
+#endif
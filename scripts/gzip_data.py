@@ -0,0 +1,31 @@
+# PlatformIO pre-script: the filesystem image is built from gzipped copies of the files in data/, the webserver sends
+# them as they are with "Content-Encoding: gzip" (see serveAsset() in src/main.cpp).
+import gzip
+import os
+import shutil
+
+Import("env")
+
+source_dir = env.subst("$PROJECT_DATA_DIR")
+target_dir = os.path.join(env.subst("$BUILD_DIR"), "data_gz")
+
+
+def gzip_data():
+    if os.path.isdir(target_dir):
+        shutil.rmtree(target_dir)
+    os.makedirs(target_dir)
+    for root, _, files in os.walk(source_dir):
+        for name in files:
+            source = os.path.join(root, name)
+            target = os.path.join(target_dir, os.path.relpath(source, source_dir)) + ".gz"
+            os.makedirs(os.path.dirname(target), exist_ok=True)
+            with open(source, "rb") as f:
+                data = f.read()
+            # mtime=0 keeps the output and with it the ETag stable as long as the file does not change
+            with open(target, "wb") as f:
+                f.write(gzip.compress(data, compresslevel=9, mtime=0))
+            print("gzip %s: %d -> %d bytes" % (name, len(data), os.path.getsize(target)))
+
+
+gzip_data()
+env.Replace(PROJECT_DATA_DIR=target_dir)
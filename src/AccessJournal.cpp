@@ -0,0 +1,285 @@
+#include "AccessJournal.h"
+
+#include <rom/crc.h>
+#include <stddef.h>
+#include <algorithm>
+
+AccessJournal::AccessJournal(fs::FS &fs, const char *directory) : fs(fs), directory(directory) {
+  mutex = xSemaphoreCreateMutex();
+}
+
+void AccessJournal::segmentPath(uint32_t sequence, char *path, size_t size) {
+  snprintf(path, size, "%s/%08x", directory, sequence);
+}
+
+static uint16_t recordCrc(const JournalRecord &record) {
+  return crc16_le(0, (const uint8_t*)&record, offsetof(JournalRecord, crc));
+}
+
+bool AccessJournal::begin() {
+  // SPIFFS has no directories, the segments are the files whose path starts with the directory
+  uint32_t sequences[JOURNAL_SEGMENTS * 2];
+  int found = 0;
+  size_t directoryLength = strlen(directory);
+  File root = fs.open("/");
+  if (root) {
+    File file;
+    while ((file = root.openNextFile())) {
+      const char *name = file.name();
+      uint32_t sequence = 0;
+      if (strncmp(name, directory, directoryLength) == 0 && name[directoryLength] == '/')
+        sequence = strtoul(name + directoryLength + 1, NULL, 16);
+      file.close();
+      if (sequence == 0)
+        continue;
+      if (found == JOURNAL_SEGMENTS * 2) { // left over from a larger JOURNAL_SEGMENTS, keep the newest
+        std::sort(sequences, sequences + found);
+        char path[32];
+        segmentPath(sequences[0], path, sizeof(path));
+        fs.remove(path);
+        sequences[0] = sequence;
+      } else {
+        sequences[found++] = sequence;
+      }
+    }
+    root.close();
+  }
+  std::sort(sequences, sequences + found);
+
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  segmentCount = 0;
+  bool lastComplete = false;
+  for (int i=0; i<found; i++) {
+    char path[32];
+    segmentPath(sequences[i], path, sizeof(path));
+    if (i < found - JOURNAL_SEGMENTS) {
+      fs.remove(path);
+      continue;
+    }
+    File file = fs.open(path);
+    JournalSegment segment = { sequences[i], 0, 0, (uint16_t)min(file.size() / sizeof(JournalRecord), (size_t)JOURNAL_SEGMENT_RECORDS) };
+    lastComplete = (file.size() % sizeof(JournalRecord) == 0);
+    JournalRecord first, last;
+    bool ok = segment.records > 0 && readRecord(file, 0, first) && readRecord(file, segment.records - 1, last);
+    file.close();
+    if (!ok) {
+      fs.remove(path);
+      continue;
+    }
+    segment.firstTime = first.time;
+    segment.lastTime = last.time;
+    segments[segmentCount++] = segment;
+  }
+  // go on with the last segment, unless a power loss left half a record at its end
+  if (segmentCount > 0 && lastComplete && segments[segmentCount - 1].records < JOURNAL_SEGMENT_RECORDS) {
+    char path[32];
+    segmentPath(segments[segmentCount - 1].sequence, path, sizeof(path));
+    appendFile = fs.open(path, FILE_APPEND);
+  }
+  ready = true;
+  uint32_t records = 0;
+  for (int i=0; i<segmentCount; i++)
+    records += segments[i].records;
+  xSemaphoreGive(mutex);
+  Serial.printf("Access journal: %u records in %u segments\n", records, segmentCount);
+  return true;
+}
+
+bool AccessJournal::startSegment(uint32_t time) {
+  if (appendFile)
+    appendFile.close();
+  uint32_t sequence = segmentCount ? segments[segmentCount - 1].sequence + 1 : 1;
+  char path[32];
+  if (segmentCount == JOURNAL_SEGMENTS) {
+    segmentPath(segments[0].sequence, path, sizeof(path));
+    fs.remove(path);
+    memmove(segments, segments + 1, (JOURNAL_SEGMENTS - 1) * sizeof(JournalSegment));
+    segmentCount--;
+  }
+  segmentPath(sequence, path, sizeof(path));
+  appendFile = fs.open(path, FILE_WRITE);
+  if (!appendFile)
+    return false;
+  segments[segmentCount++] = { sequence, time, time, 0 };
+  return true;
+}
+
+bool AccessJournal::append(uint32_t time, bool timeValid, ScanResult result, uint16_t matchId, uint16_t confidence, uint8_t returnCode) {
+  if (!ready)
+    return false;
+  StageTimer timer(appendLatency);
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  JournalRecord record;
+  record.result = (uint8_t)result;
+  // times must not decrease, otherwise the index doesn't work
+  uint32_t lastTime = segmentCount ? segments[segmentCount - 1].lastTime : 0;
+  if (!timeValid || time < lastTime) {
+    time = lastTime;
+    record.result |= JOURNAL_TIME_ESTIMATED;
+  }
+  record.time = time;
+  record.matchId = matchId;
+  record.confidence = confidence;
+  record.returnCode = returnCode;
+  record.crc = recordCrc(record);
+
+  bool ok = true;
+  if (!appendFile || segments[segmentCount - 1].records >= JOURNAL_SEGMENT_RECORDS)
+    ok = startSegment(time);
+  if (ok) {
+    ok = (appendFile.write((const uint8_t*)&record, sizeof(record)) == sizeof(record));
+    appendFile.flush();
+  }
+  if (ok) {
+    JournalSegment &segment = segments[segmentCount - 1];
+    if (segment.records == 0)
+      segment.firstTime = time;
+    segment.lastTime = time;
+    segment.records++;
+  } else {
+    appendErrors++;
+    if (appendFile)
+      appendFile.close(); // a new segment is started with the next record
+  }
+  xSemaphoreGive(mutex);
+  return ok;
+}
+
+void AccessJournal::clear() {
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  if (appendFile)
+    appendFile.close();
+  for (int i=0; i<segmentCount; i++) {
+    char path[32];
+    segmentPath(segments[i].sequence, path, sizeof(path));
+    fs.remove(path);
+  }
+  segmentCount = 0;
+  xSemaphoreGive(mutex);
+}
+
+JournalSegment *AccessJournal::findSegment(uint32_t sequence) {
+  for (int i=0; i<segmentCount; i++)
+    if (segments[i].sequence == sequence)
+      return &segments[i];
+  return NULL;
+}
+
+bool AccessJournal::readRecord(File &file, uint16_t index, JournalRecord &record) {
+  return file.seek(index * sizeof(JournalRecord)) && file.read((uint8_t*)&record, sizeof(record)) == sizeof(record);
+}
+
+uint16_t AccessJournal::lowerBound(File &file, uint16_t records, uint32_t time) {
+  uint16_t low = 0;
+  uint16_t high = records;
+  JournalRecord record;
+  while (low < high) {
+    uint16_t middle = (low + high) / 2;
+    if (readRecord(file, middle, record) && record.time < time)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return low;
+}
+
+JournalCursor AccessJournal::query(uint32_t from, uint32_t to) {
+  JournalCursor cursor;
+  cursor.from = from;
+  cursor.to = to;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  for (int i=0; i<segmentCount; i++) {
+    JournalSegment &segment = segments[i];
+    if (segment.lastTime < from)
+      continue; // the whole segment is before the range
+    if (segment.firstTime > to)
+      break;
+    cursor.sequence = segment.sequence;
+    cursor.done = false;
+    if (segment.firstTime < from) {
+      char path[32];
+      segmentPath(segment.sequence, path, sizeof(path));
+      File file = fs.open(path);
+      cursor.index = lowerBound(file, segment.records, from);
+      file.close();
+    }
+    break;
+  }
+  xSemaphoreGive(mutex);
+  return cursor;
+}
+
+size_t AccessJournal::read(JournalCursor &cursor, JournalRecord *records, size_t maxRecords) {
+  size_t count = 0;
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  while (count < maxRecords && !cursor.done) {
+    JournalSegment *segment = findSegment(cursor.sequence);
+    if (segment == NULL) {
+      // deleted by the rotation while the range was read, go on with the oldest one left
+      if (segmentCount > 0 && segments[0].sequence > cursor.sequence) {
+        cursor.sequence = segments[0].sequence;
+        cursor.index = 0;
+      } else {
+        cursor.done = true;
+      }
+      continue;
+    }
+    if (cursor.index >= segment->records) {
+      if (segment == &segments[segmentCount - 1])
+        break; // at the end for now, more records may follow
+      cursor.sequence = segment[1].sequence;
+      cursor.index = 0;
+      continue;
+    }
+
+    char path[32];
+    segmentPath(segment->sequence, path, sizeof(path));
+    File file = fs.open(path);
+    size_t n = min(maxRecords - count, (size_t)(segment->records - cursor.index));
+    n = (file && file.seek(cursor.index * sizeof(JournalRecord))) ? file.read((uint8_t*)(records + count), n * sizeof(JournalRecord)) / sizeof(JournalRecord) : 0;
+    file.close();
+    if (n == 0) {
+      cursor.done = true;
+      break;
+    }
+    cursor.index += n;
+    size_t start = count;
+    for (size_t i=0; i<n; i++) {
+      JournalRecord &record = records[start + i];
+      if (record.time > cursor.to) {
+        cursor.done = true;
+        break;
+      }
+      if (record.crc == recordCrc(record))
+        records[count++] = record;
+    }
+  }
+  if (count == 0)
+    cursor.done = true;
+  xSemaphoreGive(mutex);
+  return count;
+}
+
+uint32_t AccessJournal::getRecordCount() {
+  xSemaphoreTake(mutex, portMAX_DELAY);
+  uint32_t records = 0;
+  for (int i=0; i<segmentCount; i++)
+    records += segments[i].records;
+  xSemaphoreGive(mutex);
+  return records;
+}
+
+size_t AccessJournal::getSize() {
+  return getRecordCount() * sizeof(JournalRecord);
+}
+
+void AccessJournal::printMetrics(Print &out) {
+  printMetricHeader(out, "doorbell_journal_records", "gauge", "Scan events in the access journal.");
+  printMetric(out, "doorbell_journal_records", "", getRecordCount());
+  printMetricHeader(out, "doorbell_journal_segments", "gauge", "Segment files of the access journal.");
+  printMetric(out, "doorbell_journal_segments", "", segmentCount);
+  printMetricHeader(out, "doorbell_journal_append_seconds", "histogram", "Appending a record to the access journal.");
+  appendLatency.print(out, "doorbell_journal_append_seconds", "");
+  printMetricHeader(out, "doorbell_journal_append_errors_total", "counter", "Records that could not be written.");
+  printMetric(out, "doorbell_journal_append_errors_total", "", appendErrors);
+}
@@ -0,0 +1,77 @@
+#ifndef ACCESSJOURNAL_H
+#define ACCESSJOURNAL_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include "FingerprintManager.h"
+#include "Metrics.h"
+
+#define JOURNAL_SEGMENT_RECORDS 1024 // 12 KB per segment file
+#define JOURNAL_SEGMENTS 8 // the oldest segment is deleted when a new one would exceed this
+#define JOURNAL_TIME_ESTIMATED 0x80 // in JournalRecord.result: clock was not set, time is the one of the record before
+
+struct __attribute__((packed)) JournalRecord {
+  uint32_t time; // unix time
+  uint16_t matchId;
+  uint16_t confidence;
+  uint8_t result; // ScanResult, plus JOURNAL_TIME_ESTIMATED
+  uint8_t returnCode;
+  uint16_t crc; // of the fields above, a record torn by a power loss is skipped
+};
+
+struct JournalSegment {
+  uint32_t sequence; // file name
+  uint32_t firstTime;
+  uint32_t lastTime;
+  uint16_t records;
+};
+
+// position of a time range query, advanced by AccessJournal::read()
+struct JournalCursor {
+  uint32_t from = 0;
+  uint32_t to = 0;
+  uint32_t sequence = 0; // segment
+  uint16_t index = 0; // record in the segment
+  bool done = true;
+};
+
+/*
+  Append-only journal of scan events on the filesystem. Records are appended to segment files of fixed size and the
+  oldest segment is deleted once there are JOURNAL_SEGMENTS of them, so the journal never takes more than
+  JOURNAL_SEGMENTS * JOURNAL_SEGMENT_RECORDS records. Writing whole segments and deleting them at once keeps SPIFFS'
+  own wear levelling effective. Times never decrease, so the first and last time of each segment (kept in RAM) and a
+  binary search inside the segment find the start of a time range without reading the whole journal. Thread-safe.
+*/
+class AccessJournal {
+  private:
+    fs::FS &fs;
+    const char *directory;
+    JournalSegment segments[JOURNAL_SEGMENTS]; // oldest first
+    uint8_t segmentCount = 0;
+    File appendFile; // of the last segment
+    SemaphoreHandle_t mutex = NULL;
+    bool ready = false;
+    LatencyHistogram appendLatency;
+    uint32_t appendErrors = 0;
+
+    void segmentPath(uint32_t sequence, char *path, size_t size);
+    bool startSegment(uint32_t time);
+    JournalSegment *findSegment(uint32_t sequence);
+    bool readRecord(File &file, uint16_t index, JournalRecord &record);
+    uint16_t lowerBound(File &file, uint16_t records, uint32_t time); // first record at or after time
+
+  public:
+    AccessJournal(fs::FS &fs, const char *directory);
+    bool begin(); // reads the segment index, the filesystem must be mounted
+    bool append(uint32_t time, bool timeValid, ScanResult result, uint16_t matchId, uint16_t confidence, uint8_t returnCode);
+    void clear(); // deletes all segments
+
+    JournalCursor query(uint32_t from, uint32_t to); // records with from <= time <= to, oldest first
+    size_t read(JournalCursor &cursor, JournalRecord *records, size_t maxRecords); // 0 once the range is done
+
+    uint32_t getRecordCount();
+    size_t getSize(); // bytes on the filesystem
+    void printMetrics(Print &out); // Prometheus text format
+};
+
+#endif
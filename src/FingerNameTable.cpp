@@ -0,0 +1,176 @@
+#include "FingerNameTable.h"
+
+FingerNameTable::~FingerNameTable() {
+  free(offsets);
+  free(occupied);
+  free(arena);
+}
+
+bool FingerNameTable::begin(uint16_t slots) {
+  free(offsets);
+  free(occupied);
+  free(arena);
+  count = 0;
+  arenaSize = (uint16_t)min((uint32_t)slots * FINGER_NAME_ARENA_BYTES_PER_SLOT, (uint32_t)UINT16_MAX);
+  offsets = (uint16_t*)calloc(slots + 1, sizeof(uint16_t));
+  occupied = (uint32_t*)calloc((slots + 31) / 32, sizeof(uint32_t));
+  arena = (char*)malloc(arenaSize);
+  if (!offsets || !occupied || !arena) {
+    Serial.println("Not enough memory for the finger name table");
+    this->slots = 0;
+    return false;
+  }
+  this->slots = slots;
+  return true;
+}
+
+uint16_t FingerNameTable::getSlots() {
+  return slots;
+}
+
+uint16_t FingerNameTable::getCount() {
+  return count;
+}
+
+size_t FingerNameTable::getMemoryUsage() {
+  if (!slots)
+    return 0;
+  return (slots + 1) * sizeof(uint16_t) + (slots + 31) / 32 * sizeof(uint32_t) + arenaSize;
+}
+
+bool FingerNameTable::isOccupied(uint16_t id) {
+  return (id < slots) && (occupied[id / 32] & (1u << (id % 32)));
+}
+
+void FingerNameTable::resize(uint16_t id, uint16_t length) {
+  uint16_t start = offsets[id];
+  uint16_t end = offsets[id + 1];
+  int delta = (int)length - (end - start);
+  if (delta == 0)
+    return;
+  memmove(arena + start + length, arena + end, offsets[slots] - end);
+  for (uint16_t i=id+1; i<=slots; i++)
+    offsets[i] += delta;
+}
+
+bool FingerNameTable::grow(size_t needed) {
+  // the names are packed, so growing is the only way to make room. Offsets are 16 bit, which still holds
+  // FINGER_NAME_MAX_LENGTH bytes for each slot of sensors up to 1000 slots.
+  size_t size = min(max(needed, (size_t)arenaSize * 2), (size_t)UINT16_MAX);
+  if (size < needed)
+    return false;
+  char *grown = (char*)realloc(arena, size);
+  if (!grown)
+    return false;
+  arena = grown;
+  arenaSize = size;
+  return true;
+}
+
+// length of text cut to at most maxLength bytes without splitting a UTF-8 character
+static size_t wholeCharacters(const char *text, size_t length, size_t maxLength) {
+  if (length <= maxLength)
+    return length;
+  length = maxLength;
+  while (length > 0 && (text[length] & 0xC0) == 0x80) // continuation byte, the character starts before the cut
+    length--;
+  return length;
+}
+
+bool FingerNameTable::set(uint16_t id, const char *name) {
+  if (id >= slots)
+    return false;
+  size_t fullLength = strnlen(name, FINGER_NAME_MAX_LENGTH + 1);
+  size_t length = wholeCharacters(name, fullLength, FINGER_NAME_MAX_LENGTH);
+  size_t used = offsets[slots] - (offsets[id + 1] - offsets[id]); // without the old name of id
+  if (used + length > arenaSize)
+    grow(used + length);
+  length = wholeCharacters(name, length, arenaSize - used);
+  bool fits = (length == fullLength);
+  resize(id, length);
+  memcpy(arena + offsets[id], name, length);
+  if (!isOccupied(id)) {
+    occupied[id / 32] |= (1u << (id % 32));
+    count++;
+  }
+  return fits;
+}
+
+void FingerNameTable::clear(uint16_t id) {
+  if (!isOccupied(id))
+    return;
+  resize(id, 0);
+  occupied[id / 32] &= ~(1u << (id % 32));
+  count--;
+}
+
+void FingerNameTable::clearAll() {
+  if (!slots)
+    return;
+  memset(offsets, 0, (slots + 1) * sizeof(uint16_t));
+  memset(occupied, 0, (slots + 31) / 32 * sizeof(uint32_t));
+  count = 0;
+}
+
+size_t FingerNameTable::copy(uint16_t id, char *name, size_t size) {
+  if (size == 0)
+    return 0;
+  size_t length = 0;
+  if (isOccupied(id)) {
+    length = min((size_t)(offsets[id + 1] - offsets[id]), size - 1);
+    memcpy(name, arena + offsets[id], length);
+  }
+  name[length] = '\0';
+  return length;
+}
+
+int FingerNameTable::next(int id) {
+  int i = id + 1;
+  while (i < slots) {
+    uint32_t bits = occupied[i / 32] >> (i % 32);
+    if (bits)
+      return i + __builtin_ctz(bits); // bits beyond the last slot are never set
+    i = (i / 32 + 1) * 32;
+  }
+  return -1;
+}
+
+size_t FingerNameTable::getSerializedSize() {
+  if (!slots)
+    return 0;
+  return count * 3 + offsets[slots];
+}
+
+size_t FingerNameTable::serialize(uint8_t *data) {
+  uint8_t *p = data;
+  for (int id = next(-1); id >= 0; id = next(id)) {
+    uint8_t length = offsets[id + 1] - offsets[id];
+    *p++ = id & 0xFF;
+    *p++ = id >> 8;
+    *p++ = length;
+    memcpy(p, arena + offsets[id], length);
+    p += length;
+  }
+  return p - data;
+}
+
+bool FingerNameTable::deserialize(const uint8_t *data, size_t length) {
+  clearAll();
+  char name[FINGER_NAME_MAX_LENGTH + 1];
+  size_t i = 0;
+  while (i + 3 <= length) {
+    uint16_t id = data[i] | (data[i + 1] << 8);
+    uint8_t nameLength = data[i + 2];
+    i += 3;
+    if (nameLength > FINGER_NAME_MAX_LENGTH || i + nameLength > length)
+      return false;
+    memcpy(name, data + i, nameLength);
+    name[nameLength] = '\0';
+    i += nameLength;
+    if (id < slots)
+      set(id, name);
+    else
+      Serial.printf("Name of finger #%u dropped, the sensor has no such slot.\n", id);
+  }
+  return i == length;
+}
@@ -0,0 +1,47 @@
+#ifndef FINGERNAMETABLE_H
+#define FINGERNAMETABLE_H
+
+#include <Arduino.h>
+
+#define FINGER_NAME_MAX_LENGTH 64 // bytes, longer names are shortened to the last whole UTF-8 character
+#define FINGER_NAME_ARENA_BYTES_PER_SLOT 16 // average name length the arena is sized for at first, it grows when full
+
+/*
+  Names of the enrolled fingers, packed into one arena that is allocated for the capacity of the sensor and grows once
+  the names don't fit any more. The name of id i is arena[offsets[i]..offsets[i+1]), without terminating zero.
+  Whether a slot is in use is kept in a bitmap, so a finger may have an empty name. Not thread-safe,
+  FingerprintManager guards it with a mutex.
+*/
+class FingerNameTable {
+  private:
+    uint16_t slots = 0; // ids 0..slots-1
+    uint16_t count = 0; // occupied slots
+    uint16_t *offsets = NULL; // slots+1 entries
+    uint32_t *occupied = NULL;
+    char *arena = NULL;
+    uint16_t arenaSize = 0;
+
+    void resize(uint16_t id, uint16_t length); // moves the names behind id
+    bool grow(size_t needed); // arena for at least needed bytes of names
+
+  public:
+    ~FingerNameTable();
+    bool begin(uint16_t slots); // drops all names
+    uint16_t getSlots();
+    uint16_t getCount();
+    size_t getMemoryUsage(); // bytes allocated for the table
+
+    bool isOccupied(uint16_t id);
+    bool set(uint16_t id, const char *name); // false if the name was shortened: too long or the arena could not grow
+    void clear(uint16_t id);
+    void clearAll();
+    size_t copy(uint16_t id, char *name, size_t size); // zero terminated, returns the length copied
+    int next(int id); // next occupied id after id, -1 if there is none. Start with next(-1).
+
+    // records of all occupied slots: id (uint16, little endian), name length (uint8), name
+    size_t getSerializedSize();
+    size_t serialize(uint8_t *data); // data must hold getSerializedSize() bytes
+    bool deserialize(const uint8_t *data, size_t length); // replaces all names, false if the records are malformed
+};
+
+#endif
@@ -1,7 +1,19 @@
 #include "FingerprintManager.h"
+#include "LogBuffer.h"
 #include "global.h"
 
 #include <Adafruit_Fingerprint.h>
+#include <esp_timer.h>
+#include <rom/crc.h>
+#include <algorithm>
+
+FingerprintManager::FingerprintManager(HardwareSerial *sensorSerial) : sensorLink(sensorSerial), finger(&sensorLink) {
+  fingerNamesMutex = xSemaphoreCreateMutex();
+}
+
+FingerprintManager::FingerprintManager(Stream *sensorStream) : sensorLink(sensorStream), finger(&sensorLink) {
+  fingerNamesMutex = xSemaphoreCreateMutex();
+}
 
 bool FingerprintManager::connect() {
   
@@ -10,32 +22,40 @@ bool FingerprintManager::connect() {
 
     Serial.println("\n\nAdafruit finger detect test");
 
-    // set the data rate for the sensor serial port
-    finger.begin(57600);
-    delay(50);
-    if (finger.verifyPassword()) {
-        Serial.println("Found fingerprint sensor!");
+    // try the rate negotiated last time first, a new sensor always starts with the default rate
+    uint32_t savedBaudRate = loadSensorBaudRate();
+    sensorLink.begin(savedBaudRate);
+    // poll instead of waiting a fixed time for the sensor to boot up, a sensor that kept its power (e.g. after an
+    // OTA update) answers right away. A silent sensor costs the library's receive timeout per probe.
+    unsigned long probeStart = millis();
+    bool found;
+    while (!(found = probeBaudRate(savedBaudRate) || (savedBaudRate != SENSOR_DEFAULT_BAUDRATE && probeBaudRate(SENSOR_DEFAULT_BAUDRATE)))
+      && millis() - probeStart < SENSOR_CONNECT_TIMEOUT_MS)
+      delay(SENSOR_PROBE_INTERVAL_MS);
+    if (found) {
+        Serial.println(String("Found fingerprint sensor after ") + (millis() - probeStart) + " ms!");
     } else {
-        delay(5000); // wait a bit longer for sensor to start before 2nd try (usually after a OTA-Update the esp32 is faster with startup than the fingerprint sensor)
-        if (finger.verifyPassword()) { 
-          Serial.println("Found fingerprint sensor!");
-        } else {
-          Serial.println("Did not find fingerprint sensor :(");
-          connected = false;
-          return connected;
-        }
+        Serial.println("Did not find fingerprint sensor :(");
+        connected = false;
+        return connected;
     }
-    finger.LEDcontrol(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_BLUE, 0); // sensor connected signal
+    if (sensorLink.getBaudRate() != savedBaudRate)
+      saveSensorBaudRate(sensorLink.getBaudRate());
+    if (sensorLink.getBaudRate() != SENSOR_BAUDRATE)
+      negotiateBaudRate(SENSOR_BAUDRATE);
+    ledStateValid = false; // whatever the sensor shows right now, it is not what we commanded
+    setLed(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_BLUE); // sensor connected signal
 
     Serial.println(F("Reading sensor parameters"));
     finger.getParameters();
+    packetLength = finger.packet_len;
     Serial.print(F("Status: 0x")); Serial.println(finger.status_reg, HEX);
     Serial.print(F("Sys ID: 0x")); Serial.println(finger.system_id, HEX);
     Serial.print(F("Capacity: ")); Serial.println(finger.capacity);
     Serial.print(F("Security level: ")); Serial.println(finger.security_level);
     Serial.print(F("Device address: ")); Serial.println(finger.device_addr, HEX);
     Serial.print(F("Packet len: ")); Serial.println(finger.packet_len);
-    Serial.print(F("Baud rate: ")); Serial.println(finger.baud_rate);
+    Serial.print(F("Baud rate: ")); Serial.println(sensorLink.getBaudRate()); // finger.baud_rate is only 16 bit and overflows above 57600
 
     finger.getTemplateCount();
     Serial.print("Sensor contains "); Serial.print(finger.templateCount); Serial.println(" templates");
@@ -48,13 +68,74 @@ bool FingerprintManager::connect() {
     //updateTouchState(false);
 }
 
+bool FingerprintManager::probeBaudRate(uint32_t baudRate) {
+  if (sensorLink.getBaudRate() != baudRate)
+    sensorLink.setBaudRate(baudRate);
+  return finger.verifyPassword();
+}
+
+// Switch the sensor to a faster rate. The sensor acknowledges SetSysPara with the old rate and uses the new one
+// from then on (it is also stored in the sensor's flash). If it cannot be verified afterwards we go back to the
+// default rate, so a failed switch never leaves us without a sensor.
+bool FingerprintManager::negotiateBaudRate(uint32_t baudRate) {
+  uint32_t oldBaudRate = sensorLink.getBaudRate();
+  Serial.println(String("Sensor link at ") + oldBaudRate + " baud:");
+  measureRoundTrips();
+
+  uint8_t rc = finger.setBaudRate(baudRate / 9600);
+  if (rc == FINGERPRINT_OK) {
+    sensorLink.setBaudRate(baudRate);
+    delay(SENSOR_BAUDRATE_SWITCH_DELAY_MS);
+    if (finger.verifyPassword()) {
+      saveSensorBaudRate(baudRate);
+      Serial.println(String("Sensor link switched to ") + baudRate + " baud:");
+      measureRoundTrips();
+      return true;
+    }
+  }
+
+  Serial.println(String("Switching sensor link to ") + baudRate + " baud failed (" + rc + "), falling back.");
+  if (!probeBaudRate(oldBaudRate) && !probeBaudRate(SENSOR_DEFAULT_BAUDRATE)) {
+    // sensor changed its rate but does not answer with it, try to get it back to the default
+    sensorLink.setBaudRate(baudRate);
+    finger.setBaudRate(SENSOR_DEFAULT_BAUDRATE / 9600);
+    probeBaudRate(SENSOR_DEFAULT_BAUDRATE);
+  }
+  saveSensorBaudRate(sensorLink.getBaudRate());
+  return false;
+}
+
+// print the average round trip of a few commands that do not need a finger on the sensor
+void FingerprintManager::measureRoundTrips() {
+  const int runs = 5;
+  char notepad[32];
+  unsigned long verifyMicros = 0, templateCountMicros = 0, notepadMicros = 0;
+
+  for (int i=0; i<runs; i++) {
+    unsigned long start = micros();
+    finger.verifyPassword();
+    verifyMicros += micros() - start;
+
+    start = micros();
+    finger.getTemplateCount();
+    templateCountMicros += micros() - start;
+
+    start = micros();
+    readNotepad(0, notepad, sizeof(notepad));
+    notepadMicros += micros() - start;
+  }
+  Serial.println(String("  VfyPwd:      ") + verifyMicros / runs + " us");
+  Serial.println(String("  TemplateNum: ") + templateCountMicros / runs + " us");
+  Serial.println(String("  ReadNotepad: ") + notepadMicros / runs + " us");
+}
+
 void FingerprintManager::updateTouchState(bool touched)
 {
   if ((touched != lastTouchState) || (ignoreTouchRing != lastIgnoreTouchRing)) {
       // check if sensor or ring is touched
       if (touched) {
         // turn touch indicator on:
-        finger.LEDcontrol(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_RED, 0);
+        setLed(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_RED);
       } else {
         // turn touch indicator off:
         setLedRingReady();
@@ -70,6 +151,7 @@ Match FingerprintManager::scanFingerprint() {
   
   Match match;
   match.scanResult = ScanResult::error;
+  deferLedUpdates = true; // the result must not wait for LED round trips
 
   if (!connected) {
       return match;
@@ -94,6 +176,11 @@ Match FingerprintManager::scanFingerprint() {
   }
   
 
+  sensorPolls++;
+  StageTimer scanTimer(scanMetrics.scan);
+  int64_t startMicros = esp_timer_get_time(); // the time budget and the decision times count from here
+  int noFingerReplies = 0;
+
   bool doAnotherScan = true;
   int scanPass = 0;
   while (doAnotherScan)
@@ -106,14 +193,23 @@ Match FingerprintManager::scanFingerprint() {
     ///////////////////////////////////////////////////////////
     bool doImaging = true;
     int imagingPass = 0;
+    StageTimer imagingTimer(scanMetrics.imaging);
     while (doImaging)
     {
       doImaging = false;
       imagingPass++;
       //Serial.println(String("Get Image try ") + imagingPass);
+      StageTimer getImageTimer(scanMetrics.getImage);
       match.returnCode = finger.getImage();
+      getImageTimer.stop();
+      scanMetrics.getImageCodes.record(match.returnCode);
       switch (match.returnCode) {
         case FINGERPRINT_OK:
+          if (ringTouchMicros) {
+            recordWakeLatency((uint32_t)(esp_timer_get_time() - ringTouchMicros));
+            ringTouchMicros = 0;
+          }
+          schedulePoll(true);
           // Important: do net set touch state to true yet! Reason:
           // - if touchRing is NOT ignored, updateTouchState(true) was already called a few lines up, ring is already flashing red
           // - if touchRing IS ignored, wait for next step because image still can be "too messy" (=raindrop on sensor), and we don't want to flash red in this case
@@ -126,23 +222,31 @@ Match FingerprintManager::scanFingerprint() {
             // no finger on sensor but ring was touched -> ring event
             //Serial.println("ring touched");
             updateTouchState(true);
-            if (imagingPass < 15) // up to x image passes in a row are taken after touch ring was touched until noFinger will raise a noMatchFound event
-            {
+            noFingerReplies = (match.returnCode == FINGERPRINT_NOFINGER) ? noFingerReplies + 1 : 0;
+            // up to x image passes in a row are taken after touch ring was touched until noFinger will raise a noMatchFound event
+            if (imagingPass >= scanPolicy.ringImagingPasses) {
+              //Serial.println("x times no image after touching ring");
+            } else if (scanPolicy.ringNoFingerExit > 0 && noFingerReplies >= scanPolicy.ringNoFingerExit) {
+              scanMetrics.noFingerExits++; // nobody is going to put a finger on the sensor, ring now
+            } else if (isScanBudgetUsed(startMicros)) {
+              scanMetrics.budgetExits++;
+            } else {
               doImaging = true; // scan another image
               //delay(50);
               break;
-            } else {
-              //Serial.println("15 times no image after touching ring");
-              match.scanResult = ScanResult::noMatchFound;
-              return match;
             }
+            match.scanResult = ScanResult::noMatchFound;
+            recordScanDecision(match, startMicros);
+            return match;
           } else  {
             if (ignoreTouchRing && scanPass > 1) {
               // the scan(s) in last iteration(s) have not found any match, now the finger was released (=no finger) -> return "no match" as result
               match.scanResult = ScanResult::noMatchFound;
+              recordScanDecision(match, startMicros);
             } else {
               match.scanResult = ScanResult::noFinger;
               updateTouchState(false);
+              schedulePoll(false);
             }
             return match;
           }
@@ -160,7 +264,11 @@ Match FingerprintManager::scanFingerprint() {
     ///////////////////////////////////////////////////////////
     // STEP 2: Convert Image to feature map
     ///////////////////////////////////////////////////////////
+    imagingTimer.stop();
+    StageTimer image2TzTimer(scanMetrics.image2Tz);
     match.returnCode = finger.image2Tz();
+    image2TzTimer.stop();
+    scanMetrics.image2TzCodes.record(match.returnCode);
     switch (match.returnCode) {
       case FINGERPRINT_OK:
         //Serial.println("Image converted");
@@ -186,24 +294,31 @@ Match FingerprintManager::scanFingerprint() {
     ///////////////////////////////////////////////////////////
     // STEP 3: Search DB for matching features
     ///////////////////////////////////////////////////////////
-    match.returnCode = finger.fingerSearch();
+    StageTimer searchTimer(scanMetrics.search);
+    match.returnCode = searchLibrary();
+    searchTimer.stop();
+    scanMetrics.searchCodes.record(match.returnCode);
     if (match.returnCode == FINGERPRINT_OK) {
         // found a match!
-        finger.LEDcontrol(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_PURPLE);
+        setLed(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_PURPLE);
         
+        countMatch(finger.fingerID);
         match.scanResult = ScanResult::matchFound;
         match.matchId = finger.fingerID;
         match.matchConfidence = finger.confidence;
-        match.matchName = fingerList[finger.fingerID];
       
     } else if (match.returnCode == FINGERPRINT_PACKETRECIEVEERR) {
         Serial.println("Communication error");
 
     } else if (match.returnCode == FINGERPRINT_NOTFOUND) {
-        Serial.println(String("Did not find a match. (Scan #") + scanPass + String(" of 5)"));
+        Serial.printf("Did not find a match. (Scan #%d of %u)\n", scanPass, scanPolicy.matchScanPasses);
         match.scanResult = ScanResult::noMatchFound;
-        if (scanPass < 5) // max 5 Scans until no match found is given back as result
-          doAnotherScan = true;
+        if (scanPass < scanPolicy.matchScanPasses) { // max x Scans until no match found is given back as result
+          if (isScanBudgetUsed(startMicros))
+            scanMetrics.budgetExits++;
+          else
+            doAnotherScan = true;
+        }
 
     } else {
         Serial.println("Unknown error");
@@ -211,176 +326,348 @@ Match FingerprintManager::scanFingerprint() {
 
   } //while
 
+  recordScanDecision(match, startMicros);
   return match;
 
 }
 
 
 
+uint32_t FingerprintManager::loadSensorBaudRate() {
+  Preferences preferences;
+  preferences.begin("sensor", true);
+  uint32_t baudRate = preferences.getUInt("baudRate", SENSOR_DEFAULT_BAUDRATE);
+  preferences.end();
+  return baudRate;
+}
+
+void FingerprintManager::saveSensorBaudRate(uint32_t baudRate) {
+  Preferences preferences;
+  preferences.begin("sensor", false);
+  preferences.putUInt("baudRate", baudRate);
+  preferences.end();
+}
+
 // Preferences
+// All names are stored as one versioned and checksummed blob, so they are loaded with a single read and a change is
+// written atomically (NVS keeps the old blob until the new one is complete). Versions before stored every name under
+// its id as key, these are migrated on the first boot.
 void FingerprintManager::loadFingerListFromPrefs() {
-  Preferences preferences;
-  preferences.begin("fingerList", true); 
+  unsigned long start = micros();
+  namePreferences.begin("fingerList", false);
+  bool hasBlob = namePreferences.isKey(FINGER_NAMES_KEY);
+  xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+  fingerNames.begin(finger.capacity); // ids are 1..capacity-1, the sensor rejects pages >= capacity and 0 is not used
+  invalidateFingerListHtml();
+  free(matchCounts);
+  matchCounts = (uint16_t*)calloc(fingerNames.getSlots(), sizeof(uint16_t));
+  matchCountSlots = matchCounts ? fingerNames.getSlots() : 0;
+  bool loaded = hasBlob ? loadFingerNamesBlob() : (loadLegacyFingerNames() >= 0);
+  int counter = fingerNames.getCount();
+  xSemaphoreGive(fingerNamesMutex);
+  nameLoadMicros = micros() - start;
+  namesMigrated = !hasBlob;
+  Serial.println(String(counter) + " fingers loaded from preferences (" + (hasBlob ? "name blob" : "per-key layout") + ") in " + nameLoadMicros + " us.");
+
+  if (!loaded)
+    notifyClients(LogCode::namesDamaged);
+  else if (!hasBlob && saveFingerNames()) {
+    removeLegacyFingerNames();
+    Serial.println("Finger names migrated to a single blob.");
+  }
+  if (counter != finger.templateCount)
+    notifyClients(LogCode::fingerCountMismatch, finger.templateCount, counter);
+  reportFingerNameTable();
+}
+
+bool FingerprintManager::loadFingerNamesBlob() {
+  size_t length = namePreferences.getBytesLength(FINGER_NAMES_KEY);
+  FingerNamesHeader header;
+  if (length < sizeof(header))
+    return false;
+  uint8_t *blob = (uint8_t*)malloc(length);
+  if (!blob)
+    return false;
+  bool ok = (namePreferences.getBytes(FINGER_NAMES_KEY, blob, length) == length);
+  if (ok) {
+    memcpy(&header, blob, sizeof(header));
+    const uint8_t *records = blob + sizeof(header);
+    ok = (header.version == FINGER_NAMES_VERSION) && (header.length == length - sizeof(header))
+      && (crc32_le(0, records, header.length) == header.crc) && fingerNames.deserialize(records, header.length);
+  }
+  free(blob);
+  return ok;
+}
+
+int FingerprintManager::loadLegacyFingerNames() {
   int counter = 0;
-  for (int i=1; i<=200; i++) {
+  for (int i=1; i<fingerNames.getSlots(); i++) {
     String key = String(i);
-    if (preferences.isKey(key.c_str())) {
-      fingerList[i] = preferences.getString(key.c_str(), String("@empty"));
+    if (namePreferences.isKey(key.c_str())) {
+      if (!fingerNames.set(i, namePreferences.getString(key.c_str()).c_str()))
+        notifyClients(LogCode::nameTruncated, i); // the old layout had no length limit
       counter++;
     }
-    else
-      fingerList[i] = String("@empty");
   }
-  Serial.println(String(counter) + " fingers loaded from preferences.");
-  if (counter != finger.templateCount)
-    notifyClients(String("Warning: Fingerprint count mismatch! ") + finger.templateCount + " fingerprints stored on sensor, but we are aware of " + counter + " fingerprints.");
-  preferences.end();
+  return counter;
+}
+
+void FingerprintManager::removeLegacyFingerNames() {
+  for (int i=1; i<fingerNames.getSlots(); i++) {
+    String key = String(i);
+    if (namePreferences.isKey(key.c_str()))
+      namePreferences.remove(key.c_str());
+  }
 }
 
+bool FingerprintManager::saveFingerNames() {
+  FingerNamesHeader header;
+  xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+  header.count = fingerNames.getCount();
+  header.length = fingerNames.getSerializedSize();
+  uint8_t *blob = (uint8_t*)malloc(sizeof(header) + header.length);
+  if (blob)
+    fingerNames.serialize(blob + sizeof(header));
+  xSemaphoreGive(fingerNamesMutex);
+  if (!blob) {
+    notifyClients(LogCode::namesSaveNoMemory);
+    return false;
+  }
+  header.crc = crc32_le(0, blob + sizeof(header), header.length);
+  memcpy(blob, &header, sizeof(header));
+  bool ok = (namePreferences.putBytes(FINGER_NAMES_KEY, blob, sizeof(header) + header.length) == sizeof(header) + header.length);
+  free(blob);
+  if (!ok)
+    notifyClients(LogCode::namesSaveFailed);
+  return ok;
+}
+
+// RAM of the name table compared to the String fingerList[] it replaced: a String object per slot plus a heap block
+// (with 8 bytes heap overhead, 4 byte aligned) for each name or the "@empty" marker. Also times a walk over all names.
+void FingerprintManager::reportFingerNameTable() {
+  char name[FINGER_NAME_BUFFER_SIZE];
+  size_t stringListBytes = fingerNames.getSlots() * sizeof(String);
+  xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+  unsigned long start = micros();
+  size_t totalLength = 0;
+  for (int id = fingerNames.next(-1); id >= 0; id = fingerNames.next(id))
+    totalLength += fingerNames.copy(id, name, sizeof(name));
+  unsigned long iterateMicros = micros() - start;
+  for (int id=1; id<fingerNames.getSlots(); id++) {
+    size_t length = fingerNames.isOccupied(id) ? fingerNames.copy(id, name, sizeof(name)) : strlen("@empty");
+    stringListBytes += ((length + 1 + 3) & ~3) + 8;
+  }
+  size_t tableBytes = fingerNames.getMemoryUsage();
+  uint16_t count = fingerNames.getCount();
+  xSemaphoreGive(fingerNamesMutex);
+  Serial.printf("Finger name table: %u bytes instead of about %u bytes as String list, listing %u names (%u chars) took %lu us\n",
+    (unsigned)tableBytes, (unsigned)stringListBytes, count, (unsigned)totalLength, iterateMicros);
+}
 
-// Add/Enroll fingerprint
-NewFinger FingerprintManager::enrollFinger(int id, String name) {
 
-  NewFinger newFinger;
-  newFinger.enrollResult = EnrollResult::error;
+// Add/Enroll fingerprint
+// Enrollment is a state machine stepped by the sensor task, every step is a single getImage round trip (plus image2Tz
+// or storing the model when the step completes a sample), so the sensor task never waits for a finger.
+bool FingerprintManager::startEnroll(int id, const String &name) {
+  if (!isValidId(id) || name.length() > FINGER_NAME_MAX_LENGTH)
+    return false;
 
   lastTouchState = true; // after enrollment, scan mode kicks in again. Force update of the ring light back to normal on first iteration of scan mode.
+  enrollCancelRequested = false;
+  strlcpy(enrollName, name.c_str(), sizeof(enrollName));
+  portENTER_CRITICAL(&enrollMux);
+  enrollProgress.id = id;
+  portEXIT_CRITICAL(&enrollMux);
+
+  notifyClients(LogCode::enrollStarted, id);
+  enterEnrollSample(1);
+  return true;
+}
 
-  
-  notifyClients(String("Enrollment for id #") + id + " started. We need to scan your finger 5 times until enrollment is completed.");
+// Repeat n times to get better resulting templates (as stated in R503 documentation up to 6 combined image samples possible, but I got an communication error when trying more than 5 samples, so dont go >5)
+void FingerprintManager::enterEnrollSample(uint8_t sample) {
+  notifyClients(LogCode::enrollTake, sample);
+  if (sample == 1) {
+    Serial.printf("Taking image sample %u: ", sample);
+    setLed(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_PURPLE);
+    setEnrollProgress(EnrollState::placeFinger, sample, 0);
+  } else {
+    setEnrollProgress(EnrollState::removeFinger, sample, 0); // the finger of the last sample has to go first
+  }
+}
 
-  
-  // Repeat n times to get better resulting templates (as stated in R503 documentation up to 6 combined image samples possible, but I got an communication error when trying more than 5 samples, so dont go >5)
-  for (int nTimes=1; nTimes<=5; nTimes++)
-  {
-      notifyClients(String("Take #" + String(nTimes))+ " (place your finger on the sensor until led ring stops flashing, then remove it).");
-
-      if (nTimes != 1) // not on first run
-      {
-        //delay(2000);
-        newFinger.returnCode = 0xFF;
-        while (newFinger.returnCode != FINGERPRINT_NOFINGER) {
-          newFinger.returnCode = finger.getImage();
-        }
-      }
-      
-      Serial.print("Taking image sample "); Serial.print(nTimes); Serial.print(": ");
-      finger.LEDcontrol(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_PURPLE, 0);
-      newFinger.returnCode = 0xFF;
-      while (newFinger.returnCode != FINGERPRINT_OK) {
-        newFinger.returnCode = finger.getImage();
-        switch (newFinger.returnCode) {
-        case FINGERPRINT_OK:
-          Serial.print("taken, ");
-          break;
-        case FINGERPRINT_NOFINGER:
-          break;
-        case FINGERPRINT_PACKETRECIEVEERR:
-          Serial.print("Communication error, ");
-          break;
-        case FINGERPRINT_IMAGEFAIL:
-          Serial.print("Imaging error, ");
-          break;
-        default:
-          Serial.print("Unknown error, ");
-          break;
-        }
-      }
-    
-      // OK success!
-    
-      newFinger.returnCode = finger.image2Tz(nTimes);
-      switch (newFinger.returnCode) {
-        case FINGERPRINT_OK:
-          Serial.print("converted");
-          break;
-        case FINGERPRINT_IMAGEMESS:
-          Serial.print("too messy");
-          return newFinger;
-        case FINGERPRINT_PACKETRECIEVEERR:
-          Serial.print("Communication error");
-          return newFinger;
-        case FINGERPRINT_FEATUREFAIL:
-          Serial.print("Could not find fingerprint features");
-          return newFinger;
-        case FINGERPRINT_INVALIDIMAGE:
-          Serial.print("Could not find fingerprint features");
-          return newFinger;
-        default:
-          Serial.print("Unknown error");
-          return newFinger;
-      }
-      finger.LEDcontrol(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_PURPLE);
+void FingerprintManager::setEnrollProgress(EnrollState state, uint8_t sample, uint8_t returnCode) {
+  portENTER_CRITICAL(&enrollMux);
+  enrollProgress.state = state;
+  enrollProgress.sample = sample;
+  enrollProgress.returnCode = returnCode;
+  EnrollProgress progress = enrollProgress;
+  portEXIT_CRITICAL(&enrollMux);
+  enrollStepMillis = millis();
+  notifyEnrollProgress(progress);
+}
+
+bool FingerprintManager::isEnrolling() {
+  portENTER_CRITICAL(&enrollMux);
+  bool enrolling = (enrollProgress.state == EnrollState::placeFinger || enrollProgress.state == EnrollState::removeFinger);
+  portEXIT_CRITICAL(&enrollMux);
+  return enrolling;
+}
+
+EnrollProgress FingerprintManager::getEnrollProgress() {
+  portENTER_CRITICAL(&enrollMux);
+  EnrollProgress progress = enrollProgress;
+  portEXIT_CRITICAL(&enrollMux);
+  return progress;
+}
 
+bool FingerprintManager::cancelEnroll() {
+  if (!isEnrolling())
+    return false;
+  enrollCancelRequested = true; // taken up by the next stepEnroll()
+  return true;
+}
+
+bool FingerprintManager::stepEnroll() {
+  EnrollProgress progress = getEnrollProgress();
+  if (progress.state != EnrollState::placeFinger && progress.state != EnrollState::removeFinger)
+    return false;
+  if (enrollCancelRequested) {
+    Serial.println("Enrollment cancelled");
+    setEnrollProgress(EnrollState::cancelled, progress.sample, 0);
+    return false;
+  }
+  if (millis() - enrollStepMillis > ENROLL_STEP_TIMEOUT_MS) {
+    Serial.println("Enrollment timed out");
+    setEnrollProgress(EnrollState::timedOut, progress.sample, 0);
+    return false;
   }
 
-  
+  uint8_t returnCode = finger.getImage();
+  if (progress.state == EnrollState::removeFinger) {
+    if (returnCode == FINGERPRINT_NOFINGER) {
+      Serial.printf("Taking image sample %u: ", progress.sample);
+      setLed(FINGERPRINT_LED_FLASHING, 25, FINGERPRINT_LED_PURPLE);
+      setEnrollProgress(EnrollState::placeFinger, progress.sample, 0);
+    }
+    return true;
+  }
 
+  switch (returnCode) {
+    case FINGERPRINT_OK:
+      Serial.print("taken, ");
+      break;
+    case FINGERPRINT_NOFINGER:
+      return true;
+    case FINGERPRINT_PACKETRECIEVEERR:
+      Serial.print("Communication error, ");
+      return true;
+    case FINGERPRINT_IMAGEFAIL:
+      Serial.print("Imaging error, ");
+      return true;
+    default:
+      Serial.print("Unknown error, ");
+      return true;
+  }
+
+  // OK success!
+
+  returnCode = finger.image2Tz(progress.sample);
+  switch (returnCode) {
+    case FINGERPRINT_OK:
+      Serial.println("converted");
+      break;
+    case FINGERPRINT_IMAGEMESS:
+      Serial.println("too messy");
+      setEnrollProgress(EnrollState::failed, progress.sample, returnCode);
+      return false;
+    case FINGERPRINT_PACKETRECIEVEERR:
+      Serial.println("Communication error");
+      setEnrollProgress(EnrollState::failed, progress.sample, returnCode);
+      return false;
+    case FINGERPRINT_FEATUREFAIL:
+    case FINGERPRINT_INVALIDIMAGE:
+      Serial.println("Could not find fingerprint features");
+      setEnrollProgress(EnrollState::failed, progress.sample, returnCode);
+      return false;
+    default:
+      Serial.println("Unknown error");
+      setEnrollProgress(EnrollState::failed, progress.sample, returnCode);
+      return false;
+  }
+  setLed(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_PURPLE);
+
+  if (progress.sample < ENROLL_SAMPLES) {
+    enterEnrollSample(progress.sample + 1);
+    return true;
+  }
+  storeEnrollment(progress.id, progress.sample);
+  return false;
+}
+
+void FingerprintManager::storeEnrollment(uint16_t id, uint8_t sample) {
   // OK converted!
-  Serial.println();
   Serial.print("Creating model for #");  Serial.println(id);
 
-  newFinger.returnCode = finger.createModel();
-  if (newFinger.returnCode == FINGERPRINT_OK) {
+  uint8_t returnCode = finger.createModel();
+  if (returnCode == FINGERPRINT_OK) {
     Serial.println("Prints matched!");
-  } else if (newFinger.returnCode == FINGERPRINT_PACKETRECIEVEERR) {
-    Serial.println("Communication error");
-    return newFinger;
-  } else if (newFinger.returnCode == FINGERPRINT_ENROLLMISMATCH) {
-    Serial.println("Fingerprints did not match");
-    return newFinger;
   } else {
-    Serial.println("Unknown error");
-    return newFinger;
+    if (returnCode == FINGERPRINT_PACKETRECIEVEERR)
+      Serial.println("Communication error");
+    else if (returnCode == FINGERPRINT_ENROLLMISMATCH)
+      Serial.println("Fingerprints did not match");
+    else
+      Serial.println("Unknown error");
+    setEnrollProgress(EnrollState::failed, sample, returnCode);
+    return;
   }
 
   Serial.print("ID "); Serial.println(id);
-  newFinger.returnCode = finger.storeModel(id);
-  if (newFinger.returnCode == FINGERPRINT_OK) {
+  returnCode = finger.storeModel(id);
+  if (returnCode == FINGERPRINT_OK) {
     Serial.println("Stored!");
-    newFinger.enrollResult = EnrollResult::ok;
+    resetMatchCount(id); // a new finger in this slot
     // save to prefs
-    fingerList[id] = name;
-    Preferences preferences;
-    preferences.begin("fingerList", false); 
-    preferences.putString(String(id).c_str(), name);
-    preferences.end();
-
-  } else if (newFinger.returnCode == FINGERPRINT_PACKETRECIEVEERR) {
-    Serial.println("Communication error");
-    return newFinger;
-  } else if (newFinger.returnCode == FINGERPRINT_BADLOCATION) {
-    Serial.println("Could not store in that location");
-    return newFinger;
-  } else if (newFinger.returnCode == FINGERPRINT_FLASHERR) {
-    Serial.println("Error writing to flash");
-    return newFinger;
+    xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+    bool fits = fingerNames.set(id, enrollName);
+    invalidateFingerListHtml();
+    xSemaphoreGive(fingerNamesMutex);
+    if (!fits)
+      notifyClients(LogCode::nameTruncated, id);
+    saveFingerNames();
+    setEnrollProgress(EnrollState::done, sample, returnCode);
   } else {
-    Serial.println("Unknown error");
-    return newFinger;
+    if (returnCode == FINGERPRINT_PACKETRECIEVEERR)
+      Serial.println("Communication error");
+    else if (returnCode == FINGERPRINT_BADLOCATION)
+      Serial.println("Could not store in that location");
+    else if (returnCode == FINGERPRINT_FLASHERR)
+      Serial.println("Error writing to flash");
+    else
+      Serial.println("Unknown error");
+    setEnrollProgress(EnrollState::failed, sample, returnCode);
   }
 
   //finger.LEDcontrol(FINGERPRINT_LED_OFF, 0, FINGERPRINT_LED_RED);
-
-  return newFinger;
-
 }
 
 
 void FingerprintManager::deleteFinger(int id) {
           
-  if ((id > 0) && (id <= 200)) {
+  if (isValidId(id)) {
     int8_t result = finger.deleteModel(id);
     if (result != FINGERPRINT_OK) {
-      notifyClients(String("Delete of finger template #") + id + " from sensor failed with code " + result);
+      notifyClients(LogCode::deleteFailed, id, result);
       return;
 
     } else {
-      fingerList[id] = "@empty";
-      Preferences preferences;
-      preferences.begin("fingerList", false); 
-      preferences.remove (String(id).c_str());
-      preferences.end();
+      xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+      fingerNames.clear(id);
+      invalidateFingerListHtml();
+      xSemaphoreGive(fingerNamesMutex);
+      resetMatchCount(id);
+      saveFingerNames();
       Serial.println(String("Finger template #") + id + " deleted from sensor and prefs.");
 
     }
@@ -390,51 +677,336 @@ void FingerprintManager::deleteFinger(int id) {
 
 
 void FingerprintManager::renameFinger(int id, String newName) {
-  if ((id > 0) && (id <= 200)) {
-    Preferences preferences;
-    preferences.begin("fingerList", false); 
-    preferences.putString(String(id).c_str(), newName);
-    preferences.end();
-    Serial.println(String("Finger template #") + id + " renamed from " + fingerList[id] + " to " + newName);
-    fingerList[id] = newName;
+  if (isValidId(id)) {
+    char oldName[FINGER_NAME_BUFFER_SIZE];
+    xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+    fingerNames.copy(id, oldName, sizeof(oldName));
+    bool fits = fingerNames.set(id, newName.c_str());
+    invalidateFingerListHtml();
+    xSemaphoreGive(fingerNamesMutex);
+    saveFingerNames();
+    Serial.println(String("Finger template #") + id + " renamed from " + oldName + " to " + newName);
+    if (!fits)
+      notifyClients(LogCode::nameTruncated, id);
   }
 }
 
-String FingerprintManager::getFingerListAsHtmlOptionList() {
-  String htmlOptions = "";
-  int counter = 0;
-  for (int i=1; i<=200; i++) {
-    if (fingerList[i].compareTo("@empty") != 0) {
-      String option;
-      if (counter == 0)
-        option = "<option value=\"" + String(i) + "\" selected>" + String(i) + " - " + fingerList[i] + "</option>";
-      else 
-        option = "<option value=\"" + String(i) + "\">" + String(i) + " - " + fingerList[i] + "</option>";
-      htmlOptions += option;
-      counter++;
+static size_t appendEscapedHtml(char *out, const char *text) {
+  size_t length = 0;
+  for (; *text; text++) {
+    const char *entity = NULL;
+    switch (*text) {
+      case '&': entity = "&amp;"; break;
+      case '<': entity = "&lt;"; break;
+      case '>': entity = "&gt;"; break;
+      case '"': entity = "&quot;"; break;
+      case '\'': entity = "&#39;"; break;
+    }
+    size_t n = entity ? strlen(entity) : 1;
+    if (out) {
+      if (entity)
+        memcpy(out + length, entity, n);
+      else
+        out[length] = *text;
+    }
+    length += n;
+  }
+  return length;
+}
+
+// writes the option to out (if not NULL) and returns its length
+static size_t appendFingerOption(char *out, int id, const char *name, bool selected) {
+  char head[48];
+  size_t length = snprintf(head, sizeof(head), "<option value=\"%d\"%s>%d - ", id, selected ? " selected" : "", id);
+  if (out)
+    memcpy(out, head, length);
+  length += appendEscapedHtml(out ? out + length : NULL, name);
+  if (out)
+    memcpy(out + length, "</option>", 9);
+  return length + 9;
+}
+
+void FingerprintManager::invalidateFingerListHtml() {
+  fingerListHtmlValid = false;
+  fingerListGeneration++;
+}
+
+// The first pass measures, the second one writes into a buffer of exactly that size, so rendering needs one
+// allocation instead of a String growing with every option.
+void FingerprintManager::renderFingerListHtml() {
+  unsigned long start = micros();
+  char name[FINGER_NAME_BUFFER_SIZE];
+  size_t length = 0;
+  for (int i = fingerNames.next(0); i >= 0; i = fingerNames.next(i)) {
+    fingerNames.copy(i, name, sizeof(name));
+    length += appendFingerOption(NULL, i, name, length == 0);
+  }
+
+  free(fingerListHtml);
+  fingerListHtml = (char*)malloc(length + 1);
+  fingerListHtmlLength = 0;
+  if (!fingerListHtml) {
+    Serial.println("Not enough memory for the finger list");
+    return;
+  }
+  for (int i = fingerNames.next(0); i >= 0; i = fingerNames.next(i)) {
+    fingerNames.copy(i, name, sizeof(name));
+    fingerListHtmlLength += appendFingerOption(fingerListHtml + fingerListHtmlLength, i, name, fingerListHtmlLength == 0);
+  }
+  fingerListHtml[fingerListHtmlLength] = '\0';
+  fingerListHtmlValid = true;
+  fingerListRenderMicros = micros() - start;
+  Serial.printf("Finger list rendered: %u entries, %u bytes in %u us\n", fingerNames.getCount(), (unsigned)fingerListHtmlLength, fingerListRenderMicros);
+}
+
+size_t FingerprintManager::readFingerListHtml(size_t offset, uint8_t *buffer, size_t size, uint32_t &generation) {
+  size_t length = 0;
+  xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+  if (offset == 0)
+    generation = fingerListGeneration;
+  if (generation == fingerListGeneration) { // otherwise the list changed while it was sent, end the response early
+    if (!fingerListHtmlValid)
+      renderFingerListHtml();
+    if (offset < fingerListHtmlLength) {
+      length = min(size, fingerListHtmlLength - offset);
+      memcpy(buffer, fingerListHtml + offset, length);
     }
   }
-  return htmlOptions;
+  xSemaphoreGive(fingerNamesMutex);
+  return length;
+}
+
+const char *FingerprintManager::lockFingerListHtml() {
+  xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+  if (!fingerListHtmlValid)
+    renderFingerListHtml();
+  return fingerListHtml ? fingerListHtml : "";
+}
+
+void FingerprintManager::unlockFingerListHtml() {
+  xSemaphoreGive(fingerNamesMutex);
+}
+
+bool FingerprintManager::copyFingerName(int id, char *name, size_t size) {
+  if (size)
+    name[0] = '\0';
+  if (id < 1)
+    return false;
+  xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+  bool found = fingerNames.isOccupied(id);
+  fingerNames.copy(id, name, size);
+  xSemaphoreGive(fingerNamesMutex);
+  return found;
+}
+
+int FingerprintManager::nextFinger(int id, char *name, size_t size) {
+  xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+  int next = fingerNames.next(max(id, 0));
+  fingerNames.copy(next, name, size);
+  xSemaphoreGive(fingerNamesMutex);
+  return next;
+}
+
+uint16_t FingerprintManager::getFingerCount() {
+  xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+  uint16_t count = fingerNames.getCount();
+  xSemaphoreGive(fingerNamesMutex);
+  return count;
+}
+
+uint16_t FingerprintManager::getCapacity() {
+  return finger.capacity;
+}
+
+bool FingerprintManager::isValidId(int id) {
+  return id >= 1 && id < finger.capacity;
 }
 
 void FingerprintManager::setIgnoreTouchRing(bool state) {
   if (ignoreTouchRing != state) {
     ignoreTouchRing = state;
-    if (state == true)
-      notifyClients("IgnoreTouchRing is now 'on'");
-    else
-      notifyClients("IgnoreTouchRing is now 'off'");
+    notifyClients(LogCode::ignoreTouchRing, 0, 0, state ? "on" : "off");
   }
 }
 
 
 bool FingerprintManager::isRingTouched() {
+  if (ringTouchLatched) {
+    ringTouchLatched = false;
+    return true;
+  }
   if (digitalRead(touchRingPin) == LOW) // LOW = touched. Caution: touchSignal on this pin occour only once (at beginning of touching the ring, not every iteration if you keep your finger on the ring)
       return true;
   else 
       return false;
 }
 
+void IRAM_ATTR FingerprintManager::onRingTouched() {
+  ringTouchLatched = true;
+  ringTouchMicros = esp_timer_get_time();
+  wakeups++;
+}
+
+// true if nothing is going on and only a touch on the ring can start a scan
+bool FingerprintManager::isWaitingForTouch() {
+  return connected && !ignoreTouchRing && !lastTouchState && !ringTouchLatched;
+}
+
+void FingerprintManager::sleepSensor() {
+  if (sensorSleeping)
+    return;
+  uint8_t data = FINGERPRINT_SLEEP;
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, 1, &data);
+  finger.writeStructuredPacket(packet);
+  if (finger.getStructuredPacket(&packet) == FINGERPRINT_OK && packet.type == FINGERPRINT_ACKPACKET && packet.data[0] == FINGERPRINT_OK) {
+    sensorSleeping = true;
+    ledStateValid = false; // LED is off while sleeping
+  }
+}
+
+bool FingerprintManager::wakeSensor() {
+  if (!sensorSleeping)
+    return true;
+  // a touch wakes the sensor by itself, but it takes a moment until it answers again
+  for (int i=0; i<SENSOR_WAKE_RETRIES; i++) {
+    if (finger.verifyPassword()) {
+      sensorSleeping = false;
+      return true;
+    }
+  }
+  Serial.println("Sensor did not wake up.");
+  return false;
+}
+
+void FingerprintManager::recordWakeLatency(uint32_t latencyMicros) {
+  wakeStats.latencyCount++;
+  wakeStats.lastLatencyMicros = latencyMicros;
+  wakeStats.totalLatencyMicros += latencyMicros;
+  if (latencyMicros > wakeStats.maxLatencyMicros)
+    wakeStats.maxLatencyMicros = latencyMicros;
+}
+
+WakeStats FingerprintManager::getWakeStats() {
+  WakeStats stats = wakeStats;
+  stats.wakeups = wakeups;
+  return stats;
+}
+
+// Without the touch ring every scan is a getImage() round trip. Poll at full rate while something happens on the
+// sensor and back off step by step when nothing was seen for a while.
+void FingerprintManager::schedulePoll(bool imageTaken) {
+  if (imageTaken) {
+    lastImageMillis = millis();
+    pollIntervalMs = pollIntervalMinMs;
+  } else if (millis() - lastImageMillis >= POLL_BACKOFF_DELAY_MS) {
+    pollIntervalMs = min(pollIntervalMs * 2, pollIntervalMaxMs);
+  }
+}
+
+void FingerprintManager::setPollInterval(uint32_t minMs, uint32_t maxMs) {
+  pollIntervalMinMs = minMs;
+  pollIntervalMaxMs = max(minMs, maxMs);
+  pollIntervalMs = pollIntervalMinMs;
+}
+
+uint32_t FingerprintManager::getPollIntervalMs() {
+  if (!ignoreTouchRing)
+    return pollIntervalMinMs; // only the touch ring pin is read, no need to slow down
+  return pollIntervalMs;
+}
+
+// called regularly by the sensor task, the stats are only read by others
+void FingerprintManager::updatePollStats() {
+  unsigned long elapsed = millis() - rateWindowStart;
+  if (elapsed < POLL_RATE_WINDOW_MS)
+    return;
+  uint32_t transactions = sensorLink.getTransactionCount();
+  pollStats.pollsPerMinute = (uint64_t)(sensorPolls - rateWindowPolls) * 60000 / elapsed;
+  pollStats.transactionsPerMinute = (uint64_t)(transactions - rateWindowTransactions) * 60000 / elapsed;
+  rateWindowStart = millis();
+  rateWindowPolls = sensorPolls;
+  rateWindowTransactions = transactions;
+}
+
+PollStats FingerprintManager::getPollStats() {
+  PollStats stats = pollStats;
+  stats.intervalMs = getPollIntervalMs();
+  return stats;
+}
+
+void FingerprintManager::printMetrics(Print &out) {
+  const char *name = "doorbell_scan_stage_seconds";
+  printMetricHeader(out, name, "histogram", "Duration of the scan stages, imaging includes all getImage retries.");
+  scanMetrics.scan.print(out, name, "stage=\"scan\"");
+  scanMetrics.imaging.print(out, name, "stage=\"imaging\"");
+  scanMetrics.getImage.print(out, name, "stage=\"get_image\"");
+  scanMetrics.image2Tz.print(out, name, "stage=\"image2tz\"");
+  scanMetrics.search.print(out, name, "stage=\"search\"");
+
+  // labeled with the policy, so the distributions of different policies can be compared across reboots
+  char policyLabels[112];
+  snprintf(policyLabels, sizeof(policyLabels), "ring_passes=\"%u\",match_passes=\"%u\",budget_ms=\"%u\",nofinger_exit=\"%u\"",
+    scanPolicy.ringImagingPasses, scanPolicy.matchScanPasses, scanPolicy.timeBudgetMs, scanPolicy.ringNoFingerExit);
+  printMetricHeader(out, "doorbell_time_to_ring_seconds", "histogram", "Scan start until the touch was decided to be a ring, per scan policy.");
+  scanMetrics.timeToRing.print(out, "doorbell_time_to_ring_seconds", policyLabels);
+  printMetricHeader(out, "doorbell_time_to_unlock_seconds", "histogram", "Scan start until a match was found, per scan policy.");
+  scanMetrics.timeToUnlock.print(out, "doorbell_time_to_unlock_seconds", policyLabels);
+  printMetricHeader(out, "doorbell_scan_early_exits_total", "counter", "Rings decided by a rule of the scan policy before the passes were used up.");
+  printMetric(out, "doorbell_scan_early_exits_total", "rule=\"time_budget\"", scanMetrics.budgetExits);
+  printMetric(out, "doorbell_scan_early_exits_total", "rule=\"no_finger\"", scanMetrics.noFingerExits);
+
+  name = "doorbell_sensor_return_codes_total";
+  printMetricHeader(out, name, "counter", "Confirmation codes returned by the sensor per scan stage.");
+  scanMetrics.getImageCodes.print(out, name, "stage=\"get_image\"");
+  scanMetrics.image2TzCodes.print(out, name, "stage=\"image2tz\"");
+  scanMetrics.searchCodes.print(out, name, "stage=\"search\"");
+
+  printMetricHeader(out, "doorbell_sensor_transactions_total", "counter", "UART request/response round trips with the sensor.");
+  printMetric(out, "doorbell_sensor_transactions_total", "", sensorLink.getTransactionCount());
+  printMetricHeader(out, "doorbell_sensor_bytes_total", "counter", "Bytes transferred with the sensor.");
+  printMetric(out, "doorbell_sensor_bytes_total", "direction=\"tx\"", sensorLink.getBytesWritten());
+  printMetric(out, "doorbell_sensor_bytes_total", "direction=\"rx\"", sensorLink.getBytesRead());
+  printMetricHeader(out, "doorbell_sensor_baud_rate", "gauge", "Baud rate of the sensor link.");
+  printMetric(out, "doorbell_sensor_baud_rate", "", sensorLink.getBaudRate());
+
+  printMetricHeader(out, "doorbell_sensor_polls_total", "counter", "Scans that talked to the sensor.");
+  printMetric(out, "doorbell_sensor_polls_total", "", sensorPolls);
+  printMetricHeader(out, "doorbell_poll_interval_seconds", "gauge", "Current pause between two scans.");
+  out.printf("doorbell_poll_interval_seconds %.3f\n", getPollIntervalMs() / 1e3);
+
+  static const char *strategyNames[] = { "full", "high_speed", "hot_first" };
+  char labels[32];
+  name = "doorbell_search_match_seconds";
+  printMetricHeader(out, name, "summary", "Search duration of scans that found a match, per search strategy (recent samples).");
+  for (int i=0; i<(int)SearchStrategy::count; i++) {
+    snprintf(labels, sizeof(labels), "strategy=\"%s\"", strategyNames[i]);
+    matchSearchLatency[i].print(out, name, labels);
+  }
+  printMetricHeader(out, "doorbell_search_strategy", "gauge", "Active search strategy.");
+  snprintf(labels, sizeof(labels), "strategy=\"%s\"", strategyNames[(int)searchStrategy]);
+  printMetric(out, "doorbell_search_strategy", labels, 1);
+  printMetricHeader(out, "doorbell_hot_range_searches_total", "counter", "Searches in the hot ranges of the hot_first strategy.");
+  printMetric(out, "doorbell_hot_range_searches_total", "result=\"hit\"", hotRangeHits);
+  printMetric(out, "doorbell_hot_range_searches_total", "result=\"miss\"", hotRangeMisses);
+
+  printMetricHeader(out, "doorbell_led_commands_total", "counter", "LED ring commands, suppressed ones did not change the LED state.");
+  printMetric(out, "doorbell_led_commands_total", "result=\"sent\"", ledStats.sent);
+  printMetric(out, "doorbell_led_commands_total", "result=\"suppressed\"", ledStats.suppressed);
+
+  printMetricHeader(out, "doorbell_touch_wakeups_total", "counter", "Touch ring interrupts.");
+  printMetric(out, "doorbell_touch_wakeups_total", "", wakeups);
+  printMetricHeader(out, "doorbell_wake_to_image_seconds_max", "gauge", "Longest time from touch ring interrupt to first image.");
+  out.printf("doorbell_wake_to_image_seconds_max %.6f\n", wakeStats.maxLatencyMicros / 1e6);
+
+  printMetricHeader(out, "doorbell_finger_list_render_seconds", "gauge", "Last rendering of the finger option list.");
+  out.printf("doorbell_finger_list_render_seconds %.6f\n", fingerListRenderMicros / 1e6);
+  printMetricHeader(out, "doorbell_finger_list_bytes", "gauge", "Size of the rendered finger option list, also the heap it needs.");
+  printMetric(out, "doorbell_finger_list_bytes", "", fingerListHtmlLength);
+
+  printMetricHeader(out, "doorbell_finger_names_load_seconds", "gauge", "Loading the finger names from flash at boot.");
+  out.printf("doorbell_finger_names_load_seconds{layout=\"%s\"} %.6f\n", namesMigrated ? "per_key" : "blob", nameLoadMicros / 1e6);
+}
+
 bool FingerprintManager::isFingerOnSensor() {
   // get an image
   uint8_t returnCode = finger.getImage();
@@ -447,16 +1019,193 @@ bool FingerprintManager::isFingerOnSensor() {
   return false;
 }
   
+// Search char buffer 1 in the given page range, the result is left in finger.fingerID/confidence like fingerSearch() does
+uint8_t FingerprintManager::searchRange(uint8_t instruction, uint16_t start, uint16_t count) {
+  uint8_t data[6];
+
+  data[0] = instruction;
+  data[1] = 0x01;
+  data[2] = start >> 8;
+  data[3] = start & 0xFF;
+  data[4] = count >> 8;
+  data[5] = count & 0xFF;
+
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+  finger.writeStructuredPacket(packet);
+  if (finger.getStructuredPacket(&packet) != FINGERPRINT_OK)
+    return FINGERPRINT_PACKETRECIEVEERR;
+  if (packet.type != FINGERPRINT_ACKPACKET)
+    return FINGERPRINT_PACKETRECIEVEERR;
+
+  finger.fingerID = ((uint16_t)packet.data[1] << 8) | packet.data[2];
+  finger.confidence = ((uint16_t)packet.data[3] << 8) | packet.data[4];
+  return packet.data[0];
+}
+
+uint8_t FingerprintManager::searchLibrary() {
+  unsigned long start = micros();
+  SearchStrategy strategy = searchStrategy;
+  uint8_t rc = FINGERPRINT_NOTFOUND;
+
+  if (strategy == SearchStrategy::hotFirst && hotRangeCount > 0) {
+    // most rings come from the same few fingers, a search over a few pages is much faster than over the whole library
+    for (uint8_t i=0; i<hotRangeCount && rc == FINGERPRINT_NOTFOUND; i++)
+      rc = searchRange(FINGERPRINT_HIGHSPEEDSEARCH, hotRanges[i].start, hotRanges[i].count);
+    if (rc == FINGERPRINT_OK)
+      hotRangeHits++;
+    else
+      hotRangeMisses++;
+  }
+  if (rc == FINGERPRINT_NOTFOUND) {
+    if (strategy == SearchStrategy::highSpeed)
+      rc = searchRange(FINGERPRINT_HIGHSPEEDSEARCH, 0, finger.capacity);
+    else
+      rc = searchRange(FINGERPRINT_SEARCH, 0, finger.capacity);
+  }
+
+  if (rc == FINGERPRINT_OK)
+    matchSearchLatency[(int)strategy].record(micros() - start);
+  return rc;
+}
+
+void FingerprintManager::countMatch(uint16_t id) {
+  if (id >= matchCountSlots)
+    return;
+  if (++matchCounts[id] >= MATCH_COUNT_LIMIT) {
+    for (int i=0; i<matchCountSlots; i++)
+      matchCounts[i] /= 2;
+  }
+  updateHotRanges();
+}
+
+void FingerprintManager::resetMatchCount(int id) {
+  if ((id < 0) || (id >= matchCountSlots))
+    return;
+  matchCounts[id] = 0;
+  updateHotRanges();
+}
+
+// Hot ranges cover the HOT_SLOT_COUNT most matched slots. Slots are not moved to pack them together, because the
+// slot is the finger ID published over MQTT, instead nearby slots are merged into one range.
+void FingerprintManager::updateHotRanges() {
+  uint16_t hot[HOT_SLOT_COUNT];
+  uint8_t hotCount = 0;
+  for (int id=0; id<matchCountSlots; id++) {
+    if (matchCounts[id] == 0)
+      continue;
+    // insert sorted by count, keep the top ones
+    int pos = hotCount;
+    while (pos > 0 && matchCounts[hot[pos - 1]] < matchCounts[id])
+      pos--;
+    if (pos >= HOT_SLOT_COUNT)
+      continue;
+    if (hotCount < HOT_SLOT_COUNT)
+      hotCount++;
+    for (int i=hotCount-1; i>pos; i--)
+      hot[i] = hot[i - 1];
+    hot[pos] = id;
+  }
+
+  // ranges in slot order
+  for (uint8_t i=1; i<hotCount; i++) // at most HOT_SLOT_COUNT, insertion sort
+    for (uint8_t j=i; j>0 && hot[j - 1] > hot[j]; j--)
+      std::swap(hot[j - 1], hot[j]);
+  hotRangeCount = 0;
+  for (uint8_t i=0; i<hotCount; i++) {
+    if (hotRangeCount > 0 && hot[i] - (hotRanges[hotRangeCount - 1].start + hotRanges[hotRangeCount - 1].count - 1) <= HOT_RANGE_MAX_GAP) {
+      hotRanges[hotRangeCount - 1].count = hot[i] - hotRanges[hotRangeCount - 1].start + 1;
+    } else {
+      hotRanges[hotRangeCount].start = hot[i];
+      hotRanges[hotRangeCount].count = 1;
+      hotRangeCount++;
+    }
+  }
+}
+
+void FingerprintManager::setSearchStrategy(SearchStrategy strategy) {
+  searchStrategy = strategy;
+}
+
+void FingerprintManager::setScanPolicy(ScanPolicy policy) {
+  policy.ringImagingPasses = max(policy.ringImagingPasses, (uint8_t)1);
+  policy.matchScanPasses = max(policy.matchScanPasses, (uint8_t)1);
+  scanPolicy = policy;
+}
+
+void FingerprintManager::setSleepWhenIdle(bool sleep) {
+  sleepWhenIdle = sleep;
+}
+
+bool FingerprintManager::isSleepWhenIdle() {
+  return sleepWhenIdle;
+}
+
+ScanPolicy FingerprintManager::getScanPolicy() {
+  return scanPolicy;
+}
+
+bool FingerprintManager::isScanBudgetUsed(int64_t startMicros) {
+  return scanPolicy.timeBudgetMs > 0 && esp_timer_get_time() - startMicros >= scanPolicy.timeBudgetMs * 1000LL;
+}
+
+void FingerprintManager::recordScanDecision(const Match &match, int64_t startMicros) {
+  uint32_t micros = (uint32_t)(esp_timer_get_time() - startMicros);
+  if (match.scanResult == ScanResult::matchFound)
+    scanMetrics.timeToUnlock.record(micros);
+  else if (match.scanResult == ScanResult::noMatchFound)
+    scanMetrics.timeToRing.record(micros);
+}
+
+// Every LEDcontrol is a full UART round trip, so only send it if the LED really changes.
+uint8_t FingerprintManager::setLed(uint8_t control, uint8_t speed, uint8_t color) {
+  LedState state;
+  state.control = control;
+  state.speed = speed;
+  state.color = color;
+  if (deferLedUpdates) {
+    if (ledPending)
+      ledStats.suppressed++; // replaced before it was ever sent
+    pendingLed = state;
+    ledPending = true;
+    return FINGERPRINT_OK;
+  }
+  return sendLed(state);
+}
+
+uint8_t FingerprintManager::sendLed(const LedState &state) {
+  if (ledStateValid && state.control == ledState.control && state.speed == ledState.speed && state.color == ledState.color) {
+    ledStats.suppressed++;
+    return FINGERPRINT_OK;
+  }
+  uint8_t rc = finger.LEDcontrol(state.control, state.speed, state.color, 0);
+  ledStats.sent++;
+  ledState = state;
+  ledStateValid = (rc == FINGERPRINT_OK);
+  return rc;
+}
+
+void FingerprintManager::applyPendingLed() {
+  deferLedUpdates = false;
+  if (ledPending) {
+    ledPending = false;
+    sendLed(pendingLed);
+  }
+}
+
+LedStats FingerprintManager::getLedStats() {
+  return ledStats;
+}
+
 void FingerprintManager::setLedRingError() {
-  finger.LEDcontrol(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_RED);
+  setLed(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_RED);
 }
 
 void FingerprintManager::setLedRingWifiConfig() {
-  finger.LEDcontrol(FINGERPRINT_LED_BREATHING, 250, FINGERPRINT_LED_RED);
+  setLed(FINGERPRINT_LED_BREATHING, 250, FINGERPRINT_LED_RED);
 }
 
 void FingerprintManager::setLedRingReady() {
-  finger.LEDcontrol(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_BLUE);
+  setLed(FINGERPRINT_LED_ON, 0, FINGERPRINT_LED_BLUE);
   // if (!ignoreTouchRing)
   //   finger.LEDcontrol(FINGERPRINT_LED_BREATHING, 250, FINGERPRINT_LED_BLUE);
   // else
@@ -466,16 +1215,14 @@ void FingerprintManager::setLedRingReady() {
 bool FingerprintManager::deleteAll() {
   if (finger.emptyDatabase() == FINGERPRINT_OK)
   {
-    bool rc;
-    Preferences preferences;
-    rc = preferences.begin("fingerList", false); 
-    if (rc)
-        rc = preferences.clear();
-    preferences.end();
-
-    for (int i=1; i<=200; i++) {
-        fingerList[i] = String("@empty");
-    };
+    xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+    fingerNames.clearAll();
+    invalidateFingerListHtml();
+    xSemaphoreGive(fingerNamesMutex);
+    bool rc = saveFingerNames();
+    if (matchCounts)
+      memset(matchCounts, 0, matchCountSlots * sizeof(uint16_t));
+    updateHotRanges();
     
     return rc;
   }
@@ -550,12 +1297,402 @@ bool FingerprintManager::setPairingCode(String pairingCode) {
 }
 
 
-// ToDo: support sensor replacement by enable transferring of sensor DB to another sensor
-void FingerprintManager::exportSensorDB() {
+// writes the export file and keeps track of its size and checksum
+class DatabaseWriter {
+  public:
+    Print &out;
+    uint32_t crc = 0;
+    uint32_t bytes = 0;
+    bool failed = false;
+
+    DatabaseWriter(Print &out) : out(out) {}
 
+    void write(const uint8_t *data, size_t length) {
+      if (failed || length == 0)
+        return;
+      if (out.write(data, length) != length) {
+        failed = true; // e.g. client went away
+        return;
+      }
+      crc = crc32_le(crc, data, length);
+      bytes += length;
+    }
+    void writeByte(uint8_t value) {
+      write(&value, 1);
+    }
+    void writeUInt16(uint16_t value) {
+      uint8_t data[2] = { (uint8_t)(value >> 8), (uint8_t)(value & 0xFF) };
+      write(data, sizeof(data));
+    }
+};
+
+class DatabaseReader {
+  public:
+    Stream &in;
+    uint32_t crc = 0;
+    uint32_t bytes = 0;
+    bool failed = false;
+
+    DatabaseReader(Stream &in) : in(in) {}
+
+    bool read(uint8_t *data, size_t length) {
+      if (failed)
+        return false;
+      if (in.readBytes(data, length) != length) {
+        failed = true;
+        return false;
+      }
+      crc = crc32_le(crc, data, length);
+      bytes += length;
+      return true;
+    }
+    uint8_t readByte() {
+      uint8_t value = 0;
+      read(&value, 1);
+      return value;
+    }
+    uint16_t readUInt16() {
+      uint8_t data[2] = { 0, 0 };
+      read(data, sizeof(data));
+      return ((uint16_t)data[0] << 8) | data[1];
+    }
+};
+
+uint8_t FingerprintManager::readIndexTable(uint8_t page, uint8_t *table) {
+  uint8_t data[2];
+
+  data[0] = FINGERPRINT_READINDEXTABLE;
+  data[1] = page;
+
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+  finger.writeStructuredPacket(packet);
+  if (finger.getStructuredPacket(&packet) != FINGERPRINT_OK)
+    return FINGERPRINT_PACKETRECIEVEERR;
+  if (packet.type != FINGERPRINT_ACKPACKET)
+    return FINGERPRINT_PACKETRECIEVEERR;
+
+  if (packet.data[0] == FINGERPRINT_OK)
+    memcpy(table, &packet.data[1], 32);
+  return packet.data[0];
 }
-    
-void FingerprintManager::importSensorDB() {
 
+// data packets have to be small enough for Adafruit_Fingerprint's receive buffer
+uint8_t FingerprintManager::beginDatabaseTransfer() {
+  if (packetLength == SENSOR_DB_TRANSFER_PACKET_SIZE)
+    return FINGERPRINT_OK;
+  return finger.setPacketSize(FINGERPRINT_PACKET_SIZE_32);
 }
 
+void FingerprintManager::endDatabaseTransfer() {
+  // data packets of an aborted transfer may still arrive
+  delay(100);
+  while (sensorLink.available())
+    sensorLink.read();
+
+  switch (packetLength) {
+    case 64: finger.setPacketSize(FINGERPRINT_PACKET_SIZE_64); break;
+    case 128: finger.setPacketSize(FINGERPRINT_PACKET_SIZE_128); break;
+    case 256: finger.setPacketSize(FINGERPRINT_PACKET_SIZE_256); break;
+  }
+}
+
+// UpChar the template in char buffer 1, each data packet becomes a chunk <length><data> in the export file. Without
+// writer only the checksum of the template data is computed.
+uint8_t FingerprintManager::uploadTemplate(DatabaseWriter *writer, uint32_t *templateCrc) {
+  uint8_t data[2];
+
+  data[0] = FINGERPRINT_UPLOAD;
+  data[1] = 0x01;
+
+  Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+  finger.writeStructuredPacket(packet);
+  if (finger.getStructuredPacket(&packet) != FINGERPRINT_OK || packet.type != FINGERPRINT_ACKPACKET)
+    return FINGERPRINT_PACKETRECIEVEERR;
+  if (packet.data[0] != FINGERPRINT_OK)
+    return packet.data[0];
+
+  uint32_t templateSize = 0;
+  *templateCrc = 0;
+  do {
+    if (finger.getStructuredPacket(&packet) != FINGERPRINT_OK)
+      return FINGERPRINT_PACKETRECIEVEERR;
+    if (packet.type != FINGERPRINT_DATAPACKET && packet.type != FINGERPRINT_ENDDATAPACKET)
+      return FINGERPRINT_PACKETRECIEVEERR;
+    uint8_t length = packet.length - 2; // without checksum
+    templateSize += length;
+    if (templateSize > SENSOR_DB_MAX_TEMPLATE_SIZE)
+      return FINGERPRINT_UPLOADFAIL;
+    *templateCrc = crc32_le(*templateCrc, packet.data, length);
+    if (writer) {
+      writer->writeByte(length);
+      writer->write(packet.data, length);
+    }
+  } while (packet.type != FINGERPRINT_ENDDATAPACKET);
+  if (writer)
+    writer->writeByte(0);
+
+  return (writer && writer->failed) ? FINGERPRINT_UPLOADFAIL : FINGERPRINT_OK;
+}
+
+// DownChar the next template of the export file into char buffer 1. The chunks are repacked into data packets of the
+// transfer size, the last one has to be marked as end packet, so a full packet is only sent once more data follows.
+uint8_t FingerprintManager::downloadTemplate(DatabaseReader &reader, bool toSensor, uint32_t *templateCrc) {
+  uint8_t data[2];
+
+  uint8_t ackCode = FINGERPRINT_OK;
+  if (toSensor) {
+    data[0] = FINGERPRINT_DOWNCHAR;
+    data[1] = 0x01;
+
+    Adafruit_Fingerprint_Packet packet(FINGERPRINT_COMMANDPACKET, sizeof(data), data);
+    finger.writeStructuredPacket(packet);
+    if (finger.getStructuredPacket(&packet) != FINGERPRINT_OK || packet.type != FINGERPRINT_ACKPACKET)
+      ackCode = FINGERPRINT_PACKETRECIEVEERR;
+    else
+      ackCode = packet.data[0];
+    toSensor = (ackCode == FINGERPRINT_OK); // otherwise the template is only skipped in the file
+  }
+
+  uint8_t chunk[255];
+  uint8_t pending[SENSOR_DB_TRANSFER_PACKET_SIZE];
+  uint8_t pendingLength = 0;
+  uint32_t templateSize = 0;
+  *templateCrc = 0;
+  for (;;) {
+    uint8_t chunkLength = reader.readByte();
+    if (chunkLength == 0 || !reader.read(chunk, chunkLength))
+      break;
+    *templateCrc = crc32_le(*templateCrc, chunk, chunkLength);
+    templateSize += chunkLength;
+    if (templateSize > SENSOR_DB_MAX_TEMPLATE_SIZE)
+      return FINGERPRINT_BADPACKET;
+    for (uint8_t i=0; i<chunkLength; i++) {
+      if (pendingLength == sizeof(pending)) {
+        if (toSensor) {
+          Adafruit_Fingerprint_Packet packet(FINGERPRINT_DATAPACKET, pendingLength, pending);
+          finger.writeStructuredPacket(packet);
+        }
+        pendingLength = 0;
+      }
+      pending[pendingLength++] = chunk[i];
+    }
+  }
+  if (reader.failed || templateSize == 0)
+    return FINGERPRINT_BADPACKET; // the sensor waits for the end packet, endDatabaseTransfer() cleans up
+
+  if (toSensor) {
+    Adafruit_Fingerprint_Packet packet(FINGERPRINT_ENDDATAPACKET, pendingLength, pending);
+    finger.writeStructuredPacket(packet);
+  }
+  return ackCode;
+}
+
+DatabaseTransfer FingerprintManager::exportSensorDB(Print &out) {
+  DatabaseTransfer result;
+  unsigned long start = micros();
+
+  // find the occupied pages first, the file header carries the count
+  uint8_t indexTable[SENSOR_INDEX_TABLE_PAGES][32];
+  uint16_t count = 0;
+  int pages = min((finger.capacity + 255) / 256, SENSOR_INDEX_TABLE_PAGES);
+  for (int page=0; page<pages; page++) {
+    uint8_t rc = readIndexTable(page, indexTable[page]);
+    if (rc != FINGERPRINT_OK) {
+      result.error = String("Reading index table failed (Code ") + rc + ")";
+      return result;
+    }
+    for (int i=0; i<256; i++)
+      if ((page * 256 + i < finger.capacity) && (indexTable[page][i / 8] & (1 << (i % 8))))
+        count++;
+  }
+
+  uint8_t rc = beginDatabaseTransfer();
+  if (rc != FINGERPRINT_OK) {
+    result.error = String("Setting packet size failed (Code ") + rc + ")";
+    return result;
+  }
+
+  DatabaseWriter writer(out);
+  writer.write((const uint8_t*)SENSOR_DB_MAGIC, 4);
+  writer.writeByte(SENSOR_DB_VERSION);
+  writer.writeUInt16(count);
+
+  for (uint16_t id=0; id<finger.capacity && !writer.failed && result.error.isEmpty(); id++) {
+    if (!(indexTable[id / 256][(id % 256) / 8] & (1 << (id % 8))))
+      continue;
+
+    rc = finger.loadModel(id);
+    if (rc == FINGERPRINT_OK) {
+      char name[FINGER_NAME_BUFFER_SIZE];
+      uint8_t nameLength = copyFingerName(id, name, sizeof(name)) ? strlen(name) : 0;
+      writer.writeUInt16(id);
+      writer.writeByte(nameLength);
+      writer.write((const uint8_t*)name, nameLength);
+      uint32_t templateCrc;
+      rc = uploadTemplate(&writer, &templateCrc);
+    }
+    if (rc != FINGERPRINT_OK)
+      result.error = String("Exporting template #") + id + " failed (Code " + rc + ")";
+    else
+      result.templates++;
+  }
+
+  // checksum over everything before it
+  uint32_t crc = writer.crc;
+  uint8_t trailer[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+  writer.write(trailer, sizeof(trailer));
+
+  endDatabaseTransfer();
+  if (writer.failed && result.error.isEmpty())
+    result.error = "Export aborted";
+  result.ok = result.error.isEmpty() && result.templates == count;
+  result.bytes = writer.bytes;
+  result.micros = micros() - start;
+  return result;
+}
+
+// Loads a stored slot back and compares its template with the one written, a difference counts as flash error.
+uint8_t FingerprintManager::verifyTemplate(uint16_t id, uint32_t templateCrc) {
+  uint8_t rc = finger.loadModel(id);
+  uint32_t storedCrc = 0;
+  if (rc == FINGERPRINT_OK)
+    rc = uploadTemplate(NULL, &storedCrc);
+  if (rc == FINGERPRINT_OK && storedCrc != templateCrc)
+    rc = FINGERPRINT_FLASHERR;
+  return rc;
+}
+
+DatabaseTransfer FingerprintManager::importSensorDB(Stream &in) {
+  return importTemplates(in, false);
+}
+
+DatabaseTransfer FingerprintManager::provisionSensorDB(Stream &in) {
+  return importTemplates(in, true);
+}
+
+void FingerprintManager::publishProvisionReport(const ProvisionReport &report) {
+  portENTER_CRITICAL(&provisionMux);
+  provisionReport = report;
+  portEXIT_CRITICAL(&provisionMux);
+}
+
+ProvisionReport FingerprintManager::getProvisionReport() {
+  portENTER_CRITICAL(&provisionMux);
+  ProvisionReport report = provisionReport;
+  portEXIT_CRITICAL(&provisionMux);
+  return report;
+}
+
+// Import stops at the first template that fails. Provisioning goes on with the next one, verifies every stored slot by
+// reading its template back and reports the failed slots. Either way the names are saved once at the end.
+DatabaseTransfer FingerprintManager::importTemplates(Stream &in, bool provision) {
+  DatabaseTransfer result;
+  unsigned long start = micros();
+  DatabaseReader reader(in);
+  ProvisionReport report;
+  report.running = true;
+  if (provision)
+    publishProvisionReport(report);
+
+  uint8_t magic[4];
+  reader.read(magic, sizeof(magic));
+  uint8_t version = reader.readByte();
+  uint16_t count = reader.readUInt16();
+  uint8_t rc = FINGERPRINT_OK;
+  if (reader.failed || memcmp(magic, SENSOR_DB_MAGIC, sizeof(magic)) != 0)
+    result.error = "Not a fingerprint database file";
+  else if (version < 1 || version > SENSOR_DB_VERSION)
+    result.error = String("Unsupported database version ") + version;
+  else if ((rc = beginDatabaseTransfer()) != FINGERPRINT_OK)
+    result.error = String("Setting packet size failed (Code ") + rc + ")";
+  if (!result.error.isEmpty()) {
+    if (provision) {
+      report.running = false;
+      strlcpy(report.error, result.error.c_str(), sizeof(report.error));
+      publishProvisionReport(report);
+    }
+    return result;
+  }
+
+  for (uint16_t i=0; i<count && result.error.isEmpty(); i++) {
+    uint16_t id = reader.readUInt16();
+    uint8_t nameLength = reader.readByte();
+    char name[256];
+    reader.read((uint8_t*)name, nameLength);
+    name[nameLength] = 0;
+    if (reader.failed) {
+      result.error = "Database file is truncated";
+      break;
+    }
+
+    bool fits = isValidId(id); // the file may come from a bigger sensor or have a template in the unused page 0
+    ProvisionStage stage = ProvisionStage::download;
+    uint32_t templateCrc;
+    rc = downloadTemplate(reader, fits, &templateCrc);
+    if (rc == FINGERPRINT_OK && fits) {
+      stage = ProvisionStage::store;
+      rc = finger.storeModel(id);
+    }
+    if (rc == FINGERPRINT_OK && fits && provision) {
+      stage = ProvisionStage::verify;
+      rc = verifyTemplate(id, templateCrc);
+    }
+    if (rc != FINGERPRINT_OK && (!provision || rc == FINGERPRINT_BADPACKET)) {
+      // the position in the file is lost after a bad template, nothing after it can be read
+      result.error = String("Importing template #") + id + " failed (Code " + rc + ")";
+    } else if (rc != FINGERPRINT_OK) {
+      Serial.printf("Provisioning template #%u failed (Code %u)\n", id, rc);
+      if (report.errorCount < PROVISION_MAX_ERRORS)
+        report.errors[report.errorCount++] = { id, rc, stage };
+      report.failed++;
+    } else if (!fits) {
+      Serial.println(String("Template #") + id + " does not fit into this sensor, skipped.");
+      if (result.skipped < DATABASE_MAX_SKIPPED_IDS)
+        result.skippedIds[result.skipped] = id;
+      result.skipped++;
+    } else {
+      xSemaphoreTake(fingerNamesMutex, portMAX_DELAY);
+      bool fits = fingerNames.set(id, name);
+      invalidateFingerListHtml();
+      xSemaphoreGive(fingerNamesMutex);
+      if (!fits)
+        notifyClients(LogCode::nameTruncated, id);
+      resetMatchCount(id); // a new finger in this slot
+      result.templates++;
+    }
+    if (provision) {
+      report.templates = result.templates;
+      report.skipped = result.skipped;
+      memcpy(report.skippedIds, result.skippedIds, sizeof(report.skippedIds));
+      report.bytes = reader.bytes;
+      report.micros = micros() - start;
+      publishProvisionReport(report);
+    }
+  }
+
+  if (result.error.isEmpty()) {
+    uint32_t crc = reader.crc;
+    uint8_t trailer[4];
+    reader.read(trailer, sizeof(trailer));
+    uint32_t fileCrc = ((uint32_t)trailer[0] << 24) | ((uint32_t)trailer[1] << 16) | ((uint32_t)trailer[2] << 8) | trailer[3];
+    if (reader.failed || fileCrc != crc)
+      result.error = "Checksum mismatch, the database file is damaged";
+  }
+
+  if (result.templates)
+    saveFingerNames(); // once for all imported names
+
+  endDatabaseTransfer();
+  result.ok = result.error.isEmpty();
+  result.bytes = reader.bytes;
+  result.micros = micros() - start;
+  if (provision) {
+    report.running = false;
+    report.ok = result.ok && report.failed == 0;
+    report.micros = result.micros;
+    report.bytes = result.bytes;
+    strlcpy(report.error, result.error.c_str(), sizeof(report.error));
+    publishProvisionReport(report);
+  }
+  return result;
+}
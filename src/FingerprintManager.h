@@ -3,12 +3,51 @@
 
 #include <Adafruit_Fingerprint.h>
 #include <Preferences.h>
+#include "SensorLink.h"
+#include "FingerNameTable.h"
+#include "Metrics.h"
 #include "global.h"
 
 #define mySerial Serial2
 
 #define FINGERPRINT_WRITENOTEPAD 0x18 // Write Notepad on sensor
 #define FINGERPRINT_READNOTEPAD 0x19 // Read Notepad from sensor
+#define FINGERPRINT_SLEEP 0x33 // put sensor into sleep state, a touch wakes it up again
+#define FINGERPRINT_DOWNCHAR 0x09 // download a template from host into a char buffer
+#define FINGERPRINT_READINDEXTABLE 0x1F // bitmap of occupied template pages
+#define FINGERPRINT_HIGHSPEEDSEARCH 0x1B
+
+#define SENSOR_DEFAULT_BAUDRATE 57600 // factory setting of the sensor
+#define SENSOR_BAUDRATE 115200 // rate negotiated after connect, the R503 supports up to 12x9600
+#define SENSOR_BAUDRATE_SWITCH_DELAY_MS 50
+#define SENSOR_CONNECT_TIMEOUT_MS 7000 // give up probing the sensor after this
+#define SENSOR_PROBE_INTERVAL_MS 100
+#define SENSOR_WAKE_RETRIES 3
+#define POLL_INTERVAL_MIN_MS 5 // getImage interval in rain mode while something is on the sensor
+#define POLL_INTERVAL_MAX_MS 200 // slowest getImage interval in rain mode after a long idle period
+#define POLL_BACKOFF_DELAY_MS 30000 // stay at full rate this long after the last image was taken
+#define POLL_RATE_WINDOW_MS 60000
+
+// sensor database export file: "FPDB", version, template count, records, crc32
+#define SENSOR_DB_MAGIC "FPDB"
+#define SENSOR_DB_VERSION 1
+#define SENSOR_DB_TRANSFER_PACKET_SIZE 32 // Adafruit_Fingerprint cannot receive larger data packets
+#define SENSOR_DB_MAX_TEMPLATE_SIZE 4096 // guard against a sensor sending data packets forever
+#define SENSOR_INDEX_TABLE_PAGES 4 // 256 templates each
+
+#define ENROLL_SAMPLES 5 // images combined into one template
+#define ENROLL_STEP_TIMEOUT_MS 30000 // enrollment is given up if the finger is not placed or removed within this time
+#define ENROLL_POLL_INTERVAL_MS 50 // pause between two steps of an enrollment
+
+#define PROVISION_MAX_ERRORS 16 // failed slots listed in the provisioning report, more are only counted
+#define DATABASE_MAX_SKIPPED_IDS 16 // ids of an import file without a slot in this sensor that are listed, more are only counted
+
+#define HOT_SLOT_COUNT 4 // most frequently matched fingers searched first with SearchStrategy::hotFirst
+#define HOT_RANGE_MAX_GAP 8 // hot slots closer than this are searched as one range
+#define MATCH_COUNT_LIMIT 1000 // match counts are halved when one reaches this, so old habits fade
+#define FINGER_NAME_BUFFER_SIZE (FINGER_NAME_MAX_LENGTH + 1)
+#define FINGER_NAMES_KEY "names" // blob with all names in the "fingerList" namespace
+#define FINGER_NAMES_VERSION 1
 
 
 /*
@@ -18,48 +57,268 @@
 const int touchRingPin = PIN_WAKE;     // touch/wakeup pin connected to fingerprint sensor
 
 enum class ScanResult { noFinger, matchFound, noMatchFound, error };
-enum class EnrollResult { ok, error };
+enum class EnrollState : uint8_t { idle, placeFinger, removeFinger, done, failed, timedOut, cancelled };
+enum class SearchStrategy { full, highSpeed, hotFirst, count }; // hotFirst searches the hot ranges first, full search on miss
 
+// plain data only, a scan must not touch the heap. The name of a match is looked up by matchId when needed.
 struct Match {
   ScanResult scanResult = ScanResult::noFinger;
   uint16_t matchId = 0;
-  String matchName = "Nobody";
   uint16_t matchConfidence = 0;
   uint8_t returnCode = 0;
 };
 
-struct NewFinger {
-  EnrollResult enrollResult = EnrollResult::error;
-  uint8_t returnCode = 0;
+struct WakeStats {
+  uint32_t wakeups = 0; // touch ring interrupts
+  uint32_t latencyCount = 0;
+  uint32_t lastLatencyMicros = 0; // touch ring interrupt to first image taken
+  uint32_t maxLatencyMicros = 0;
+  uint64_t totalLatencyMicros = 0;
+};
+
+struct PollStats {
+  uint32_t intervalMs = 0; // current poll interval
+  uint32_t pollsPerMinute = 0; // scans that talked to the sensor
+  uint32_t transactionsPerMinute = 0; // UART round trips
+};
+
+struct LedState {
+  uint8_t control = 0;
+  uint8_t speed = 0;
+  uint8_t color = 0;
+};
+
+struct LedStats {
+  uint32_t sent = 0;
+  uint32_t suppressed = 0; // LED already was in the requested state or a deferred state was replaced before sending
+};
+
+// When scanFingerprint() gives up and reports a ring (noMatchFound). The defaults are the passes that were fixed before.
+struct ScanPolicy {
+  uint8_t ringImagingPasses = 15; // getImage passes without a finger after the touch ring was touched
+  uint8_t matchScanPasses = 5; // searches without a match
+  uint16_t timeBudgetMs = 0; // per scan, no further pass is started once it is used up, 0 for no limit
+  uint8_t ringNoFingerExit = 0; // FINGERPRINT_NOFINGER replies in a row after a touch ring touch that are a ring at once, 0 for off
+};
+
+struct ScanMetrics {
+  LatencyHistogram scan; // whole scan, only if it talked to the sensor
+  LatencyHistogram timeToRing; // scan start until noMatchFound was decided
+  LatencyHistogram timeToUnlock; // scan start until matchFound
+  LatencyHistogram imaging; // getImage including retries
+  LatencyHistogram getImage; // single getImage round trip
+  LatencyHistogram image2Tz;
+  LatencyHistogram search;
+  ReturnCodeCounter getImageCodes;
+  ReturnCodeCounter image2TzCodes;
+  ReturnCodeCounter searchCodes;
+  uint32_t budgetExits = 0; // decided by ScanPolicy::timeBudgetMs before the passes were used up
+  uint32_t noFingerExits = 0; // decided by ScanPolicy::ringNoFingerExit
 };
 
+struct DatabaseTransfer {
+  bool ok = false;
+  uint16_t templates = 0;
+  uint32_t bytes = 0; // size of the export file
+  uint32_t micros = 0;
+  uint16_t skipped = 0; // templates with an id this sensor has no slot for, not imported
+  uint16_t skippedIds[DATABASE_MAX_SKIPPED_IDS] = {};
+  String error;
+};
+
+enum class ProvisionStage : uint8_t { download, store, verify };
+
+struct SlotError {
+  uint16_t id;
+  uint8_t returnCode;
+  ProvisionStage stage;
+};
+
+// plain data, copied while provisioning is running to show its progress
+struct ProvisionReport {
+  bool running = false;
+  bool ok = false; // all templates of the file were stored and verified
+  uint16_t templates = 0; // stored and verified
+  uint16_t skipped = 0; // id this sensor has no slot for, see skippedIds
+  uint16_t skippedIds[DATABASE_MAX_SKIPPED_IDS] = {};
+  uint16_t failed = 0;
+  uint32_t bytes = 0;
+  uint32_t micros = 0;
+  uint8_t errorCount = 0;
+  SlotError errors[PROVISION_MAX_ERRORS];
+  char error[64] = ""; // the file as a whole, e.g. a checksum mismatch
+};
+
+// followed by the records of FingerNameTable::serialize()
+struct FingerNamesHeader {
+  uint8_t version = FINGER_NAMES_VERSION;
+  uint8_t reserved = 0;
+  uint16_t count = 0;
+  uint32_t length = 0; // of the records
+  uint32_t crc = 0; // of the records
+};
+
+class DatabaseWriter;
+class DatabaseReader;
+
+struct SlotRange {
+  uint16_t start = 0;
+  uint16_t count = 0;
+};
+
+struct EnrollProgress {
+  EnrollState state = EnrollState::idle;
+  uint16_t id = 0;
+  uint8_t sample = 0; // 1 to ENROLL_SAMPLES, the one being taken
+  uint8_t returnCode = 0; // of the sensor command that failed
+};
+
+extern void notifyEnrollProgress(const EnrollProgress &progress); // on every change of the state or sample
+
 class FingerprintManager {       
   private:
-    Adafruit_Fingerprint finger = Adafruit_Fingerprint(&mySerial);
+    SensorLink sensorLink;
+    Adafruit_Fingerprint finger;
     bool lastTouchState = false;
-    String fingerList[201];
+    FingerNameTable fingerNames;
+    SemaphoreHandle_t fingerNamesMutex; // fingerNames is written by the sensor task and read by main loop and webserver
+    char *fingerListHtml = NULL; // rendered <option> list, only rebuilt after the names changed
+    size_t fingerListHtmlLength = 0;
+    bool fingerListHtmlValid = false;
+    uint32_t fingerListGeneration = 0; // incremented whenever the names change
+    uint32_t fingerListRenderMicros = 0;
+    Preferences namePreferences; // opened once at boot, names are saved on every change
+    uint32_t nameLoadMicros = 0;
+    bool namesMigrated = false; // loaded from the old per-key layout at boot
     int fingerCountOnSensor = 0;
     bool ignoreTouchRing = false; // set to true when the sensor is usually exposed to rain to avoid false ring events. Can also be set conditional by a rain sensor over MQTT
     bool lastIgnoreTouchRing = false;
+    volatile bool ringTouchLatched = false; // set by the touch ring interrupt, the ring signal is only a short pulse
+    volatile int64_t ringTouchMicros = 0; // time of the last touch ring interrupt, 0 once the image was taken
+    volatile uint32_t wakeups = 0;
+    WakeStats wakeStats;
+    bool sensorSleeping = false;
+    uint16_t packetLength = 128; // data packet size of the sensor, read on connect
+    uint32_t pollIntervalMinMs = POLL_INTERVAL_MIN_MS;
+    uint32_t pollIntervalMaxMs = POLL_INTERVAL_MAX_MS;
+    uint32_t pollIntervalMs = POLL_INTERVAL_MIN_MS;
+    unsigned long lastImageMillis = 0;
+    uint32_t sensorPolls = 0;
+    unsigned long rateWindowStart = 0;
+    uint32_t rateWindowPolls = 0;
+    uint32_t rateWindowTransactions = 0;
+    PollStats pollStats;
+    LedState ledState; // last state commanded to the sensor
+    bool ledStateValid = false; // false if unknown, e.g. after connect or sleep
+    LedState pendingLed;
+    bool ledPending = false;
+    bool deferLedUpdates = false; // set while scanning, LED changes are sent by applyPendingLed()
+    LedStats ledStats;
+    ScanMetrics scanMetrics;
+    ScanPolicy scanPolicy;
+    SearchStrategy searchStrategy = SearchStrategy::full;
+    bool sleepWhenIdle = false; // the LED ring is dark while the sensor sleeps, so this is off by default
+    uint16_t *matchCounts = NULL; // per slot, for the hot ranges, sized like fingerNames
+    uint16_t matchCountSlots = 0;
+    SlotRange hotRanges[HOT_SLOT_COUNT];
+    uint8_t hotRangeCount = 0;
+    uint32_t hotRangeHits = 0;
+    uint32_t hotRangeMisses = 0;
+    LatencySamples matchSearchLatency[(int)SearchStrategy::count]; // search duration of scans that found a match
+    EnrollProgress enrollProgress; // written by the sensor task, read by the webserver
+    portMUX_TYPE enrollMux = portMUX_INITIALIZER_UNLOCKED;
+    char enrollName[FINGER_NAME_MAX_LENGTH + 1] = "";
+    unsigned long enrollStepMillis = 0; // when the current step was entered, for the timeout
+    volatile bool enrollCancelRequested = false;
+    ProvisionReport provisionReport; // written by the sensor task, read by the webserver
+    portMUX_TYPE provisionMux = portMUX_INITIALIZER_UNLOCKED;
     
     void updateTouchState(bool touched);
     bool isRingTouched();
+    void recordWakeLatency(uint32_t latencyMicros);
+    void enterEnrollSample(uint8_t sample);
+    void setEnrollProgress(EnrollState state, uint8_t sample, uint8_t returnCode);
+    void storeEnrollment(uint16_t id, uint8_t sample);
+    bool isScanBudgetUsed(int64_t startMicros);
+    void recordScanDecision(const Match &match, int64_t startMicros);
+    void schedulePoll(bool imageTaken);
+    uint8_t setLed(uint8_t control, uint8_t speed, uint8_t color);
+    uint8_t sendLed(const LedState &state);
+    uint8_t readIndexTable(uint8_t page, uint8_t *table);
+    uint8_t searchRange(uint8_t instruction, uint16_t start, uint16_t count);
+    uint8_t searchLibrary();
+    bool isValidId(int id); // 1..capacity-1
+    void countMatch(uint16_t id);
+    void resetMatchCount(int id);
+    void updateHotRanges();
+    uint8_t beginDatabaseTransfer();
+    void endDatabaseTransfer();
+    uint8_t uploadTemplate(DatabaseWriter *writer, uint32_t *templateCrc);
+    uint8_t downloadTemplate(DatabaseReader &reader, bool toSensor, uint32_t *templateCrc);
+    uint8_t verifyTemplate(uint16_t id, uint32_t templateCrc);
+    DatabaseTransfer importTemplates(Stream &in, bool provision);
+    void publishProvisionReport(const ProvisionReport &report);
     void loadFingerListFromPrefs();
+    bool loadFingerNamesBlob();
+    int loadLegacyFingerNames();
+    void removeLegacyFingerNames();
+    bool saveFingerNames(); // the whole table as one blob
+    void reportFingerNameTable();
+    void invalidateFingerListHtml(); // callers hold fingerNamesMutex
+    void renderFingerListHtml();
     void disconnect();
+    bool probeBaudRate(uint32_t baudRate);
+    bool negotiateBaudRate(uint32_t baudRate);
+    void measureRoundTrips();
+    uint32_t loadSensorBaudRate();
+    void saveSensorBaudRate(uint32_t baudRate);
     uint8_t writeNotepad(uint8_t pageNumber, const char *text, uint8_t length);
     uint8_t readNotepad(uint8_t pageNumber, char *text, uint8_t length);
     
 
 
   public:
+    FingerprintManager(HardwareSerial *sensorSerial);
+    FingerprintManager(Stream *sensorStream); // e.g. an R503Emulator instead of the real sensor
     bool connected;
     bool connect();
-    Match scanFingerprint();
-    NewFinger enrollFinger(int id, String name);
+    Match scanFingerprint(); // LED changes are deferred, call applyPendingLed() once the result was handed over
+    void applyPendingLed();
+    LedStats getLedStats();
+    void printMetrics(Print &out); // Prometheus text format
+    // Enrollment, driven by the sensor task: startEnroll() and then stepEnroll() until it returns false, which happens
+    // when the finger was stored, on error, after ENROLL_STEP_TIMEOUT_MS without progress or after cancelEnroll().
+    bool startEnroll(int id, const String &name);
+    bool stepEnroll(); // one getImage round trip, true while the enrollment goes on
+    bool cancelEnroll(); // from any task, false if no enrollment is running
+    bool isEnrolling();
+    EnrollProgress getEnrollProgress(); // the last one stays until the next enrollment is started
     void deleteFinger(int id);
     void renameFinger(int id, String newName);
-    String getFingerListAsHtmlOptionList();
+    // HTML-escaped <option> list of all fingers. Chunks are read for chunked responses, generation is set by the first
+    // chunk and no more data is returned if the list changed in between.
+    size_t readFingerListHtml(size_t offset, uint8_t *buffer, size_t size, uint32_t &generation);
+    const char *lockFingerListHtml(); // the whole list, valid until unlockFingerListHtml()
+    void unlockFingerListHtml();
+    bool copyFingerName(int id, char *name, size_t size); // without allocation, false (and name empty) for an empty slot
+    int nextFinger(int id, char *name, size_t size); // next enrolled id after id and its name, -1 if there is none
+    uint16_t getFingerCount();
+    uint16_t getCapacity();
     void setIgnoreTouchRing(bool state);
+    void setSearchStrategy(SearchStrategy strategy);
+    void setScanPolicy(ScanPolicy policy); // before the sensor task is started
+    void setSleepWhenIdle(bool sleep); // put the sensor to sleep while waiting for a touch
+    bool isSleepWhenIdle();
+    ScanPolicy getScanPolicy();
+    void IRAM_ATTR onRingTouched(); // called from the touch ring interrupt
+    bool isWaitingForTouch();
+    void sleepSensor();
+    bool wakeSensor();
+    WakeStats getWakeStats();
+    void setPollInterval(uint32_t minMs, uint32_t maxMs);
+    uint32_t getPollIntervalMs(); // pause until the next scanFingerprint()
+    void updatePollStats();
+    PollStats getPollStats();
     bool isFingerOnSensor();
     void setLedRingError();
     void setLedRingWifiConfig();
@@ -70,9 +329,11 @@ class FingerprintManager {
     bool deleteAll();
 
     
-    // functions for sensor replacement
-    void exportSensorDB();
-    void importSensorDB();
+    // functions for sensor replacement, templates are streamed one by one
+    DatabaseTransfer exportSensorDB(Print &out);
+    DatabaseTransfer importSensorDB(Stream &in);
+    DatabaseTransfer provisionSensorDB(Stream &in); // like importSensorDB(), but goes on after a failed slot, see getProvisionReport()
+    ProvisionReport getProvisionReport(); // of the running or last provisioning
 
 };
 
@@ -0,0 +1,32 @@
+#ifndef FINGERSJSON_H
+#define FINGERSJSON_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "FingerprintManager.h"
+
+#define API_FINGERS_PAGE_SIZE 50 // default and maximum limit of /api/v1/fingers
+
+// {"total":n,"offset":o,"limit":l,"fingers":[{"id":1,"name":"..."},...]}. next(id, name, size) returns the next
+// enrolled id after id and copies its name like FingerprintManager::nextFinger(), so no list of all fingers is built.
+template <typename NextFinger>
+size_t printFingersJson(Print &out, NextFinger next, uint16_t total, int offset, int limit) {
+  char name[FINGER_NAME_BUFFER_SIZE];
+  JsonDocument item; // reused, values are replaced for every finger
+  size_t length = out.printf("{\"total\":%u,\"offset\":%d,\"limit\":%d,\"fingers\":[", total, offset, limit);
+  int id = next(-1, name, sizeof(name));
+  for (int i=0; i<offset && id >= 0; i++)
+    id = next(id, name, sizeof(name));
+  for (int i=0; i<limit && id >= 0; i++) {
+    item["id"] = id;
+    item["name"] = (const char*)name;
+    if (i > 0)
+      length += out.print(',');
+    length += serializeJson(item, out);
+    id = next(id, name, sizeof(name));
+  }
+  length += out.print("]}");
+  return length;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include "LogBuffer.h"
+
+struct LogFormat {
+  const char *format; // %d takes the next argument, %s the text
+  LogSeverity severity;
+};
+
+// in the order of LogCode
+static const LogFormat logFormats[(int)LogCode::count] = {
+  { "%s", LogSeverity::info },
+  { "System booted successfully!", LogSeverity::info },
+  { "System is rebooting now...", LogSeverity::info },
+  { "Warning: Stored finger names are damaged and could not be loaded.", LogSeverity::warning },
+  { "Warning: Fingerprint count mismatch! %d fingerprints stored on sensor, but we are aware of %d fingerprints.", LogSeverity::warning },
+  { "Saving finger names failed, out of memory.", LogSeverity::error },
+  { "Saving finger names failed.", LogSeverity::error },
+  { "Name of finger #%d was shortened, it is too long or there is not enough memory for it.", LogSeverity::warning },
+  { "Enrollment for id #%d started. We need to scan your finger 5 times until enrollment is completed.", LogSeverity::info },
+  { "Take #%d (place your finger on the sensor until led ring stops flashing, then remove it).", LogSeverity::info },
+  { "Enrollment successfull. You can now use your new finger for scanning.", LogSeverity::info },
+  { "Enrollment failed. (Code %d)", LogSeverity::error },
+  { "Enrollment timed out after %d seconds without progress, scanning again.", LogSeverity::warning },
+  { "Enrollment cancelled.", LogSeverity::info },
+  { "Invalid memory slot id '%s'", LogSeverity::warning },
+  { "Delete of finger template #%d from sensor failed with code %d", LogSeverity::error },
+  { "Finger database could not be deleted.", LogSeverity::error },
+  { "App settings could not be deleted.", LogSeverity::error },
+  { "Wifi settings could not be deleted.", LogSeverity::error },
+  { "Factory reset initiated...", LogSeverity::info },
+  { "Deleting all fingerprints...", LogSeverity::info },
+  { "Sensor is busy, please try again later.", LogSeverity::warning },
+  { "Another database transfer is running.", LogSeverity::warning },
+  { "Importing fingerprint database %s...", LogSeverity::info },
+  { "Provisioning fingerprint templates (%d bytes)...", LogSeverity::info },
+  { "Pairing successful.", LogSeverity::info },
+  { "Pairing failed.", LogSeverity::error },
+  { "Pairing failed, sensor is busy.", LogSeverity::error },
+  { "Security issue! Pairing with sensor is invalid. This could potentially be an attack! If the sensor is new or has been replaced by you do a (re)pairing in settings page. MQTT messages regarding matching fingerprints will not been sent until pairing is valid again.", LogSeverity::error },
+  { "Security issue! Match was not sent by MQTT because of invalid sensor pairing! This could potentially be an attack! If the sensor is new or has been replaced by you do a (re)pairing in settings page.", LogSeverity::error },
+  { "Match Found: %d - %s with confidence of %d", LogSeverity::info },
+  { "No Match Found (Code %d)", LogSeverity::info },
+  { "ScanResult Error (Code %d)", LogSeverity::error },
+  { "IgnoreTouchRing is now '%s'", LogSeverity::info },
+  { "The name is too long (%d bytes), at most %d bytes are allowed.", LogSeverity::warning },
+};
+
+const LogEntry &LogBuffer::add(time_t time, LogCode code, int32_t arg0, int32_t arg1, const char *text) {
+  lastId++;
+  LogEntry &entry = entries[lastId % LOG_HISTORY_SIZE];
+  entry.id = lastId;
+  entry.time = time;
+  entry.code = (code < LogCode::count) ? code : LogCode::text;
+  entry.severity = getSeverity(entry.code);
+  entry.args[0] = arg0;
+  entry.args[1] = arg1;
+  strlcpy(entry.text, text ? text : "", sizeof(entry.text));
+  return entry;
+}
+
+uint32_t LogBuffer::getLastId() {
+  return lastId;
+}
+
+uint32_t LogBuffer::firstIdAfter(uint32_t id) {
+  uint32_t oldest = (lastId >= LOG_HISTORY_SIZE) ? lastId - LOG_HISTORY_SIZE + 1 : 1;
+  return max(id + 1, oldest);
+}
+
+const LogEntry &LogBuffer::get(uint32_t id) {
+  return entries[id % LOG_HISTORY_SIZE];
+}
+
+LogSeverity LogBuffer::getSeverity(LogCode code) {
+  return logFormats[(int)code].severity;
+}
+
+const char *LogBuffer::getSeverityName(LogSeverity severity) {
+  switch (severity) {
+    case LogSeverity::warning: return "warning";
+    case LogSeverity::error: return "error";
+    default: return "info";
+  }
+}
+
+size_t LogBuffer::formatMessage(const LogEntry &entry, char *buffer, size_t size) {
+  if (size == 0)
+    return 0;
+  const char *format = logFormats[(int)entry.code].format;
+  size_t length = 0;
+  int arg = 0;
+  for (const char *p = format; *p && length < size - 1; p++) {
+    int n = 0;
+    if (p[0] == '%' && p[1] == 'd' && arg < 2) {
+      n = snprintf(buffer + length, size - length, "%d", entry.args[arg++]);
+      p++;
+    } else if (p[0] == '%' && p[1] == 's') {
+      n = snprintf(buffer + length, size - length, "%s", entry.text);
+      p++;
+    } else {
+      buffer[length] = *p;
+      n = 1;
+    }
+    length = min(length + n, size - 1);
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+size_t LogBuffer::format(const LogEntry &entry, char *buffer, size_t size) {
+  if (size == 0)
+    return 0;
+  char timestamp[TIMESTAMP_BUFFER_SIZE];
+  WallClock::formatTime(entry.time, timestamp, sizeof(timestamp));
+  size_t length = min((size_t)snprintf(buffer, size, "[%s]: ", timestamp), size - 1);
+  return length + formatMessage(entry, buffer + length, size - length);
+}
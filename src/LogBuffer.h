@@ -0,0 +1,85 @@
+#ifndef LOGBUFFER_H
+#define LOGBUFFER_H
+
+#include <Arduino.h>
+#include <time.h>
+#include "global.h"
+#include "WallClock.h"
+
+#define LOG_TEXT_SIZE 96 // text argument of an entry, longer ones are truncated
+#define LOG_LINE_SIZE 384 // formatted entry including timestamp
+
+enum class LogSeverity : uint8_t { info, warning, error };
+
+// Every log message has a code, its text is only put together from the code and the arguments when it is read.
+enum class LogCode : uint8_t {
+  text, // free text, e.g. a result text of a sensor command
+  booted,
+  rebooting,
+  namesDamaged,
+  fingerCountMismatch,
+  namesSaveNoMemory,
+  namesSaveFailed,
+  nameTruncated,
+  enrollStarted,
+  enrollTake,
+  enrollDone,
+  enrollFailed,
+  enrollTimedOut,
+  enrollCancelled,
+  invalidSlotId,
+  deleteFailed,
+  databaseNotDeleted,
+  appSettingsNotDeleted,
+  wifiSettingsNotDeleted,
+  factoryReset,
+  deletingAll,
+  sensorBusy,
+  transferRunning,
+  importStarted,
+  provisioningStarted,
+  pairingSuccessful,
+  pairingFailed,
+  pairingFailedBusy,
+  pairingInvalid,
+  pairingInvalidMatch,
+  matchFound,
+  noMatchFound,
+  scanError,
+  ignoreTouchRing,
+  nameTooLong,
+  count
+};
+
+struct LogEntry {
+  uint32_t id; // 0 for an unused entry
+  time_t time; // 0 if the clock was not set yet
+  LogCode code;
+  LogSeverity severity;
+  int32_t args[2]; // used by %d in the format of the code, in order
+  char text[LOG_TEXT_SIZE]; // used by %s in the format of the code
+};
+
+/*
+  The last LOG_HISTORY_SIZE log messages as fixed size entries in a ring, nothing is allocated when a message is added.
+  Ids increase with every message, the entry with id i is entries[i % LOG_HISTORY_SIZE]. Not thread-safe, main.cpp
+  guards it with a mutex.
+*/
+class LogBuffer {
+  private:
+    LogEntry entries[LOG_HISTORY_SIZE] = {};
+    uint32_t lastId = 0;
+
+  public:
+    const LogEntry &add(time_t time, LogCode code, int32_t arg0, int32_t arg1, const char *text); // time 0 if unknown
+    uint32_t getLastId();
+    uint32_t firstIdAfter(uint32_t id); // first id after id that is still kept, the entries up to getLastId() follow
+    const LogEntry &get(uint32_t id); // id must be between firstIdAfter(0) and getLastId()
+
+    static LogSeverity getSeverity(LogCode code);
+    static const char *getSeverityName(LogSeverity severity);
+    static size_t formatMessage(const LogEntry &entry, char *buffer, size_t size); // the message only
+    static size_t format(const LogEntry &entry, char *buffer, size_t size); // "[timestamp]: message"
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include "Metrics.h"
+#include <algorithm>
+#include <esp_timer.h>
+
+const uint32_t LatencyHistogram::bucketBounds[LATENCY_BUCKETS] = {
+  500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000, 10000000
+};
+
+void LatencyHistogram::record(uint32_t micros) {
+  int i = 0;
+  while (i < LATENCY_BUCKETS && micros > bucketBounds[i])
+    i++;
+  buckets[i]++;
+  count++;
+  sumMicros += micros;
+  if (micros > maxMicros)
+    maxMicros = micros;
+}
+
+uint32_t LatencyHistogram::getCount() {
+  return count;
+}
+
+uint32_t LatencyHistogram::getMaxMicros() {
+  return maxMicros;
+}
+
+void LatencyHistogram::print(Print &out, const char *name, const char *labels) {
+  const char *separator = labels[0] ? "," : "";
+  uint32_t cumulative = 0;
+  for (int i=0; i<LATENCY_BUCKETS; i++) {
+    cumulative += buckets[i];
+    out.printf("%s_bucket{%s%sle=\"%g\"} %u\n", name, labels, separator, bucketBounds[i] / 1e6, cumulative);
+  }
+  cumulative += buckets[LATENCY_BUCKETS];
+  out.printf("%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, separator, cumulative);
+  if (labels[0]) {
+    out.printf("%s_sum{%s} %.6f\n", name, labels, sumMicros / 1e6);
+    out.printf("%s_count{%s} %u\n", name, labels, count);
+  } else {
+    out.printf("%s_sum %.6f\n", name, sumMicros / 1e6);
+    out.printf("%s_count %u\n", name, count);
+  }
+}
+
+void LatencySamples::record(uint32_t micros) {
+  samples[next] = micros;
+  next = (next + 1) % LATENCY_SAMPLES;
+  if (size < LATENCY_SAMPLES)
+    size++;
+  count++;
+  sumMicros += micros;
+}
+
+uint32_t LatencySamples::getCount() {
+  return count;
+}
+
+uint32_t LatencySamples::percentile(float p) {
+  if (size == 0)
+    return 0;
+  uint32_t sorted[LATENCY_SAMPLES];
+  uint16_t n = size;
+  memcpy(sorted, samples, n * sizeof(uint32_t));
+  uint16_t k = min((int)(p * n), n - 1);
+  std::nth_element(sorted, sorted + k, sorted + n);
+  return sorted[k];
+}
+
+void LatencySamples::print(Print &out, const char *name, const char *labels) {
+  const char *separator = labels[0] ? "," : "";
+  out.printf("%s{%s%squantile=\"0.5\"} %.6f\n", name, labels, separator, percentile(0.5) / 1e6);
+  out.printf("%s{%s%squantile=\"0.99\"} %.6f\n", name, labels, separator, percentile(0.99) / 1e6);
+  if (labels[0]) {
+    out.printf("%s_sum{%s} %.6f\n", name, labels, sumMicros / 1e6);
+    out.printf("%s_count{%s} %u\n", name, labels, count);
+  } else {
+    out.printf("%s_sum %.6f\n", name, sumMicros / 1e6);
+    out.printf("%s_count %u\n", name, count);
+  }
+}
+
+void ReturnCodeCounter::record(uint8_t code) {
+  counts[min((int)code, RETURN_CODE_SLOTS - 1)]++;
+}
+
+void ReturnCodeCounter::print(Print &out, const char *name, const char *labels) {
+  const char *separator = labels[0] ? "," : "";
+  for (int i=0; i<RETURN_CODE_SLOTS; i++) {
+    if (counts[i] == 0)
+      continue;
+    if (i < RETURN_CODE_SLOTS - 1)
+      out.printf("%s{%s%scode=\"0x%02X\"} %u\n", name, labels, separator, i, counts[i]);
+    else
+      out.printf("%s{%s%scode=\"other\"} %u\n", name, labels, separator, counts[i]);
+  }
+}
+
+StageTimer::StageTimer(LatencyHistogram &histogram) : histogram(&histogram), start(micros()) {
+}
+
+StageTimer::~StageTimer() {
+  stop();
+}
+
+void StageTimer::stop() {
+  if (histogram) {
+    histogram->record(micros() - start);
+    histogram = NULL;
+  }
+}
+
+static TaskHandle_t trackedTasks[HEAP_TRACKED_TASKS] = {};
+static volatile uint32_t heapAllocations[HEAP_TRACKED_TASKS] = {};
+static portMUX_TYPE trackedTasksMux = portMUX_INITIALIZER_UNLOCKED;
+
+static int trackedTaskIndex(TaskHandle_t task) {
+  if (task == NULL) // scheduler not running yet
+    return -1;
+  for (int i=0; i<HEAP_TRACKED_TASKS; i++)
+    if (trackedTasks[i] == task)
+      return i;
+  return -1;
+}
+
+void trackHeapAllocations() {
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  portENTER_CRITICAL(&trackedTasksMux);
+  for (int i=0; i<HEAP_TRACKED_TASKS && trackedTaskIndex(task) < 0; i++)
+    if (trackedTasks[i] == NULL)
+      trackedTasks[i] = task;
+  portEXIT_CRITICAL(&trackedTasksMux);
+}
+
+uint32_t getHeapAllocations() {
+  int i = trackedTaskIndex(xTaskGetCurrentTaskHandle());
+  return i < 0 ? 0 : heapAllocations[i];
+}
+
+bool isHeapAllocationTracked() {
+  return trackedTaskIndex(xTaskGetCurrentTaskHandle()) >= 0;
+}
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+// the linker redirects every call of malloc() to __wrap_malloc() and makes the original available as __real_malloc()
+static inline void countHeapAllocation() {
+  int i = trackedTaskIndex(xTaskGetCurrentTaskHandle());
+  if (i >= 0)
+    heapAllocations[i]++; // only the task itself writes its counter
+}
+
+extern "C" {
+  void *__real_malloc(size_t size);
+  void *__real_calloc(size_t count, size_t size);
+  void *__real_realloc(void *ptr, size_t size);
+
+  void *__wrap_malloc(size_t size) {
+    countHeapAllocation();
+    return __real_malloc(size);
+  }
+
+  void *__wrap_calloc(size_t count, size_t size) {
+    countHeapAllocation();
+    return __real_calloc(count, size);
+  }
+
+  void *__wrap_realloc(void *ptr, size_t size) {
+    countHeapAllocation();
+    return __real_realloc(ptr, size);
+  }
+}
+#endif
+
+void IdleAllocations::start() {
+  startCount = getHeapAllocations();
+}
+
+void IdleAllocations::stop(bool idle) {
+  if (!idle)
+    return;
+  uint32_t count = getHeapAllocations() - startCount;
+  iterations++;
+  allocations += count;
+  if (count)
+    allocatingIterations++;
+}
+
+uint32_t IdleAllocations::getIterations() {
+  return iterations;
+}
+
+uint32_t IdleAllocations::getAllocatingIterations() {
+  return allocatingIterations;
+}
+
+uint32_t IdleAllocations::getAllocations() {
+  return allocations;
+}
+
+void BootProfiler::mark(const char *phase) {
+  portENTER_CRITICAL(&mux);
+  if (count < BOOT_PHASES_MAX) {
+    phases[count] = phase;
+    micros[count] = esp_timer_get_time();
+    count++;
+  }
+  portEXIT_CRITICAL(&mux);
+}
+
+// phases are listed in the order they finished, the duration is relative to the one finished before
+void BootProfiler::print(Print &out) {
+  uint32_t previous = 0;
+  for (int i=0; i<count; i++) {
+    out.printf("Boot phase %-12s done after %5u ms (+%u ms)\n", phases[i], micros[i] / 1000, (micros[i] - previous) / 1000);
+    previous = micros[i];
+  }
+}
+
+void BootProfiler::printMetrics(Print &out, const char *name) {
+  for (int i=0; i<count; i++)
+    out.printf("%s{phase=\"%s\"} %.3f\n", name, phases[i], micros[i] / 1e6);
+}
+
+void printMetricHeader(Print &out, const char *name, const char *type, const char *help) {
+  out.printf("# HELP %s %s\n", name, help);
+  out.printf("# TYPE %s %s\n", name, type);
+}
+
+void printMetric(Print &out, const char *name, const char *labels, uint64_t value) {
+  if (labels[0])
+    out.printf("%s{%s} %llu\n", name, labels, (unsigned long long)value);
+  else
+    out.printf("%s %llu\n", name, (unsigned long long)value);
+}
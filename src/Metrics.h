@@ -0,0 +1,112 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+
+/*
+  Small fixed-size building blocks for runtime metrics, printed in the Prometheus text format on /metrics.
+  Metrics are written by one task only and read by the webserver without locking, a scrape may therefore be off by one
+  sample, which is fine for this purpose.
+*/
+
+#define LATENCY_BUCKETS 14
+#define LATENCY_SAMPLES 128 // recent samples kept for percentiles
+#define HEAP_TRACKED_TASKS 2 // tasks whose heap allocations are counted, see trackHeapAllocations()
+#define BOOT_PHASES_MAX 12
+#define RETURN_CODE_SLOTS 33 // sensor confirmation codes 0x00..0x1F, everything else (timeouts, bad packets) in the last slot
+
+class LatencyHistogram {
+  private:
+    static const uint32_t bucketBounds[LATENCY_BUCKETS]; // upper bounds in microseconds
+    uint32_t buckets[LATENCY_BUCKETS + 1] = {}; // last one is +Inf
+    uint32_t count = 0;
+    uint64_t sumMicros = 0;
+    uint32_t maxMicros = 0;
+
+  public:
+    void record(uint32_t micros);
+    uint32_t getCount();
+    uint32_t getMaxMicros();
+    void print(Print &out, const char *name, const char *labels); // samples only, see printMetricHeader()
+};
+
+// the most recent samples, for percentiles that are more precise than the histogram buckets
+class LatencySamples {
+  private:
+    uint32_t samples[LATENCY_SAMPLES];
+    uint16_t next = 0;
+    uint16_t size = 0;
+    uint32_t count = 0;
+    uint64_t sumMicros = 0;
+
+  public:
+    void record(uint32_t micros);
+    uint32_t getCount();
+    uint32_t percentile(float p); // p between 0 and 1, 0 if there are no samples
+    void print(Print &out, const char *name, const char *labels); // as Prometheus summary
+};
+
+class ReturnCodeCounter {
+  private:
+    uint32_t counts[RETURN_CODE_SLOTS] = {};
+
+  public:
+    void record(uint8_t code);
+    void print(Print &out, const char *name, const char *labels);
+};
+
+// measures from construction until stop() or the end of the scope, whatever comes first
+class StageTimer {
+  private:
+    LatencyHistogram *histogram;
+    unsigned long start;
+
+  public:
+    StageTimer(LatencyHistogram &histogram);
+    ~StageTimer();
+    void stop();
+};
+
+/*
+  Heap allocations (malloc, calloc, realloc) are counted per task for tasks registered with trackHeapAllocations().
+  This needs COUNT_HEAP_ALLOCATIONS and the linker to wrap the allocation functions, both are only set for the
+  esp32doit-devkit-v1-diagnostics environment in platformio.ini. Otherwise the counters stay 0.
+*/
+void trackHeapAllocations(); // count the allocations of the calling task from now on
+uint32_t getHeapAllocations(); // of the calling task
+bool isHeapAllocationTracked(); // for the calling task
+
+// heap allocations made during iterations of a loop that had nothing to do, these should always be 0
+class IdleAllocations {
+  private:
+    uint32_t iterations = 0;
+    uint32_t allocatingIterations = 0;
+    uint32_t allocations = 0;
+    uint32_t startCount = 0;
+
+  public:
+    void start();
+    void stop(bool idle); // only idle iterations are counted
+    uint32_t getIterations();
+    uint32_t getAllocatingIterations();
+    uint32_t getAllocations();
+};
+
+// time since boot at which each startup phase was finished
+class BootProfiler {
+  private:
+    const char *phases[BOOT_PHASES_MAX]; // string literals
+    uint32_t micros[BOOT_PHASES_MAX];
+    uint8_t count = 0;
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED; // phases running concurrently mark from their own task
+
+  public:
+    void mark(const char *phase);
+    void print(Print &out); // human readable, with the duration of each phase
+    void printMetrics(Print &out, const char *name); // as gauge samples labeled with the phase, see printMetricHeader()
+};
+
+void printMetricHeader(Print &out, const char *name, const char *type, const char *help);
+void printMetric(Print &out, const char *name, const char *labels, uint64_t value);
+
+#endif
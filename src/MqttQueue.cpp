@@ -0,0 +1,167 @@
+#include "MqttQueue.h"
+#include "Metrics.h"
+
+struct MqttQueueHeader {
+  uint8_t version;
+  uint8_t count;
+  uint16_t eventSize; // layout check, the file is dropped if MqttEvent changed
+};
+
+MqttEvent MqttEvent::person(const char *name, int confidence, int id) {
+  MqttEvent event = {};
+  event.type = MqttEventType::person;
+  event.coalesce = (id < 0 && strcmp(name, "Nobody") == 0); // only the reset after a scan, a ring is an event of its own
+  event.id = id;
+  event.confidence = confidence;
+  strlcpy(event.name, name, sizeof(event.name));
+  return event;
+}
+
+MqttEvent MqttEvent::wifiSignal(int32_t value) {
+  MqttEvent event = {};
+  event.type = MqttEventType::wifiSignal;
+  event.coalesce = true;
+  event.value = value;
+  return event;
+}
+
+MqttQueue::MqttQueue(MqttPublishFunction publish) : publish(publish) {
+}
+
+MqttEvent &MqttQueue::at(uint8_t index) {
+  return events[(head + index) % MQTT_QUEUE_SIZE];
+}
+
+void MqttQueue::removeAt(uint8_t index) {
+  for (uint8_t i=index; i+1<count; i++)
+    at(i) = at(i + 1);
+  count--;
+  dirty = true;
+}
+
+void MqttQueue::begin(fs::FS &fs, const char *path) {
+  this->fs = &fs;
+  this->path = path;
+  File file = fs.open(path);
+  if (!file)
+    return;
+  fileExists = true;
+  MqttQueueHeader header;
+  head = 0;
+  count = 0;
+  if (file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) && header.version == MQTT_QUEUE_VERSION &&
+      header.eventSize == sizeof(MqttEvent) && header.count <= MQTT_QUEUE_SIZE) {
+    while (count < header.count && file.read((uint8_t*)&events[count], sizeof(MqttEvent)) == sizeof(MqttEvent))
+      events[count++].restored = true;
+  }
+  file.close();
+  maxDepth = count;
+  backlog = (count > 0);
+  dirty = true;
+  Serial.printf("%u MQTT events restored from flash\n", count);
+}
+
+void MqttQueue::push(const MqttEvent &event) {
+  if (event.coalesce) {
+    // the last queued event of this type is superseded if it is a state as well
+    for (int i=count-1; i>=0; i--) {
+      if (at(i).type != event.type)
+        continue;
+      if (at(i).coalesce) {
+        removeAt(i);
+        coalescedCount++;
+      }
+      break;
+    }
+  }
+  if (count == MQTT_QUEUE_SIZE) {
+    head = (head + 1) % MQTT_QUEUE_SIZE;
+    count--;
+    droppedCount++;
+  }
+  MqttEvent &queued = at(count);
+  queued = event;
+  if (!queued.restored)
+    queued.queuedMillis = millis();
+  count++;
+  dirty = true;
+  if (count > maxDepth)
+    maxDepth = count;
+}
+
+bool MqttQueue::isExpired(const MqttEvent &event) {
+  if (event.type != MqttEventType::person || event.id <= 0)
+    return false;
+  return event.restored || (millis() - event.queuedMillis > MQTT_MATCH_MAX_AGE_MS);
+}
+
+uint8_t MqttQueue::flush() {
+  uint8_t sent = 0;
+  while (count > 0) {
+    MqttEvent &event = at(0);
+    if (isExpired(event)) {
+      expiredCount++;
+    } else if (publish(event)) {
+      publishedCount++;
+      sent++;
+    } else {
+      backlog = true;
+      break;
+    }
+    head = (head + 1) % MQTT_QUEUE_SIZE;
+    count--;
+    dirty = true;
+  }
+
+  if (count == 0 && backlog) {
+    backlog = false;
+    flushedBatches++;
+    Serial.printf("%u queued MQTT events sent\n", sent);
+  }
+  if (dirty)
+    persist();
+  return sent;
+}
+
+// the file only exists while events are waiting
+void MqttQueue::persist() {
+  if (fs == NULL)
+    return;
+  dirty = false;
+  if (count == 0) {
+    if (fileExists)
+      fs->remove(path);
+    fileExists = false;
+    return;
+  }
+  File file = fs->open(path, FILE_WRITE);
+  if (!file)
+    return;
+  MqttQueueHeader header = { MQTT_QUEUE_VERSION, count, sizeof(MqttEvent) };
+  file.write((const uint8_t*)&header, sizeof(header));
+  for (uint8_t i=0; i<count; i++)
+    file.write((const uint8_t*)&at(i), sizeof(MqttEvent));
+  file.close();
+  fileExists = true;
+  persistCount++;
+}
+
+uint8_t MqttQueue::getDepth() {
+  return count;
+}
+
+void MqttQueue::printMetrics(Print &out) {
+  printMetricHeader(out, "doorbell_mqtt_queue_depth", "gauge", "MQTT events waiting to be sent.");
+  printMetric(out, "doorbell_mqtt_queue_depth", "", count);
+  printMetricHeader(out, "doorbell_mqtt_queue_depth_max", "gauge", "Most MQTT events waiting at the same time since boot.");
+  printMetric(out, "doorbell_mqtt_queue_depth_max", "", maxDepth);
+  printMetricHeader(out, "doorbell_mqtt_events_total", "counter", "MQTT events by outcome. dropped: queue was full, expired: match too old to open the door, coalesced: replaced by a newer state.");
+  printMetric(out, "doorbell_mqtt_events_total", "outcome=\"published\"", publishedCount);
+  printMetric(out, "doorbell_mqtt_events_total", "outcome=\"dropped\"", droppedCount);
+  printMetric(out, "doorbell_mqtt_events_total", "outcome=\"expired\"", expiredCount);
+  printMetric(out, "doorbell_mqtt_events_total", "outcome=\"coalesced\"", coalescedCount);
+  printMetricHeader(out, "doorbell_mqtt_queue_batches_total", "counter", "Flushes that sent events which had been waiting for the connection.");
+  printMetric(out, "doorbell_mqtt_queue_batches_total", "", flushedBatches);
+  printMetricHeader(out, "doorbell_mqtt_queue_writes_total", "counter", "Times the waiting events were written to flash.");
+  printMetric(out, "doorbell_mqtt_queue_writes_total", "", persistCount);
+}
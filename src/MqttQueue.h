@@ -0,0 +1,68 @@
+#ifndef MQTTQUEUE_H
+#define MQTTQUEUE_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include "FingerNameTable.h"
+
+#define MQTT_QUEUE_SIZE 32 // the oldest event is dropped when a new one doesn't fit anymore
+#define MQTT_MATCH_MAX_AGE_MS 30000 // a match published later than this could open the door for nobody, it is dropped
+#define MQTT_QUEUE_VERSION 1
+
+enum class MqttEventType : uint8_t { person, wifiSignal };
+
+struct MqttEvent {
+  MqttEventType type;
+  bool coalesce; // a state that is superseded by a later event of the same type, e.g. "Nobody" or the signal strength
+  bool restored; // loaded from flash after a reboot
+  int16_t id; // person: finger id, -1 for nobody/unknown
+  int16_t confidence;
+  int32_t value; // wifiSignal
+  uint32_t queuedMillis;
+  char name[FINGER_NAME_MAX_LENGTH + 1]; // person
+
+  static MqttEvent person(const char *name, int confidence, int id);
+  static MqttEvent wifiSignal(int32_t value);
+};
+
+typedef bool (*MqttPublishFunction)(const MqttEvent &event); // false if it could not be sent, e.g. while offline
+
+/*
+  Outbound queue for MQTT events, so matches and rings during a broker outage are not lost. Events are published in
+  the order they were pushed, queued states are replaced by newer ones of the same type. While events are waiting the
+  queue is also written to flash, so they survive a reboot. Used by the main loop only.
+*/
+class MqttQueue {
+  private:
+    MqttEvent events[MQTT_QUEUE_SIZE]; // ring
+    uint8_t head = 0;
+    uint8_t count = 0;
+    MqttPublishFunction publish;
+    fs::FS *fs = NULL;
+    const char *path = NULL;
+    bool fileExists = false;
+    bool dirty = false; // changed since it was written to flash
+    bool backlog = false; // an event could not be sent, the next successful flush is a batch
+    uint32_t publishedCount = 0;
+    uint32_t droppedCount = 0; // queue was full
+    uint32_t expiredCount = 0;
+    uint32_t coalescedCount = 0;
+    uint32_t persistCount = 0;
+    uint32_t flushedBatches = 0; // flushes that published events which had been waiting
+    uint8_t maxDepth = 0;
+
+    MqttEvent &at(uint8_t index); // 0 is the oldest event
+    void removeAt(uint8_t index);
+    bool isExpired(const MqttEvent &event);
+    void persist();
+
+  public:
+    MqttQueue(MqttPublishFunction publish);
+    void begin(fs::FS &fs, const char *path); // restores the events left from before a reboot, call before push()
+    void push(const MqttEvent &event); // call flush() afterwards to send it at once
+    uint8_t flush(); // publishes until the queue is empty or an event could not be sent, returns the events sent
+    uint8_t getDepth();
+    void printMetrics(Print &out); // Prometheus text format
+};
+
+#endif
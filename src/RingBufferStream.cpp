@@ -0,0 +1,148 @@
+#include "RingBufferStream.h"
+
+RingBufferStream::RingBufferStream(size_t size) : size(size) {
+}
+
+bool RingBufferStream::open() {
+  portENTER_CRITICAL(&mux);
+  bool busy = !writerDone || !readerDone;
+  if (!busy) {
+    writerDone = false;
+    readerDone = false;
+  }
+  portEXIT_CRITICAL(&mux);
+  if (busy)
+    return false;
+
+  if (ringbuf == NULL)
+    ringbuf = xRingbufferCreate(size, RINGBUF_TYPE_BYTEBUF);
+  if (ringbuf == NULL) {
+    writerDone = true;
+    readerDone = true;
+    return false;
+  }
+
+  // leftovers of an aborted transfer
+  size_t length;
+  void *item;
+  while ((item = xRingbufferReceiveUpTo(ringbuf, &length, 0, size)) != NULL)
+    vRingbufferReturnItem(ringbuf, item);
+  peeked = -1;
+  aborted = false;
+  return true;
+}
+
+void RingBufferStream::finishWriting() {
+  writerDone = true;
+}
+
+void RingBufferStream::finishReading() {
+  readerDone = true;
+}
+
+void RingBufferStream::abort() {
+  aborted = true;
+}
+
+bool RingBufferStream::isAborted() {
+  return aborted;
+}
+
+bool RingBufferStream::isWritingFinished() {
+  return writerDone;
+}
+
+size_t RingBufferStream::receive(uint8_t *buffer, size_t maxLength, TickType_t waitTicks) {
+  if (ringbuf == NULL || maxLength == 0)
+    return 0;
+  size_t length = 0;
+  uint8_t *item = (uint8_t*)xRingbufferReceiveUpTo(ringbuf, &length, waitTicks, maxLength);
+  if (item == NULL)
+    return 0;
+  memcpy(buffer, item, length);
+  vRingbufferReturnItem(ringbuf, item);
+  return length;
+}
+
+size_t RingBufferStream::readAvailable(uint8_t *buffer, size_t maxLength) {
+  if (aborted || maxLength == 0)
+    return 0;
+  size_t length = 0;
+  if (peeked >= 0) {
+    buffer[length++] = peeked;
+    peeked = -1;
+  }
+  return length + receive(buffer + length, maxLength - length, 0);
+}
+
+size_t RingBufferStream::writeAvailable(const uint8_t *buffer, size_t length) {
+  if (ringbuf == NULL || aborted)
+    return 0;
+  length = min(length, getFree());
+  if (length == 0 || xRingbufferSend(ringbuf, buffer, length, 0) != pdTRUE)
+    return 0;
+  return length;
+}
+
+size_t RingBufferStream::getFree() {
+  if (ringbuf == NULL)
+    return 0;
+  return xRingbufferGetCurFreeSize(ringbuf);
+}
+
+int RingBufferStream::available() {
+  if (ringbuf == NULL)
+    return 0;
+  return (peeked >= 0 ? 1 : 0) + (size - xRingbufferGetCurFreeSize(ringbuf));
+}
+
+int RingBufferStream::read() {
+  if (peeked >= 0) {
+    int data = peeked;
+    peeked = -1;
+    return data;
+  }
+  uint8_t data;
+  unsigned long start = millis();
+  while (!aborted) {
+    // wait in small steps to notice an abort or the end of data
+    if (receive(&data, 1, pdMS_TO_TICKS(100)))
+      return data;
+    if (writerDone)
+      return receive(&data, 1, 0) ? data : -1; // the last bytes may have arrived right before
+    if (millis() - start >= RINGBUFFERSTREAM_TIMEOUT_MS)
+      return -1;
+  }
+  return -1;
+}
+
+int RingBufferStream::peek() {
+  if (peeked < 0)
+    peeked = read();
+  return peeked;
+}
+
+size_t RingBufferStream::write(uint8_t data) {
+  return write(&data, 1);
+}
+
+size_t RingBufferStream::write(const uint8_t *buffer, size_t length) {
+  if (ringbuf == NULL || aborted)
+    return 0;
+  size_t written = 0;
+  while (written < length) {
+    // send in pieces of at most half the buffer, larger items may never fit
+    size_t piece = min(length - written, size / 2);
+    if (xRingbufferSend(ringbuf, buffer + written, piece, pdMS_TO_TICKS(RINGBUFFERSTREAM_TIMEOUT_MS)) != pdTRUE) {
+      aborted = true; // reader is stuck
+      break;
+    }
+    written += piece;
+    if (aborted)
+      break;
+  }
+  return written;
+}
+
+void RingBufferStream::flush() {
+}
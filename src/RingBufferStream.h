@@ -0,0 +1,52 @@
+#ifndef RINGBUFFERSTREAM_H
+#define RINGBUFFERSTREAM_H
+
+#include <Arduino.h>
+#include <freertos/ringbuf.h>
+
+/*
+  Stream between two tasks over a FreeRTOS byte ring buffer, used to pass sensor database transfers between the
+  webserver and the sensor task without buffering the whole data in RAM. The writer blocks (write()) or writes what
+  fits (writeAvailable()) while the buffer is full, the reader blocks (read()) or polls (readAvailable()) while it is
+  empty. Either side can abort the transfer, e.g. if the HTTP client went away. One transfer at a time, open() fails
+  while the last one is not finished on both sides.
+*/
+
+#define RINGBUFFERSTREAM_TIMEOUT_MS 10000
+
+class RingBufferStream : public Stream {
+  private:
+    size_t size;
+    RingbufHandle_t ringbuf = NULL;
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    volatile bool writerDone = true;
+    volatile bool readerDone = true;
+    volatile bool aborted = false;
+    int peeked = -1;
+
+    size_t receive(uint8_t *buffer, size_t maxLength, TickType_t waitTicks);
+
+  public:
+    RingBufferStream(size_t size);
+
+    bool open(); // start a new transfer, the ring buffer is allocated on first use
+    void finishWriting(); // end of data
+    void finishReading();
+    void abort();
+    bool isAborted();
+    bool isWritingFinished();
+
+    size_t readAvailable(uint8_t *buffer, size_t maxLength); // never blocks
+    size_t writeAvailable(const uint8_t *buffer, size_t length); // never blocks, returns what fitted
+    size_t getFree(); // bytes writeAvailable() takes right now
+
+    // Stream
+    int available() override;
+    int read() override; // blocks up to RINGBUFFERSTREAM_TIMEOUT_MS, -1 on timeout, abort or end of data
+    int peek() override;
+    size_t write(uint8_t data) override;
+    size_t write(const uint8_t *buffer, size_t length) override; // blocks while the buffer is full
+    void flush() override;
+};
+
+#endif
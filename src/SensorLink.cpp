@@ -0,0 +1,74 @@
+#include "SensorLink.h"
+
+SensorLink::SensorLink(HardwareSerial *serial) : serial(serial), stream(serial) {
+}
+
+SensorLink::SensorLink(Stream *stream) : stream(stream) {
+}
+
+void SensorLink::begin(uint32_t baudRate) {
+  this->baudRate = baudRate;
+  if (serial)
+    serial->begin(baudRate);
+  // other transports (e.g. the emulator) have their own notion of baud rate and need no setup here
+}
+
+void SensorLink::setBaudRate(uint32_t baudRate) {
+  this->baudRate = baudRate;
+  if (serial) {
+    serial->flush(); // let the last command leave with the old rate
+    serial->updateBaudRate(baudRate);
+  }
+  while (stream->available())
+    stream->read(); // garbage received during the switch
+}
+
+uint32_t SensorLink::getBaudRate() {
+  return baudRate;
+}
+
+bool SensorLink::isHardwareSerial() {
+  return serial != NULL;
+}
+
+uint32_t SensorLink::getTransactionCount() {
+  return transactions;
+}
+
+uint32_t SensorLink::getBytesWritten() {
+  return bytesWritten;
+}
+
+uint32_t SensorLink::getBytesRead() {
+  return bytesRead;
+}
+
+int SensorLink::available() {
+  return stream->available();
+}
+
+int SensorLink::read() {
+  int data = stream->read();
+  if (data >= 0) {
+    bytesRead++;
+    lastWasRead = true;
+  }
+  return data;
+}
+
+int SensorLink::peek() {
+  return stream->peek();
+}
+
+size_t SensorLink::write(uint8_t data) {
+  if (lastWasRead) {
+    transactions++;
+    lastWasRead = false;
+  }
+  bytesWritten++;
+  return stream->write(data);
+}
+
+void SensorLink::flush() {
+  stream->flush();
+}
@@ -0,0 +1,41 @@
+#ifndef SENSORLINK_H
+#define SENSORLINK_H
+
+#include <Arduino.h>
+
+/*
+  Transport between FingerprintManager and the sensor. Usually this is the hardware UART the R503 is wired to, but any
+  Stream (e.g. the R503Emulator from lib/) can be plugged in instead, so the scan path can run without a physical sensor.
+*/
+class SensorLink : public Stream {
+  private:
+    HardwareSerial *serial = NULL; // only set if the transport is a real UART
+    Stream *stream;
+    uint32_t baudRate = 0;
+    uint32_t transactions = 0; // request/response round trips, i.e. writes following a read
+    uint32_t bytesWritten = 0;
+    uint32_t bytesRead = 0;
+    bool lastWasRead = true;
+
+  public:
+    SensorLink(HardwareSerial *serial);
+    SensorLink(Stream *stream);
+
+    void begin(uint32_t baudRate);
+    void setBaudRate(uint32_t baudRate); // switch a running link, pending input is dropped
+    uint32_t getBaudRate();
+    bool isHardwareSerial();
+    uint32_t getTransactionCount();
+    uint32_t getBytesWritten();
+    uint32_t getBytesRead();
+
+    // Stream
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t data) override;
+    using Print::write;
+    void flush() override;
+};
+
+#endif
@@ -0,0 +1,373 @@
+#include "SensorTask.h"
+
+SensorTask::SensorTask(FingerprintManager *fingerManager) : fingerManager(fingerManager) {
+}
+
+void SensorTask::begin() {
+  commandQueue = xQueueCreate(SENSOR_COMMAND_QUEUE_DEPTH, sizeof(uint8_t));
+  completedQueue = xQueueCreate(SENSOR_COMMAND_QUEUE_DEPTH, sizeof(uint8_t));
+  scanEventQueue = xQueueCreate(SCAN_EVENT_QUEUE_DEPTH, sizeof(ScanEvent));
+  activity = xSemaphoreCreateBinary();
+  for (int i=0; i<SENSOR_COMMAND_QUEUE_DEPTH; i++)
+    commands[i].done = xSemaphoreCreateBinary();
+
+  xTaskCreatePinnedToCore(taskFunction, "sensor", SENSOR_TASK_STACK_SIZE, this, SENSOR_TASK_PRIORITY, &taskHandle, APP_CPU_NUM);
+  attachInterruptArg(touchRingPin, onTouchInterrupt, this, FALLING);
+}
+
+void SensorTask::taskFunction(void *parameter) {
+  static_cast<SensorTask*>(parameter)->run();
+}
+
+void IRAM_ATTR SensorTask::onTouchInterrupt(void *parameter) {
+  SensorTask *sensorTask = static_cast<SensorTask*>(parameter);
+  sensorTask->fingerManager->onRingTouched();
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR(sensorTask->taskHandle, &higherPriorityTaskWoken);
+  if (higherPriorityTaskWoken)
+    portYIELD_FROM_ISR();
+}
+
+// Sleep until the touch ring interrupt or a command wakes us up. Commands are served right away, the sensor is only
+// woken up if there is something to do for it.
+void SensorTask::waitForTouch() {
+  if (fingerManager->isSleepWhenIdle())
+    fingerManager->sleepSensor();
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TOUCH_WAIT_TIMEOUT_MS));
+  serveCommands(0);
+}
+
+void SensorTask::run() {
+  trackHeapAllocations();
+  for (;;) {
+    fingerManager->updatePollStats();
+    if (enrollCommand) {
+      stepEnrollment();
+      continue;
+    }
+    if (!fingerManager->connected) {
+      serveCommands(pdMS_TO_TICKS(1000));
+      continue;
+    }
+
+    long holdOffRemaining = (long)(holdOffUntil - millis());
+    if (holdOffActive && holdOffRemaining > 0) {
+      // let the LED blink after a match/no match, but still serve commands in the meantime
+      serveCommands(pdMS_TO_TICKS(holdOffRemaining));
+      continue;
+    }
+    holdOffActive = false;
+
+    if (fingerManager->isWaitingForTouch()) {
+      waitForTouch();
+      if (fingerManager->isWaitingForTouch())
+        continue; // woken up by a command or timeout only
+    }
+
+    fingerManager->wakeSensor();
+    scan();
+    serveCommands(pdMS_TO_TICKS(fingerManager->getPollIntervalMs()));
+  }
+}
+
+void SensorTask::serveCommands(TickType_t waitTicks) {
+  uint8_t index;
+  while (enrollCommand == NULL && xQueueReceive(commandQueue, &index, waitTicks) == pdTRUE) {
+    executing = true;
+    execute(&commands[index]);
+    executing = false;
+    waitTicks = 0; // drain whatever else is queued, then return to scanning (or to the enrollment just started)
+  }
+}
+
+void SensorTask::scan() {
+  idleScanAllocations.start();
+  Match match = fingerManager->scanFingerprint();
+  bool idle = (match.scanResult == ScanResult::noFinger && lastScanResult == ScanResult::noFinger);
+  postScanEvent(match);
+  fingerManager->applyPendingLed(); // LED only after the result is on its way to the main loop
+  idleScanAllocations.stop(idle);
+}
+
+void SensorTask::stepEnrollment() {
+  if (fingerManager->stepEnroll()) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ENROLL_POLL_INTERVAL_MS)); // cancelEnroll() wakes us up early
+    return;
+  }
+  // done, failed, timed out or cancelled, scanning goes on with the next iteration
+  EnrollProgress progress = fingerManager->getEnrollProgress();
+  SensorCommand *command = enrollCommand;
+  enrollCommand = NULL;
+  command->ok = (progress.state == EnrollState::done);
+  command->returnCode = progress.returnCode;
+  command->result = (uint8_t)progress.state;
+  complete(command);
+}
+
+bool SensorTask::cancelEnroll() {
+  if (!fingerManager->cancelEnroll())
+    return false;
+  xTaskNotifyGive(taskHandle);
+  return true;
+}
+
+void SensorTask::postScanEvent(const Match &match) {
+  // noFinger is the idle state, only the transition into it is of interest
+  if (match.scanResult == ScanResult::noFinger && lastScanResult == ScanResult::noFinger)
+    return;
+
+  ScanEvent event;
+  event.scanResult = match.scanResult;
+  event.matchId = match.matchId;
+  event.matchConfidence = match.matchConfidence;
+  event.returnCode = match.returnCode;
+  if (match.scanResult == ScanResult::matchFound && lastScanResult != ScanResult::matchFound) {
+    // the main loop will only accept the match if the sensor is still the one we are paired with
+    StageTimer pairingTimer(pairingRead);
+    String pairingCode = fingerManager->getPairingCode();
+    pairingTimer.stop();
+    strlcpy(event.pairingCode, pairingCode.c_str(), sizeof(event.pairingCode));
+  }
+  event.postedMicros = micros();
+  if (xQueueSend(scanEventQueue, &event, 0) != pdTRUE)
+    Serial.println("Scan event queue full, event dropped.");
+  xSemaphoreGive(activity);
+  lastScanResult = match.scanResult;
+
+  if (match.scanResult == ScanResult::matchFound || match.scanResult == ScanResult::noMatchFound) {
+    holdOffUntil = millis() + SCAN_HOLDOFF_MS;
+    holdOffActive = true;
+  }
+}
+
+void SensorTask::execute(SensorCommand *command) {
+  fingerManager->wakeSensor();
+  switch (command->type) {
+    case SensorCommandType::enroll:
+      if (fingerManager->startEnroll(command->id, command->text)) {
+        enrollCommand = command; // completed by stepEnrollment()
+        return;
+      }
+      command->result = (uint8_t)EnrollState::failed;
+      break;
+    case SensorCommandType::deleteFinger:
+      fingerManager->deleteFinger(command->id);
+      command->ok = true;
+      break;
+    case SensorCommandType::renameFinger:
+      fingerManager->renameFinger(command->id, command->text);
+      command->ok = true;
+      break;
+    case SensorCommandType::deleteAll:
+      command->ok = fingerManager->deleteAll();
+      break;
+    case SensorCommandType::readPairingCode:
+      command->resultText = fingerManager->getPairingCode();
+      command->ok = !command->resultText.isEmpty();
+      break;
+    case SensorCommandType::writePairingCode:
+      command->ok = fingerManager->setPairingCode(command->text);
+      break;
+    case SensorCommandType::setLedRingReady:
+      fingerManager->setLedRingReady();
+      command->ok = true;
+      break;
+    case SensorCommandType::setLedRingError:
+      fingerManager->setLedRingError();
+      command->ok = true;
+      break;
+    case SensorCommandType::exportDatabase: {
+      DatabaseTransfer transfer = fingerManager->exportSensorDB(*command->transfer);
+      command->transfer->finishWriting();
+      command->ok = transfer.ok;
+      command->resultText = describeTransfer("Exported", transfer);
+      break;
+    }
+    case SensorCommandType::importDatabase: {
+      DatabaseTransfer transfer = fingerManager->importSensorDB(*command->transfer);
+      if (!transfer.ok)
+        command->transfer->abort(); // let the upload fail fast instead of waiting for a full buffer
+      command->transfer->finishReading();
+      command->ok = transfer.ok;
+      command->resultText = describeTransfer("Imported", transfer);
+      break;
+    }
+    case SensorCommandType::provisionDatabase: {
+      DatabaseTransfer transfer = fingerManager->provisionSensorDB(*command->transfer);
+      if (!transfer.ok)
+        command->transfer->abort();
+      command->transfer->finishReading();
+      uint16_t failed = fingerManager->getProvisionReport().failed;
+      command->ok = transfer.ok && failed == 0;
+      command->resultText = describeTransfer("Provisioned", transfer);
+      if (failed > 0)
+        command->resultText += String(" ") + failed + " slots failed, see /api/v1/provision.";
+      break;
+    }
+    default:
+      break;
+  }
+  complete(command);
+}
+
+String SensorTask::describeTransfer(const char *action, const DatabaseTransfer &transfer) {
+  float seconds = transfer.micros / 1e6;
+  String text = String(action) + " " + transfer.templates + " templates (" + transfer.bytes + " bytes) in " + String(seconds, 1) + " s";
+  if (seconds > 0)
+    text += String(", ") + String(transfer.templates / seconds, 1) + " templates/s";
+  if (transfer.skipped > 0) {
+    text += String(". ") + transfer.skipped + " skipped, this sensor has no slot for id";
+    for (uint16_t i=0; i<min(transfer.skipped, (uint16_t)DATABASE_MAX_SKIPPED_IDS); i++)
+      text += String(i ? ", " : " ") + transfer.skippedIds[i];
+    if (transfer.skipped > DATABASE_MAX_SKIPPED_IDS)
+      text += ", ...";
+  }
+  if (!transfer.ok)
+    text += String(". ") + (transfer.error.isEmpty() ? String("Transfer failed") : transfer.error) + ".";
+  Serial.println(text);
+  return text;
+}
+
+void SensorTask::complete(SensorCommand *command) {
+  command->serviceMicros = micros() - command->enqueuedMicros;
+  SensorCommandStats &s = stats[(int)command->type];
+  s.count++;
+  s.totalMicros += command->serviceMicros;
+  if (command->serviceMicros > s.maxMicros)
+    s.maxMicros = command->serviceMicros;
+
+  if (command->onDone) {
+    command->completed = true;
+    uint8_t index = command - commands;
+    xQueueSend(completedQueue, &index, portMAX_DELAY); // never blocks, queue has room for all commands
+    xSemaphoreGive(activity);
+    return;
+  }
+
+  bool abandoned;
+  portENTER_CRITICAL(&commandsMux);
+  command->completed = true;
+  abandoned = command->abandoned;
+  if (abandoned)
+    command->inUse = false; // nobody is waiting anymore
+  portEXIT_CRITICAL(&commandsMux);
+  if (!abandoned)
+    xSemaphoreGive(command->done);
+}
+
+void SensorTask::freeCommand(SensorCommand *command) {
+  portENTER_CRITICAL(&commandsMux);
+  command->inUse = false;
+  portEXIT_CRITICAL(&commandsMux);
+}
+
+SensorCommand *SensorTask::submit(SensorCommandType type, uint16_t id, const String &text, SensorCommandCallback onDone, RingBufferStream *transfer) {
+  if (taskHandle == NULL)
+    return NULL;
+
+  int index = -1;
+  portENTER_CRITICAL(&commandsMux);
+  for (int i=0; i<SENSOR_COMMAND_QUEUE_DEPTH; i++) {
+    if (!commands[i].inUse) {
+      commands[i].inUse = true;
+      index = i;
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&commandsMux);
+  if (index < 0)
+    return NULL;
+
+  SensorCommand *command = &commands[index];
+  command->type = type;
+  command->id = id;
+  command->text = text;
+  command->transfer = transfer;
+  command->ok = false;
+  command->returnCode = 0;
+  command->resultText = "";
+  command->result = 0;
+  command->onDone = onDone;
+  command->completed = false;
+  command->abandoned = false;
+  xSemaphoreTake(command->done, 0); // clear a completion nobody waited for
+  command->enqueuedMicros = micros();
+
+  uint8_t index8 = index;
+  xQueueSend(commandQueue, &index8, 0); // never fails, queue has room for all commands
+  xTaskNotifyGive(taskHandle); // in case the task waits for a touch
+  return command;
+}
+
+bool SensorTask::wait(SensorCommand *command, uint32_t timeoutMs) {
+  return xSemaphoreTake(command->done, pdMS_TO_TICKS(timeoutMs)) == pdTRUE;
+}
+
+void SensorTask::release(SensorCommand *command) {
+  portENTER_CRITICAL(&commandsMux);
+  if (command->completed)
+    command->inUse = false;
+  else
+    command->abandoned = true; // sensor task frees it when done
+  portEXIT_CRITICAL(&commandsMux);
+}
+
+void SensorTask::dispatchCompletedCommands() {
+  uint8_t index;
+  while (xQueueReceive(completedQueue, &index, 0) == pdTRUE) {
+    SensorCommand *command = &commands[index];
+    command->onDone(command);
+    freeCommand(command);
+  }
+}
+
+bool SensorTask::nextScanEvent(ScanEvent *event) {
+  if (scanEventQueue == NULL)
+    return false;
+  return xQueueReceive(scanEventQueue, event, 0) == pdTRUE;
+}
+
+bool SensorTask::waitForActivity(uint32_t timeoutMs) {
+  if (activity == NULL)
+    return false;
+  return xSemaphoreTake(activity, pdMS_TO_TICKS(timeoutMs)) == pdTRUE;
+}
+
+uint8_t SensorTask::getQueueDepth() {
+  if (commandQueue == NULL)
+    return 0;
+  return uxQueueMessagesWaiting(commandQueue);
+}
+
+bool SensorTask::isBusy() {
+  return enrollCommand != NULL || executing || getQueueDepth() > 0;
+}
+
+SensorCommandStats SensorTask::getCommandStats(SensorCommandType type) {
+  return stats[(int)type];
+}
+
+IdleAllocations SensorTask::getIdleScanAllocations() {
+  return idleScanAllocations;
+}
+
+void SensorTask::printMetrics(Print &out) {
+  static const char *commandNames[] = { "enroll", "delete_finger", "rename_finger", "delete_all", "read_pairing_code", "write_pairing_code", "set_led_ring_ready", "set_led_ring_error", "export_database", "import_database", "provision_database" };
+  char labels[48];
+
+  printMetricHeader(out, "doorbell_pairing_read_seconds", "histogram", "Reading the pairing code from the sensor after a match.");
+  pairingRead.print(out, "doorbell_pairing_read_seconds", "");
+
+  printMetricHeader(out, "doorbell_sensor_commands_total", "counter", "Admin commands served by the sensor task.");
+  for (int i=0; i<(int)SensorCommandType::count; i++) {
+    snprintf(labels, sizeof(labels), "command=\"%s\"", commandNames[i]);
+    printMetric(out, "doorbell_sensor_commands_total", labels, stats[i].count);
+  }
+  printMetricHeader(out, "doorbell_sensor_command_seconds_max", "gauge", "Longest time from submitting a command to its completion.");
+  for (int i=0; i<(int)SensorCommandType::count; i++) {
+    snprintf(labels, sizeof(labels), "command=\"%s\"", commandNames[i]);
+    out.printf("doorbell_sensor_command_seconds_max{%s} %.6f\n", labels, stats[i].maxMicros / 1e6);
+  }
+  printMetricHeader(out, "doorbell_sensor_command_queue_depth", "gauge", "Commands waiting for the sensor task.");
+  printMetric(out, "doorbell_sensor_command_queue_depth", "", getQueueDepth());
+}
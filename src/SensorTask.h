@@ -0,0 +1,119 @@
+#ifndef SENSORTASK_H
+#define SENSORTASK_H
+
+#include <Arduino.h>
+#include "FingerprintManager.h"
+#include "RingBufferStream.h"
+
+#define SENSOR_TASK_STACK_SIZE 8192
+#define SENSOR_TASK_PRIORITY 1
+#define SENSOR_COMMAND_QUEUE_DEPTH 8 // max. number of admin commands in flight
+#define SCAN_EVENT_QUEUE_DEPTH 8
+#define SCAN_HOLDOFF_MS 3000 // no scanning after a match/no match to let the LED blink
+#define TOUCH_WAIT_TIMEOUT_MS 1000 // while waiting for a touch, check the ring level anyway from time to time
+
+/*
+  The sensor task is the only one talking to the fingerprint sensor. It scans continuously and serves admin commands
+  (enroll, delete, ...) from a bounded queue in between two scans, so neither the main loop nor the webserver ever wait
+  for the UART. Results of scans are handed over to the main loop as ScanEvents. While an enrollment runs it is stepped
+  instead of scanning, other commands wait until it is done, cancelled or timed out.
+*/
+
+enum class SensorCommandType { enroll, deleteFinger, renameFinger, deleteAll, readPairingCode, writePairingCode, setLedRingReady, setLedRingError, exportDatabase, importDatabase, provisionDatabase, count };
+
+struct SensorCommand;
+typedef void (*SensorCommandCallback)(SensorCommand *command);
+
+struct SensorCommand {
+  SensorCommandType type = SensorCommandType::enroll;
+  uint16_t id = 0;
+  String text; // finger name or pairing code
+  RingBufferStream *transfer = NULL; // database export/import data
+
+  // results
+  bool ok = false;
+  uint8_t returnCode = 0;
+  String resultText; // pairing code read from the sensor
+  uint8_t result = 0; // command specific, the EnrollState an enrollment ended with
+
+  // bookkeeping, owned by SensorTask
+  SensorCommandCallback onDone = NULL;
+  unsigned long enqueuedMicros = 0;
+  unsigned long serviceMicros = 0; // enqueue to completion
+  SemaphoreHandle_t done = NULL;
+  bool inUse = false;
+  bool completed = false;
+  bool abandoned = false;
+};
+
+struct SensorCommandStats {
+  uint32_t count = 0;
+  uint32_t totalMicros = 0;
+  uint32_t maxMicros = 0;
+};
+
+struct ScanEvent {
+  ScanResult scanResult = ScanResult::noFinger;
+  uint16_t matchId = 0;
+  uint16_t matchConfidence = 0;
+  uint8_t returnCode = 0;
+  char pairingCode[33] = ""; // read from the sensor right after a new match, empty otherwise
+  unsigned long postedMicros = 0;
+};
+
+class SensorTask {
+  private:
+    FingerprintManager *fingerManager;
+    TaskHandle_t taskHandle = NULL;
+    QueueHandle_t commandQueue = NULL; // indices into commands[], sensor task consumes
+    QueueHandle_t completedQueue = NULL; // indices of finished commands with callback, main loop consumes
+    QueueHandle_t scanEventQueue = NULL;
+    SemaphoreHandle_t activity = NULL; // given whenever there is something for the main loop
+    SensorCommand commands[SENSOR_COMMAND_QUEUE_DEPTH];
+    SensorCommandStats stats[(int)SensorCommandType::count];
+    portMUX_TYPE commandsMux = portMUX_INITIALIZER_UNLOCKED;
+    ScanResult lastScanResult = ScanResult::noFinger;
+    SensorCommand *enrollCommand = NULL; // running enrollment, completed when it ends
+    volatile bool executing = false; // a command is being executed right now
+    unsigned long holdOffUntil = 0;
+    bool holdOffActive = false;
+    LatencyHistogram pairingRead; // pairing code read after a match
+    IdleAllocations idleScanAllocations; // scans without a finger must not touch the heap
+
+    static void taskFunction(void *parameter);
+    static void IRAM_ATTR onTouchInterrupt(void *parameter);
+    void waitForTouch();
+    void run();
+    void serveCommands(TickType_t waitTicks);
+    void execute(SensorCommand *command);
+    void complete(SensorCommand *command);
+    String describeTransfer(const char *action, const DatabaseTransfer &transfer);
+    void freeCommand(SensorCommand *command);
+    void scan();
+    void stepEnrollment();
+    void postScanEvent(const Match &match);
+
+  public:
+    SensorTask(FingerprintManager *fingerManager);
+    void begin();
+
+    // Queue a command. Without callback the caller has to wait() for the result and release() the command afterwards,
+    // with callback the command is released automatically after the callback was run by dispatchCompletedCommands().
+    // Returns NULL if the queue is full.
+    SensorCommand *submit(SensorCommandType type, uint16_t id = 0, const String &text = String(), SensorCommandCallback onDone = NULL, RingBufferStream *transfer = NULL);
+    bool wait(SensorCommand *command, uint32_t timeoutMs);
+    void release(SensorCommand *command);
+    void dispatchCompletedCommands();
+    bool cancelEnroll(); // false if no enrollment is running
+
+    bool nextScanEvent(ScanEvent *event);
+    bool waitForActivity(uint32_t timeoutMs); // lets the main loop block until a scan event or completed command is ready
+
+    uint8_t getQueueDepth();
+    bool isBusy(); // an enrollment or another command is running or queued, a new command would have to wait for it
+    SensorCommandStats getCommandStats(SensorCommandType type);
+    IdleAllocations getIdleScanAllocations();
+    void printMetrics(Print &out); // Prometheus text format
+};
+
+#endif
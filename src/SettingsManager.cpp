@@ -1,5 +1,7 @@
 #include "SettingsManager.h"
 #include <Crypto.h>
+#include "WallClock.h"
+#include "global.h"
 
 bool SettingsManager::loadWifiSettings() {
     Preferences preferences;
@@ -21,6 +23,12 @@ bool SettingsManager::loadAppSettings() {
         appSettings.sensorPin = preferences.getString("sensorPin", "00000000");
         appSettings.sensorPairingCode = preferences.getString("pairingCode", "");
         appSettings.sensorPairingValid = preferences.getBool("pairingValid", false);
+        appSettings.searchStrategy = preferences.getUChar("searchStrategy", 0);
+        appSettings.ringImagingPasses = preferences.getUChar("ringPasses", 15);
+        appSettings.matchScanPasses = preferences.getUChar("matchPasses", 5);
+        appSettings.scanTimeBudgetMs = preferences.getUShort("scanBudgetMs", 0);
+        appSettings.ringNoFingerExit = preferences.getUChar("noFingerExit", 0);
+        appSettings.sensorSleepWhenIdle = preferences.getBool("sensorSleep", false);
         preferences.end();
         return true;
     } else {
@@ -44,6 +52,12 @@ void SettingsManager::saveAppSettings() {
     preferences.putString("sensorPin", appSettings.sensorPin);
     preferences.putString("pairingCode", appSettings.sensorPairingCode);
     preferences.putBool("pairingValid", appSettings.sensorPairingValid);
+    preferences.putUChar("searchStrategy", appSettings.searchStrategy);
+    preferences.putUChar("ringPasses", appSettings.ringImagingPasses);
+    preferences.putUChar("matchPasses", appSettings.matchScanPasses);
+    preferences.putUShort("scanBudgetMs", appSettings.scanTimeBudgetMs);
+    preferences.putUChar("noFingerExit", appSettings.ringNoFingerExit);
+    preferences.putBool("sensorSleep", appSettings.sensorSleepWhenIdle);
     preferences.end();
 }
 
@@ -100,7 +114,9 @@ String SettingsManager::generateNewPairingCode() {
     /* Put some unique values as input in our new hash */
     hasher.doUpdate( String(esp_random()).c_str() ); // random number
     hasher.doUpdate( String(millis()).c_str() ); // time since boot
-    hasher.doUpdate(getTimestampString().c_str()); // current time (if NTP is available)
+    char timestamp[TIMESTAMP_BUFFER_SIZE];
+    formatTimestamp(timestamp, sizeof(timestamp));
+    hasher.doUpdate(timestamp); // current time (if NTP is available)
     hasher.doUpdate(wifiSettings.ssid.c_str());
     hasher.doUpdate(wifiSettings.password.c_str());
 
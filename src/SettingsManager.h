@@ -15,6 +15,12 @@ struct AppSettings {
     String sensorPin = "00000000";
     String sensorPairingCode = "";
     bool   sensorPairingValid = false;
+    uint8_t searchStrategy = 0; // SearchStrategy, 0 = full search
+    uint8_t ringImagingPasses = 15; // ScanPolicy
+    uint8_t matchScanPasses = 5;
+    uint16_t scanTimeBudgetMs = 0;
+    uint8_t ringNoFingerExit = 0;
+    bool sensorSleepWhenIdle = false;
 };
 
 class SettingsManager {       
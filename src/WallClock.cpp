@@ -0,0 +1,70 @@
+#include "WallClock.h"
+#include "global.h"
+
+#include <esp_timer.h>
+#include <sys/time.h>
+
+void WallClock::begin(const char *ntpServer, long gmtOffsetSeconds, int daylightOffsetSeconds) {
+  configTime(gmtOffsetSeconds, daylightOffsetSeconds, ntpServer); // SNTP runs in the background and sets the system time
+  update();
+}
+
+void WallClock::update() {
+  unsigned long currentMillis = millis();
+  if (currentMillis - lastCheckMillis < CLOCK_CHECK_INTERVAL_MS)
+    return;
+  lastCheckMillis = currentMillis;
+  struct timeval tv;
+  gettimeofday(&tv, NULL); // unlike getLocalTime() this doesn't wait for a sync
+  if (tv.tv_sec <= CLOCK_VALID_AFTER)
+    return;
+  int64_t systemMicros = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  int64_t timerMicros = esp_timer_get_time();
+  int64_t anchoredMicros = nowMicros();
+  if (anchoredMicros != 0 && llabs(systemMicros - anchoredMicros) < CLOCK_SYNC_THRESHOLD_US)
+    return;
+  portENTER_CRITICAL(&mux);
+  anchorMicros = timerMicros;
+  anchorEpochMicros = systemMicros;
+  portEXIT_CRITICAL(&mux);
+  syncs++;
+  Serial.printf("Clock synchronized (%s by %lld ms)\n", anchoredMicros ? "corrected" : "set", anchoredMicros ? (systemMicros - anchoredMicros) / 1000 : 0LL);
+}
+
+int64_t WallClock::nowMicros() {
+  portENTER_CRITICAL(&mux);
+  int64_t epochMicros = anchorEpochMicros;
+  int64_t timerMicros = anchorMicros;
+  portEXIT_CRITICAL(&mux);
+  if (epochMicros == 0)
+    return 0;
+  return epochMicros + (esp_timer_get_time() - timerMicros);
+}
+
+bool WallClock::isSet() {
+  return nowMicros() != 0;
+}
+
+time_t WallClock::now() {
+  return nowMicros() / 1000000;
+}
+
+uint32_t WallClock::getSyncs() {
+  return syncs;
+}
+
+size_t WallClock::format(char *buffer, size_t size) {
+  return formatTime(now(), buffer, size);
+}
+
+size_t WallClock::formatTime(time_t time, char *buffer, size_t size) {
+  if (size == 0)
+    return 0;
+  if (time <= CLOCK_VALID_AFTER) {
+    size_t length = strlcpy(buffer, "no time", size);
+    return min(length, size - 1);
+  }
+  struct tm timeinfo;
+  localtime_r(&time, &timeinfo);
+  return strftime(buffer, size, "%Y-%m-%d %H:%M:%S %Z", &timeinfo);
+}
@@ -0,0 +1,36 @@
+#ifndef WALLCLOCK_H
+#define WALLCLOCK_H
+
+#include <Arduino.h>
+#include <time.h>
+
+#define CLOCK_CHECK_INTERVAL_MS 1000 // how often update() looks for a new NTP time
+#define CLOCK_SYNC_THRESHOLD_US 500000 // a system time further off than this from the anchored one is a new sync
+#define TIMESTAMP_BUFFER_SIZE 32
+
+/*
+  Wall clock that never waits for NTP. The system time set by SNTP is taken over as an anchor by update() and the time
+  is derived from esp_timer since then, so now() and format() take microseconds and return "no time" instead of
+  blocking while there was no sync yet. Thread-safe.
+*/
+class WallClock {
+  private:
+    int64_t anchorMicros = 0; // esp_timer_get_time() at the anchor
+    int64_t anchorEpochMicros = 0; // unix time at the anchor, 0 while not synced
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    unsigned long lastCheckMillis = 0;
+    uint32_t syncs = 0;
+
+    int64_t nowMicros(); // unix time in microseconds, 0 while not synced
+
+  public:
+    void begin(const char *ntpServer, long gmtOffsetSeconds, int daylightOffsetSeconds);
+    void update(); // call from the main loop
+    bool isSet();
+    time_t now(); // 0 while not synced
+    uint32_t getSyncs();
+    size_t format(char *buffer, size_t size); // current time, see formatTime()
+    static size_t formatTime(time_t time, char *buffer, size_t size); // "2024-01-31 12:00:00 UTC" or "no time" for 0
+};
+
+#endif
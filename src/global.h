@@ -2,13 +2,25 @@
 #define GLOBAL_H
 
 #include <WString.h>
+#include <stdint.h>
 
 #define PIN_WAKE 18 // original: 5
 #define PIN_DOORBELL 19
 #define DOORBELL_BUTTON_PRESS_MS 500
 #define WIFI_SIGNAL_INTERVAL 300000  // 5 minutes in milliseconds
+#define WIFI_CONNECT_TIMEOUT_MS 30000 // reboot if WiFi is not connected after this
+#define WIFI_POLL_INTERVAL_MS 100
+#define LOOP_IDLE_TIMEOUT_MS 10 // max. time loop() sleeps while waiting for the sensor task
+#define LOG_HISTORY_SIZE 128 // log entries kept, see LogBuffer
+#define LOG_REPLAY_MAX 20 // entries replayed to a reconnecting /events client, below the queue limit of a client
+#define DATABASE_UPLOAD_WINDOW (5744 + 1436) // TCP window plus one segment (lwIP of Arduino), what an upload may still send once it is not acked
+#define DATABASE_TRANSFER_BUFFER_SIZE (2 * DATABASE_UPLOAD_WINDOW) // an upload is throttled while less than a window is free
+#define CLOCK_VALID_AFTER 1609459200 // 2021-01-01, earlier times mean the clock was not set yet
 
-extern void notifyClients(String message);
-extern String getTimestampString();
+enum class LogCode : uint8_t; // see LogBuffer.h
+
+extern void notifyClients(LogCode code, int32_t arg0 = 0, int32_t arg1 = 0, const char *text = NULL);
+extern void notifyClients(const String &message); // free text
+extern size_t formatTimestamp(char *buffer, size_t size); // current time without waiting for NTP, see WallClock
 
 #endif
\ No newline at end of file
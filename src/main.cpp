@@ -5,17 +5,31 @@
 #include <WiFi.h>
 #include <DNSServer.h>
 #include <time.h>
+#include <esp_timer.h>
+#include <rom/crc.h>
 #include <ESPAsyncWebServer.h>
 #include <ElegantOTA.h>
 #include <SPIFFS.h>
 #include <ArduinoHA.h>
 #include <ArduinoJson.h>
+#include <AsyncJson.h>
 #include "FingerprintManager.h"
+#include "SensorTask.h"
+#include "RingBufferStream.h"
+#include "Metrics.h"
+#include "FingersJson.h"
+#include "LogBuffer.h"
+#include "AccessJournal.h"
+#include "MqttQueue.h"
+#include "WallClock.h"
 #include "SettingsManager.h"
 #include "global.h"
 #include "../../private.h"
+#ifdef FINGERPRINT_SENSOR_EMULATOR
+#include <R503Emulator.h>
+#endif
 
-enum class Mode { scan, enroll, wificonfig, maintenance };
+enum class Mode { scan, wificonfig };
 
 const char* VersionInfo = "1.0";
 
@@ -30,19 +44,32 @@ const long  gmtOffset_sec = 0; // UTC Time
 const int   daylightOffset_sec = 0; // UTC Time
 const int   doorbellOutputPin = PIN_DOORBELL; // pin connected to the doorbell (when using hardware connection instead of mqtt to ring the bell)
 
-const int logMessagesCount = 5;
-String logMessages[logMessagesCount]; // log messages, 0=most recent log message
+WallClock wallClock; // for timestamps, never waits for NTP
+const int logMessagesShown = 5; // on the pages
+LogBuffer logBuffer;
+char logLine[LOG_LINE_SIZE]; // formatted entry, used while holding logMutex
+SemaphoreHandle_t logMutex = xSemaphoreCreateMutex(); // log is written from the main loop and the sensor task
+LatencyHistogram logLatency; // notifyClients()
+uint32_t loggedMessages = 0; // by tasks whose heap allocations are counted
+uint32_t logHeapAllocations = 0; // made by these notifyClients() calls
 bool shouldReboot = false;
 unsigned long wifiReconnectPreviousMillis = 0;
 unsigned long mqttReconnectPreviousMillis = 0;
 
-String enrollId;
-String enrollName;
 Mode currentMode = Mode::scan;
 
-FingerprintManager fingerManager;
+#ifdef FINGERPRINT_SENSOR_EMULATOR
+R503Emulator sensorEmulator; // software sensor for running without hardware, see env:esp32doit-devkit-v1-emulator
+FingerprintManager fingerManager(&sensorEmulator);
+#else
+FingerprintManager fingerManager(&mySerial);
+#endif
+SensorTask sensorTask(&fingerManager); // owns all sensor access once started
+RingBufferStream databaseTransfer(DATABASE_TRANSFER_BUFFER_SIZE); // sensor database export/import between webserver and sensor task
+AsyncWebServerRequest *importRequest = NULL; // upload currently feeding databaseTransfer
+AsyncClient *throttledUpload = NULL; // its connection while acks are held back, see writeDatabaseUpload()
+SemaphoreHandle_t uploadMutex = xSemaphoreCreateMutex(); // both are used by the async_tcp task and the main loop
 SettingsManager settingsManager;
-bool needMaintenanceMode = false;
 
 const byte DNS_PORT = 53;
 DNSServer dnsServer;
@@ -55,121 +82,546 @@ HAMqtt mqtt(espClient, device);
 HAButton ringBell("ringBell");
 HASensorNumber wifiSignal("wifiSignal");
 HASensor person("person", HASensor::JsonAttributesFeature);
+bool publishMqttEvent(const MqttEvent &event);
+MqttQueue mqttQueue(publishMqttEvent); // HA updates wait here while the broker is not reachable
 
 // Variables to track timing
 unsigned long lastWifiSignalUpdate = 0;
+unsigned long loopMaxMicros = 0; // longest loop() iteration since last report
+esp_timer_handle_t doorbellTimer; // releases the doorbell output after DOORBELL_BUTTON_PRESS_MS
+LatencyHistogram scanHandoverLatency; // scan event posted by the sensor task until handled here
+LatencyHistogram mqttPublishLatency;
+BootProfiler bootProfiler;
+SemaphoreHandle_t spiffsMounted = NULL; // given once the background mount is done
+bool spiffsOk = false;
+AccessJournal accessJournal(SPIFFS, "/journal"); // scan events, kept across reboots
+IdleAllocations idleScanAllocations; // doScan() without scan events must not touch the heap
+char matchName[FINGER_NAME_BUFFER_SIZE]; // name of the last match, resolved when a match is handled
+char personAttributes[48]; // JSON attributes of the person sensor
 
 long lastMsg = 0;
 char msg[50];
 int value = 0;
 
-Match lastMatch;
+ScanResult lastScanResult = ScanResult::noFinger;
+
+// Sends the entries a client missed, one event each. A client that connects the first time (or whose last id is from
+// before a reboot) gets the entries shown on the pages.
+void replayLogMessages(AsyncEventSourceClient *client) {
+  uint32_t lastId = client->lastId();
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  uint32_t lastLogId = logBuffer.getLastId();
+  if (lastId == 0 || lastId > lastLogId)
+    lastId = (lastLogId > logMessagesShown) ? lastLogId - logMessagesShown : 0;
+  for (uint32_t id=max(logBuffer.firstIdAfter(lastId), lastLogId - min(lastLogId, (uint32_t)LOG_REPLAY_MAX) + 1); id<=lastLogId; id++) {
+    LogBuffer::format(logBuffer.get(id), logLine, sizeof(logLine));
+    client->send(logLine, "message", id);
+  }
+  xSemaphoreGive(logMutex);
+}
 
-void addLogMessage(const String& message) {
-  // shift all messages in array by 1, oldest message will die
-  for (int i=logMessagesCount-1; i>0; i--)
-    logMessages[i]=logMessages[i-1];
-  logMessages[0]=message;
+size_t formatTimestamp(char *buffer, size_t size) {
+  return wallClock.format(buffer, size);
 }
 
-String getLogMessagesAsHtml() {
-  String html = "";
-  for (int i=logMessagesCount-1; i>=0; i--) {
-    if (logMessages[i]!="")
-      html = html + logMessages[i] + "<br>";
+// Current values shown on the pages. The pages themselves are static files cached by the browser and fetch this.
+void sendState(AsyncWebServerRequest *request) {
+  JsonDocument state;
+  state["hostname"] = settingsManager.getWifiSettings().hostname;
+  state["version"] = VersionInfo;
+  if (currentMode == Mode::wificonfig) {
+    state["wifiSsid"] = settingsManager.getWifiSettings().ssid;
+    // for security reasons the wifi password will not left the device once configured
+    state["wifiPassword"] = settingsManager.getWifiSettings().password.isEmpty() ? "" : "********";
+  } else {
+    const char *strategyNames[] = { "Full search", "High speed search", "Frequently matched fingers first" };
+    state["ntpServer"] = settingsManager.getAppSettings().ntpServer;
+    state["searchStrategy"] = settingsManager.getAppSettings().searchStrategy;
+    state["ringImagingPasses"] = settingsManager.getAppSettings().ringImagingPasses;
+    state["matchScanPasses"] = settingsManager.getAppSettings().matchScanPasses;
+    state["scanTimeBudgetMs"] = settingsManager.getAppSettings().scanTimeBudgetMs;
+    state["ringNoFingerExit"] = settingsManager.getAppSettings().ringNoFingerExit;
+    state["sensorSleepWhenIdle"] = settingsManager.getAppSettings().sensorSleepWhenIdle;
+    JsonArray strategies = state["searchStrategies"].to<JsonArray>();
+    for (int i=0; i<(int)SearchStrategy::count; i++)
+      strategies.add(strategyNames[i]);
   }
-  return html;
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->addHeader("Cache-Control", "no-store");
+  serializeJson(state, *response);
+  request->send(response);
 }
 
-String getTimestampString(){
-  struct tm timeinfo;
-  if(!getLocalTime(&timeinfo)){
-    Serial.println("Failed to obtain time");
-    return "no time";
-  }
-  
-  char buffer[25];
-  strftime(buffer,sizeof(buffer),"%Y-%m-%d %H:%M:%S %Z", &timeinfo);
-  String datetime = String(buffer);
-  return datetime;
-}
-
-/* wait for maintenance mode or timeout 5s */
-bool waitForMaintenanceMode() {
-  needMaintenanceMode = true;
-  unsigned long startMillis = millis();
-  while (currentMode != Mode::maintenance) {
-    if ((millis() - startMillis) >= 5000ul) {
-      needMaintenanceMode = false;
-      return false;
-    }
-    delay(50);
+// Static files, stored gzipped by scripts/gzip_data.py and sent as they are. The ETag is the crc32 of the stored file,
+// so a browser revalidating its cached copy gets a 304 without body until the filesystem image changes.
+struct Asset {
+  const char *path;
+  const char *contentType;
+  const char *cacheControl;
+  char etag[11];
+  size_t size;
+};
+
+Asset assets[] = {
+  { "/index.html", "text/html", "no-cache" }, // cached, but revalidated on every load so updates show up at once
+  { "/settings.html", "text/html", "no-cache" },
+  { "/wificonfig.html", "text/html", "no-cache" },
+  { "/bootstrap.min.css", "text/css", "public, max-age=31536000" },
+};
+uint32_t assetResponses = 0;
+uint32_t assetNotModifiedResponses = 0;
+uint64_t assetBytes = 0; // body bytes of the files sent (compressed)
+LatencyHistogram pageTimeToFirstByte; // as reported by the browser
+uint64_t pageBytes = 0; // transferred per page load including all resources, as reported by the browser
+
+void computeAssetETags() {
+  uint8_t buffer[512];
+  for (Asset &asset : assets) {
+    String path = String(asset.path) + ".gz";
+    File file = SPIFFS.exists(path) ? SPIFFS.open(path) : SPIFFS.open(asset.path);
+    if (!file)
+      continue;
+    uint32_t crc = 0;
+    size_t n;
+    while ((n = file.read(buffer, sizeof(buffer))) > 0)
+      crc = crc32_le(crc, buffer, n);
+    asset.size = file.size();
+    file.close();
+    snprintf(asset.etag, sizeof(asset.etag), "\"%08x\"", crc);
   }
-  needMaintenanceMode = false;
-  return true;
 }
 
-// Replaces placeholder in HTML pages
-String processor(const String& var){
-  if(var == "LOGMESSAGES"){
-    return getLogMessagesAsHtml();
-  } else if (var == "FINGERLIST") {
-    return fingerManager.getFingerListAsHtmlOptionList();
-  } else if (var == "HOSTNAME") {
-    return settingsManager.getWifiSettings().hostname;
-  } else if (var == "VERSIONINFO") {
-    return VersionInfo;
-  } else if (var == "WIFI_SSID") {
-    return settingsManager.getWifiSettings().ssid;
-  } else if (var == "WIFI_PASSWORD") {
-    if (settingsManager.getWifiSettings().password.isEmpty())
-      return "";
-    else
-      return "********"; // for security reasons the wifi password will not left the device once configured
-  } else if (var == "NTP_SERVER") {
-    return settingsManager.getAppSettings().ntpServer;
+void serveAsset(AsyncWebServerRequest *request, const char *path) {
+  Asset *asset = NULL;
+  for (Asset &a : assets)
+    if (strcmp(a.path, path) == 0)
+      asset = &a;
+  if (!asset) {
+    request->send(404);
+    return;
+  }
+
+  if (asset->etag[0] && request->hasHeader("If-None-Match") && request->getHeader("If-None-Match")->value().equals(asset->etag)) {
+    AsyncWebServerResponse *response = request->beginResponse(304);
+    response->addHeader("ETag", asset->etag);
+    response->addHeader("Cache-Control", asset->cacheControl);
+    request->send(response);
+    assetNotModifiedResponses++;
+    return;
   }
 
-  return String();
+  // only the .gz file is in the filesystem image, the response adds "Content-Encoding: gzip" for it
+  AsyncWebServerResponse *response = request->beginResponse(SPIFFS, asset->path, asset->contentType);
+  if (asset->etag[0])
+    response->addHeader("ETag", asset->etag);
+  response->addHeader("Cache-Control", asset->cacheControl);
+  request->send(response);
+  assetResponses++;
+  assetBytes += asset->size;
 }
 
 
-// send LastMessage to websocket clients
-void notifyClients(String message) {
-  String messageWithTimestamp = "[" + getTimestampString() + "]: " + message;
-  Serial.println(messageWithTimestamp);
-  addLogMessage(messageWithTimestamp);
-  events.send(getLogMessagesAsHtml().c_str(),"message",millis(),1000);
+// add a message to the log and send it to the event source clients
+void notifyClients(LogCode code, int32_t arg0, int32_t arg1, const char *text) {
+  uint32_t allocations = getHeapAllocations();
+  StageTimer timer(logLatency);
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  const LogEntry &entry = logBuffer.add(wallClock.now(), code, arg0, arg1, text);
+  LogBuffer::format(entry, logLine, sizeof(logLine));
+  Serial.println(logLine);
+  events.send(logLine, "message", entry.id, 1000); // allocates the event for every connected client
+  if (isHeapAllocationTracked()) {
+    loggedMessages++;
+    logHeapAllocations += getHeapAllocations() - allocations;
+  }
+  xSemaphoreGive(logMutex);
   
   //String mqttRootTopic = settingsManager.getAppSettings().mqttRootTopic;
   //mqttClient.publish((String(mqttRootTopic) + "/lastLogMessage").c_str(), message.c_str());
 }
+void notifyClients(const String &message) {
+  notifyClients(LogCode::text, 0, 0, message.c_str());
+}
 
-void updateClientsFingerlist(String fingerlist) {
+void updateClientsFingerlist() {
   Serial.println("New fingerlist was sent to clients");
-  events.send(fingerlist.c_str(),"fingerlist",millis(),1000);
+  events.send(fingerManager.lockFingerListHtml(), "fingerlist"); // without id, it would overwrite the client's last log id
+  fingerManager.unlockFingerListHtml();
 }
 
 
-bool doPairing() {
-  String newPairingCode = settingsManager.generateNewPairingCode();
+const char *getEnrollStateName(EnrollState state) {
+  static const char *names[] = { "idle", "placeFinger", "removeFinger", "done", "failed", "timedOut", "cancelled" };
+  return names[(int)state];
+}
+
+void printEnrollProgressJson(JsonObject progress, const EnrollProgress &enroll) {
+  progress["state"] = getEnrollStateName(enroll.state);
+  progress["id"] = enroll.id;
+  progress["sample"] = enroll.sample;
+  progress["samples"] = ENROLL_SAMPLES;
+  if (enroll.state == EnrollState::failed)
+    progress["returnCode"] = enroll.returnCode;
+}
+
+// called by the sensor task on every step of an enrollment that changed something, the page shows it next to the log
+void notifyEnrollProgress(const EnrollProgress &progress) {
+  JsonDocument json;
+  printEnrollProgressJson(json.to<JsonObject>(), progress);
+  char buffer[128];
+  serializeJson(json, buffer, sizeof(buffer));
+  events.send(buffer, "enroll"); // without id like the fingerlist
+}
+
+// completion callbacks of sensor commands, called from the main loop
+void onEnrollDone(SensorCommand *command) {
+  if (command->ok) {
+    notifyClients(LogCode::enrollDone);
+    updateClientsFingerlist();
+  } else if ((EnrollState)command->result == EnrollState::timedOut) {
+    notifyClients(LogCode::enrollTimedOut, ENROLL_STEP_TIMEOUT_MS / 1000);
+  } else if ((EnrollState)command->result == EnrollState::cancelled) {
+    notifyClients(LogCode::enrollCancelled);
+  } else {
+    notifyClients(LogCode::enrollFailed, command->returnCode);
+  }
+}
+
+void onFingerlistChanged(SensorCommand *command) {
+  updateClientsFingerlist();
+}
+
+void onAllFingersDeleted(SensorCommand *command) {
+  if (!command->ok)
+    notifyClients(LogCode::databaseNotDeleted);
+  updateClientsFingerlist();
+}
+
+void onFactoryResetFingersDeleted(SensorCommand *command) {
+  if (!command->ok)
+    notifyClients(LogCode::databaseNotDeleted);
+  
+  if (!settingsManager.deleteAppSettings())
+    notifyClients(LogCode::appSettingsNotDeleted);
+
+  if (!settingsManager.deleteWifiSettings())
+    notifyClients(LogCode::wifiSettingsNotDeleted);
+
+  shouldReboot = true;
+}
+
+void onDatabaseTransferDone(SensorCommand *command) {
+  notifyClients(command->resultText);
+  if (command->type == SensorCommandType::importDatabase || command->type == SensorCommandType::provisionDatabase)
+    updateClientsFingerlist();
+}
+
+// Uploads of a database file for import or provisioning feed databaseTransfer, one at a time. Returns 0 if the upload
+// was taken, otherwise the HTTP status it is rejected with. An upload has to wait for nothing but the templates it
+// writes, so it is refused while an enrollment or another command keeps the sensor task away from the ring buffer.
+uint16_t startDatabaseUpload(AsyncWebServerRequest *request, SensorCommandType type) {
+  if (!databaseTransfer.open())
+    return 409;
+  if (sensorTask.isBusy() || sensorTask.submit(type, 0, String(), onDatabaseTransferDone, &databaseTransfer) == NULL) {
+    databaseTransfer.finishWriting();
+    databaseTransfer.finishReading();
+    return 503;
+  }
+  xSemaphoreTake(uploadMutex, portMAX_DELAY);
+  importRequest = request;
+  throttledUpload = NULL;
+  xSemaphoreGive(uploadMutex);
+  request->onDisconnect([request](){
+    xSemaphoreTake(uploadMutex, portMAX_DELAY);
+    if (importRequest == request) {
+      databaseTransfer.abort();
+      databaseTransfer.finishWriting();
+      importRequest = NULL;
+      throttledUpload = NULL;
+    }
+    xSemaphoreGive(uploadMutex);
+  });
+  return 0;
+}
+
+// Runs in the async_tcp task and must not wait for the sensor task. The data goes into the ring buffer right away.
+// Once less than a TCP window is free the received data is not acked, so the sender stops after at most one more
+// window, which still fits. pumpDatabaseUpload() acks it when the sensor task has made room again.
+void writeDatabaseUpload(AsyncWebServerRequest *request, uint8_t *data, size_t len, bool final) {
+  xSemaphoreTake(uploadMutex, portMAX_DELAY);
+  if (request == importRequest) {
+    if (databaseTransfer.writeAvailable(data, len) < len)
+      databaseTransfer.abort(); // sender ignored the window, the import fails instead of missing bytes
+    if (final) {
+      databaseTransfer.finishWriting();
+      request->client()->ack(DATABASE_UPLOAD_WINDOW); // whatever was held back, the response has to get through
+      importRequest = NULL;
+      throttledUpload = NULL;
+    } else if (databaseTransfer.getFree() < DATABASE_UPLOAD_WINDOW && !databaseTransfer.isAborted()) {
+      request->client()->ackLater();
+      throttledUpload = request->client();
+    }
+  }
+  xSemaphoreGive(uploadMutex);
+}
+
+// Called from the main loop, resumes a throttled upload.
+void pumpDatabaseUpload() {
+  if (throttledUpload == NULL)
+    return;
+  xSemaphoreTake(uploadMutex, portMAX_DELAY);
+  if (throttledUpload && (databaseTransfer.getFree() >= DATABASE_UPLOAD_WINDOW || databaseTransfer.isAborted())) {
+    throttledUpload->ack(DATABASE_UPLOAD_WINDOW);
+    throttledUpload = NULL;
+  }
+  xSemaphoreGive(uploadMutex);
+}
+
+void sendApiProvisionReport(AsyncWebServerRequest *request) {
+  static const char *stageNames[] = { "download", "store", "verify" };
+  ProvisionReport report = fingerManager.getProvisionReport();
+  JsonDocument json;
+  json["running"] = report.running;
+  json["ok"] = report.ok;
+  json["templates"] = report.templates;
+  json["skipped"] = report.skipped;
+  json["failed"] = report.failed;
+  json["bytes"] = report.bytes;
+  json["seconds"] = report.micros / 1e6;
+  json["templatesPerSecond"] = report.micros ? report.templates / (report.micros / 1e6) : 0;
+  if (report.error[0])
+    json["error"] = report.error;
+  JsonArray errors = json["slotErrors"].to<JsonArray>();
+  for (uint8_t i=0; i<report.errorCount; i++) {
+    JsonObject error = errors.add<JsonObject>();
+    error["id"] = report.errors[i].id;
+    error["stage"] = stageNames[(int)report.errors[i].stage];
+    error["returnCode"] = report.errors[i].returnCode;
+  }
+  JsonArray skippedIds = json["skippedIds"].to<JsonArray>();
+  for (uint16_t i=0; i<min(report.skipped, (uint16_t)DATABASE_MAX_SKIPPED_IDS); i++)
+    skippedIds.add(report.skippedIds[i]);
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->addHeader("Cache-Control", "no-store");
+  serializeJson(json, *response);
+  request->send(response);
+}
+
+void submitSensorCommand(SensorCommandType type, uint16_t id, const String &text, SensorCommandCallback onDone) {
+  if (sensorTask.submit(type, id, text, onDone) == NULL)
+    notifyClients(LogCode::sensorBusy);
+}
+
+
+// ===================================================================================================================
+// JSON API at /api/v1 for automation, the same data as the pages but without HTML to scrape.
+// Everything is serialized straight into the response stream, no intermediate String.
+// ===================================================================================================================
+void sendApiFingers(AsyncWebServerRequest *request) {
+  int offset = request->hasArg("offset") ? request->arg("offset").toInt() : 0;
+  int limit = request->hasArg("limit") ? request->arg("limit").toInt() : API_FINGERS_PAGE_SIZE;
+  if (offset < 0 || limit < 0) {
+    request->send(400, "application/json", "{\"error\":\"offset and limit must not be negative\"}");
+    return;
+  }
+  limit = min(limit, API_FINGERS_PAGE_SIZE);
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->addHeader("Cache-Control", "no-store");
+  printFingersJson(*response, [](int id, char *name, size_t size) { return fingerManager.nextFinger(id, name, size); },
+    fingerManager.getFingerCount(), offset, limit);
+  request->send(response);
+}
+
+void sendApiStatus(AsyncWebServerRequest *request) {
+  JsonDocument status;
+  status["version"] = VersionInfo;
+  status["hostname"] = settingsManager.getWifiSettings().hostname;
+  status["uptime"] = (uint32_t)(esp_timer_get_time() / 1000000);
+  JsonObject sensor = status["sensor"].to<JsonObject>();
+  sensor["connected"] = fingerManager.connected;
+  sensor["capacity"] = fingerManager.getCapacity();
+  sensor["fingers"] = fingerManager.getFingerCount();
+  sensor["commandQueueDepth"] = sensorTask.getQueueDepth();
+  printEnrollProgressJson(status["enroll"].to<JsonObject>(), fingerManager.getEnrollProgress());
+  JsonObject wifi = status["wifi"].to<JsonObject>();
+  wifi["ip"] = WiFi.localIP().toString();
+  wifi["rssi"] = WiFi.RSSI();
+  status["mqttConnected"] = mqtt.isConnected();
+  status["mqttQueueDepth"] = mqttQueue.getDepth();
+  JsonObject heap = status["heap"].to<JsonObject>();
+  heap["free"] = ESP.getFreeHeap();
+  heap["minFree"] = ESP.getMinFreeHeap();
+  heap["maxAlloc"] = ESP.getMaxAllocHeap();
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->addHeader("Cache-Control", "no-store");
+  serializeJson(status, *response);
+  request->send(response);
+}
+
+// the log messages still in the history, oldest first. With ?after=<id> only newer ones, like the SSE replay.
+void sendApiEvents(AsyncWebServerRequest *request) {
+  uint32_t after = request->hasArg("after") ? request->arg("after").toInt() : 0;
+  AsyncResponseStream *response = request->beginResponseStream("application/json");
+  response->addHeader("Cache-Control", "no-store");
+  JsonDocument item;
+  response->print("{\"events\":[");
+  xSemaphoreTake(logMutex, portMAX_DELAY);
+  uint32_t first = logBuffer.firstIdAfter(after);
+  for (uint32_t id=first; id<=logBuffer.getLastId(); id++) {
+    const LogEntry &entry = logBuffer.get(id);
+    LogBuffer::formatMessage(entry, logLine, sizeof(logLine));
+    item["id"] = id;
+    if (entry.time > 0)
+      item["time"] = (uint32_t)entry.time;
+    else
+      item["time"] = nullptr;
+    item["severity"] = LogBuffer::getSeverityName(entry.severity);
+    item["code"] = (int)entry.code;
+    item["message"] = (const char*)logLine;
+    if (id != first)
+      response->print(',');
+    serializeJson(item, *response);
+  }
+  xSemaphoreGive(logMutex);
+  response->print("]}");
+  request->send(response);
+}
 
-  if (fingerManager.setPairingCode(newPairingCode)) {
+// {"action":"enroll"|"rename"|"delete","id":n,"name":"..."}. The command is queued for the sensor task, its result
+// shows up in the log like for the page (enrollment needs the finger on the sensor several times, its progress is in
+// /api/v1/status). {"action":"cancelEnroll"} stops a running enrollment.
+void handleApiFingerCommand(AsyncWebServerRequest *request, JsonVariant &json) {
+  const char *action = json["action"] | "";
+  if (strcmp(action, "cancelEnroll") == 0) {
+    if (sensorTask.cancelEnroll())
+      request->send(202, "application/json", "{\"status\":\"cancelling\"}");
+    else
+      request->send(409, "application/json", "{\"error\":\"no enrollment running\"}");
+    return;
+  }
+  int id = json["id"] | 0;
+  const char *name = json["name"] | "";
+  SensorCommandType type;
+  SensorCommandCallback onDone = onFingerlistChanged;
+  if (strcmp(action, "enroll") == 0) {
+    type = SensorCommandType::enroll;
+    onDone = onEnrollDone;
+  } else if (strcmp(action, "rename") == 0) {
+    type = SensorCommandType::renameFinger;
+  } else if (strcmp(action, "delete") == 0) {
+    type = SensorCommandType::deleteFinger;
+  } else {
+    request->send(400, "application/json", "{\"error\":\"action must be enroll, cancelEnroll, rename or delete\"}");
+    return;
+  }
+  if (id < 1 || id >= fingerManager.getCapacity()) {
+    request->send(400, "application/json", "{\"error\":\"invalid id\"}");
+    return;
+  }
+  if (strlen(name) > FINGER_NAME_MAX_LENGTH) {
+    request->send(400, "application/json", String("{\"error\":\"name is longer than ") + FINGER_NAME_MAX_LENGTH + " bytes\"}");
+    return;
+  }
+  char currentName[FINGER_NAME_BUFFER_SIZE];
+  if (type != SensorCommandType::enroll && !fingerManager.copyFingerName(id, currentName, sizeof(currentName))) {
+    request->send(404, "application/json", "{\"error\":\"no finger with this id\"}");
+    return;
+  }
+  if (sensorTask.submit(type, id, name, onDone) == NULL) {
+    request->send(503, "application/json", "{\"error\":\"sensor is busy\"}");
+    return;
+  }
+  request->send(202, "application/json", "{\"status\":\"queued\"}");
+}
+
+// Journal records of a time range as JSON, read in small batches by the chunked response so a long range is never
+// held in RAM.
+#define JOURNAL_JSON_RECORD_MAX 112 // one formatted record
+#define JOURNAL_JSON_BATCH 8
+
+struct JournalJsonState {
+  JournalCursor cursor;
+  uint32_t records = 0;
+  bool opened = false;
+  bool closed = false;
+};
+
+size_t readJournalJson(JournalJsonState &state, char *buffer, size_t size) {
+  static const char *resultNames[] = { "noFinger", "match", "noMatch", "error" };
+  if (state.closed)
+    return 0;
+  if (size < JOURNAL_JSON_RECORD_MAX + 16)
+    return RESPONSE_TRY_AGAIN;
+  size_t length = 0;
+  if (!state.opened) {
+    length += snprintf(buffer, size, "{\"records\":[");
+    state.opened = true;
+  }
+  JournalRecord records[JOURNAL_JSON_BATCH];
+  size_t n = accessJournal.read(state.cursor, records, min((size - length - 2) / JOURNAL_JSON_RECORD_MAX, (size_t)JOURNAL_JSON_BATCH));
+  for (size_t i=0; i<n; i++) {
+    JournalRecord &record = records[i];
+    uint8_t result = record.result & ~JOURNAL_TIME_ESTIMATED;
+    length += snprintf(buffer + length, size - length, "%s{\"time\":%u,\"timeEstimated\":%s,\"result\":\"%s\",\"id\":%u,\"confidence\":%u,\"code\":%u}",
+      state.records++ ? "," : "", record.time, (record.result & JOURNAL_TIME_ESTIMATED) ? "true" : "false",
+      result < 4 ? resultNames[result] : "unknown", record.matchId, record.confidence, record.returnCode);
+  }
+  if (state.cursor.done) {
+    length += snprintf(buffer + length, size - length, "]}");
+    state.closed = true;
+  }
+  return length;
+}
+
+void onPairingWritten(SensorCommand *command) {
+  if (command->ok) {
     AppSettings settings = settingsManager.getAppSettings();
-    settings.sensorPairingCode = newPairingCode;
+    settings.sensorPairingCode = command->text;
     settings.sensorPairingValid = true;
     settingsManager.saveAppSettings(settings);
-    notifyClients("Pairing successful.");
-    return true;
+    notifyClients(LogCode::pairingSuccessful);
   } else {
-    notifyClients("Pairing failed.");
+    notifyClients(LogCode::pairingFailed);
+  }
+}
+
+/* writes a new pairing code to the sensor, result is reported by onPairingWritten() */
+bool doPairing() {
+  String newPairingCode = settingsManager.generateNewPairingCode();
+
+  if (sensorTask.submit(SensorCommandType::writePairingCode, 0, newPairingCode, onPairingWritten) == NULL) {
+    notifyClients(LogCode::pairingFailedBusy);
     return false;
   }
+  return true;
+}
+
+
+/* reads the pairing code from the sensor and blocks until done, so don't use it from webserver callbacks */
+String readSensorPairingCode() {
+  String pairingCode = "";
+  SensorCommand *command = sensorTask.submit(SensorCommandType::readPairingCode);
+  if (command == NULL)
+    return pairingCode;
+  if (sensorTask.wait(command, 5000))
+    pairingCode = command->resultText;
+  sensorTask.release(command);
+  return pairingCode;
+}
+
 
+/* runs a command on the sensor task and blocks until done, so don't use it from webserver callbacks */
+bool runSensorCommand(SensorCommandType type) {
+  SensorCommand *command = sensorTask.submit(type);
+  if (command == NULL)
+    return false;
+  bool ok = sensorTask.wait(command, 5000) && command->ok;
+  sensorTask.release(command);
+  return ok;
 }
 
 
-bool checkPairingValid() {
+bool checkPairingValid(const String &actualSensorPairingCode) {
   AppSettings settings = settingsManager.getAppSettings();
 
    if (!settings.sensorPairingValid) {
@@ -182,7 +634,6 @@ bool checkPairingValid() {
      }
    }
 
-  String actualSensorPairingCode = fingerManager.getPairingCode();
   //Serial.println("Awaited pairing code: " + settings.sensorPairingCode);
   //Serial.println("Actual pairing code: " + actualSensorPairingCode);
 
@@ -193,7 +644,6 @@ bool checkPairingValid() {
       // An empty code means there was a communication problem. So we don't have a valid code, but maybe next read will succeed and we get one again.
       // But here we just got an non-empty pairing code that was different to the awaited one. So don't expect that will change in future until repairing was done.
       // -> invalidate pairing for security reasons
-      AppSettings settings = settingsManager.getAppSettings();
       settings.sensorPairingValid = false;
       settingsManager.saveAppSettings(settings);
     }
@@ -202,19 +652,25 @@ bool checkPairingValid() {
 }
 
 
-bool initWifi() {
-  // Connect to Wi-Fi
+// Connect to Wi-Fi, the association runs in the background until waitForWifi()
+void startWifi() {
   WifiSettings wifiSettings = settingsManager.getWifiSettings();
   WiFi.mode(WIFI_STA);
   WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE, INADDR_NONE);
   WiFi.setHostname(wifiSettings.hostname.c_str()); //define hostname
   WiFi.begin(wifiSettings.ssid.c_str(), wifiSettings.password.c_str());
-  int counter = 0;
+}
+
+bool waitForWifi() {
+  unsigned long start = millis();
+  unsigned long lastMessage = start;
   while (WiFi.status() != WL_CONNECTED) {
-    delay(1000);
-    Serial.println("Waiting for WiFi connection...");
-    counter++;
-    if (counter > 30)
+    delay(WIFI_POLL_INTERVAL_MS);
+    if (millis() - lastMessage >= 1000) {
+      Serial.println("Waiting for WiFi connection...");
+      lastMessage = millis();
+    }
+    if (millis() - start > WIFI_CONNECT_TIMEOUT_MS)
       return false;
   }
   Serial.println("Connected!");
@@ -238,16 +694,35 @@ void initWiFiAccessPointForConfiguration() {
 }
 
 
+void mountSpiffsTask(void *parameter) {
+  spiffsOk = SPIFFS.begin(true);
+  if (spiffsOk) {
+    computeAssetETags();
+    accessJournal.begin();
+  }
+  bootProfiler.mark("spiffs");
+  xSemaphoreGive(spiffsMounted);
+  vTaskDelete(NULL);
+}
+
+// mounting (or formatting on first boot) takes a while, so it runs in parallel to WiFi and sensor setup
+void startSpiffsMount() {
+  spiffsMounted = xSemaphoreCreateBinary();
+  xTaskCreate(mountSpiffsTask, "spiffs", 4096, NULL, 1, NULL);
+}
+
 void startWebserver(){
   
-  // Initialize SPIFFS
-  if(!SPIFFS.begin(true)){
+  // Wait for SPIFFS
+  xSemaphoreTake(spiffsMounted, portMAX_DELAY);
+  xSemaphoreGive(spiffsMounted);
+  if(!spiffsOk){
     Serial.println("An Error has occurred while mounting SPIFFS");
     return;
   }
 
   // Init time by NTP Client
-  configTime(gmtOffset_sec, daylightOffset_sec, settingsManager.getAppSettings().ntpServer.c_str());
+  wallClock.begin(settingsManager.getAppSettings().ntpServer.c_str(), gmtOffset_sec, daylightOffset_sec);
   
   // webserver for normal operating or wifi config?
   if (currentMode == Mode::wificonfig)
@@ -257,7 +732,7 @@ void startWebserver(){
     // =================
 
     webServer.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
-      request->send(SPIFFS, "/wificonfig.html", String(), false, processor);
+      serveAsset(request, "/wificonfig.html");
     });
 
     webServer.on("/save", HTTP_GET, [](AsyncWebServerRequest *request){
@@ -296,24 +771,40 @@ void startWebserver(){
       if(client->lastId()){
         Serial.printf("Client reconnected! Last message ID it got was: %u\n", client->lastId());
       }
-      //send event with message "ready", id current millis
-      // and set reconnect delay to 1 second
-      client->send(getLogMessagesAsHtml().c_str(),"message",millis(),1000);
+      replayLogMessages(client);
     });
     webServer.addHandler(&events);
 
     
     // Route for root / web page
     webServer.on("/", HTTP_GET, [](AsyncWebServerRequest *request){
-      request->send(SPIFFS, "/index.html", String(), false, processor);
+      serveAsset(request, "/index.html");
+    });
+
+    // <option> list for the finger select of the index page, streamed from the pre-rendered list
+    webServer.on("/fingerlist", HTTP_GET, [](AsyncWebServerRequest *request){
+      uint32_t generation = 0;
+      request->send(request->beginChunkedResponse("text/html", [generation](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+        return fingerManager.readFingerListHtml(index, buffer, maxLen, generation);
+      }));
     });
 
     webServer.on("/enroll", HTTP_GET, [](AsyncWebServerRequest *request){
       if(request->hasArg("startEnrollment"))
       {
-        enrollId = request->arg("newFingerprintId");
-        enrollName = request->arg("newFingerprintName");
-        currentMode = Mode::enroll;
+        String enrollId = request->arg("newFingerprintId");
+        int id = enrollId.toInt();
+        String name = request->arg("newFingerprintName");
+        if (id < 1 || id >= fingerManager.getCapacity())
+          notifyClients(LogCode::invalidSlotId, 0, 0, enrollId.c_str());
+        else if (name.length() > FINGER_NAME_MAX_LENGTH)
+          notifyClients(LogCode::nameTooLong, name.length(), FINGER_NAME_MAX_LENGTH);
+        else
+          submitSensorCommand(SensorCommandType::enroll, id, name, onEnrollDone);
+      }
+      else if (request->hasArg("cancelEnrollment"))
+      {
+        sensorTask.cancelEnroll();
       }
       request->redirect("/");
     });
@@ -324,15 +815,16 @@ void startWebserver(){
         if(request->hasArg("btnDelete"))
         {
           int id = request->arg("selectedFingerprint").toInt();
-          waitForMaintenanceMode();
-          fingerManager.deleteFinger(id);
-          currentMode = Mode::scan;
+          submitSensorCommand(SensorCommandType::deleteFinger, id, String(), onFingerlistChanged);
         }
         else if (request->hasArg("btnRename"))
         {
           int id = request->arg("selectedFingerprint").toInt();
           String newName = request->arg("renameNewName");
-          fingerManager.renameFinger(id, newName);
+          if (newName.length() > FINGER_NAME_MAX_LENGTH)
+            notifyClients(LogCode::nameTooLong, newName.length(), FINGER_NAME_MAX_LENGTH);
+          else
+            submitSensorCommand(SensorCommandType::renameFinger, id, newName, onFingerlistChanged);
         }
       }
       request->redirect("/");  
@@ -344,11 +836,22 @@ void startWebserver(){
         Serial.println("Save settings");
         AppSettings settings = settingsManager.getAppSettings();
         settings.ntpServer = request->arg("ntpServer");
+        if (request->arg("searchStrategy").toInt() < (int)SearchStrategy::count)
+          settings.searchStrategy = request->arg("searchStrategy").toInt();
+        if (request->hasArg("ringImagingPasses"))
+          settings.ringImagingPasses = constrain(request->arg("ringImagingPasses").toInt(), 1, 50);
+        if (request->hasArg("matchScanPasses"))
+          settings.matchScanPasses = constrain(request->arg("matchScanPasses").toInt(), 1, 10);
+        if (request->hasArg("scanTimeBudgetMs"))
+          settings.scanTimeBudgetMs = constrain(request->arg("scanTimeBudgetMs").toInt(), 0, 10000);
+        if (request->hasArg("ringNoFingerExit"))
+          settings.ringNoFingerExit = constrain(request->arg("ringNoFingerExit").toInt(), 0, 50);
+        settings.sensorSleepWhenIdle = request->hasArg("sensorSleepWhenIdle"); // an unchecked checkbox is not sent
         settingsManager.saveAppSettings(settings);
         request->redirect("/");  
         shouldReboot = true;
       } else {
-        request->send(SPIFFS, "/settings.html", String(), false, processor);
+        serveAsset(request, "/settings.html");
       }
     });
 
@@ -360,7 +863,7 @@ void startWebserver(){
         doPairing();
         request->redirect("/");  
       } else {
-        request->send(SPIFFS, "/settings.html", String(), false, processor);
+        serveAsset(request, "/settings.html");
       }
     });
 
@@ -369,21 +872,14 @@ void startWebserver(){
     webServer.on("/factoryReset", HTTP_GET, [](AsyncWebServerRequest *request){
       if(request->hasArg("btnFactoryReset"))
       {
-        notifyClients("Factory reset initiated...");
-        
-        if (!fingerManager.deleteAll())
-          notifyClients("Finger database could not be deleted.");
+        notifyClients(LogCode::factoryReset);
         
-        if (!settingsManager.deleteAppSettings())
-          notifyClients("App settings could not be deleted.");
-
-        if (!settingsManager.deleteWifiSettings())
-          notifyClients("Wifi settings could not be deleted.");
+        // settings are deleted and the reboot is triggered once the fingers are gone
+        submitSensorCommand(SensorCommandType::deleteAll, 0, String(), onFactoryResetFingersDeleted);
         
         request->redirect("/");  
-        shouldReboot = true;
       } else {
-        request->send(SPIFFS, "/settings.html", String(), false, processor);
+        serveAsset(request, "/settings.html");
       }
     });
 
@@ -391,18 +887,195 @@ void startWebserver(){
     webServer.on("/deleteAllFingerprints", HTTP_GET, [](AsyncWebServerRequest *request){
       if(request->hasArg("btnDeleteAllFingerprints"))
       {
-        notifyClients("Deleting all fingerprints...");
+        notifyClients(LogCode::deletingAll);
         
-        if (!fingerManager.deleteAll())
-          notifyClients("Finger database could not be deleted.");
+        submitSensorCommand(SensorCommandType::deleteAll, 0, String(), onAllFingersDeleted);
         
         request->redirect("/");  
         
       } else {
-        request->send(SPIFFS, "/settings.html", String(), false, processor);
+        serveAsset(request, "/settings.html");
+      }
+    });
+
+    // Sensor database for sensor replacement. Templates are streamed from/to the sensor task through databaseTransfer,
+    // the database is never held in RAM as a whole.
+    webServer.on("/exportSensorDB", HTTP_GET, [](AsyncWebServerRequest *request){
+      if (!databaseTransfer.open()) {
+        request->send(409, "text/plain", "Another database transfer is running.");
+        return;
+      }
+      if (sensorTask.submit(SensorCommandType::exportDatabase, 0, String(), onDatabaseTransferDone, &databaseTransfer) == NULL) {
+        databaseTransfer.finishWriting();
+        databaseTransfer.finishReading();
+        request->send(503, "text/plain", "Sensor is busy, please try again later.");
+        return;
+      }
+      AsyncWebServerResponse *response = request->beginChunkedResponse("application/octet-stream", [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+        bool finished = databaseTransfer.isWritingFinished() || databaseTransfer.isAborted(); // check before reading, the last bytes may still arrive
+        size_t length = databaseTransfer.readAvailable(buffer, maxLen);
+        if (length > 0)
+          return length;
+        if (!finished)
+          return RESPONSE_TRY_AGAIN;
+        databaseTransfer.finishReading();
+        return 0;
+      });
+      response->addHeader("Content-Disposition", "attachment; filename=\"fingerprints.fpdb\"");
+      request->onDisconnect([](){
+        if (!databaseTransfer.isWritingFinished())
+          databaseTransfer.abort();
+        databaseTransfer.finishReading();
+      });
+      request->send(response);
+    });
+
+    webServer.on("/importSensorDB", HTTP_POST, [](AsyncWebServerRequest *request){
+      request->redirect("/"); // result is shown in the log when the sensor task is done
+    }, [](AsyncWebServerRequest *request, const String &filename, size_t index, uint8_t *data, size_t len, bool final){
+      if (index == 0) {
+        uint16_t status = startDatabaseUpload(request, SensorCommandType::importDatabase);
+        if (status == 409)
+          notifyClients(LogCode::transferRunning);
+        else if (status == 503)
+          notifyClients(LogCode::sensorBusy);
+        else
+          notifyClients(LogCode::importStarted, 0, 0, filename.c_str());
       }
+      writeDatabaseUpload(request, data, len, final);
+    });
+
+    // JSON API, see the README
+    webServer.on("/api/v1/fingers", HTTP_GET, [](AsyncWebServerRequest *request){
+      sendApiFingers(request);
     });
 
+    AsyncCallbackJsonWebHandler *fingerCommandHandler = new AsyncCallbackJsonWebHandler("/api/v1/fingers", handleApiFingerCommand);
+    fingerCommandHandler->setMethod(HTTP_POST);
+    fingerCommandHandler->setMaxContentLength(256);
+    webServer.addHandler(fingerCommandHandler);
+
+    // bulk provisioning: the body is a database file like the export, sent as application/octet-stream. The templates
+    // are written while the upload is still running, the report is at GET /api/v1/provision.
+    webServer.on("/api/v1/provision", HTTP_POST, [](AsyncWebServerRequest *request){
+      // status the upload got at its start, kept with the request, freed by the webserver
+      uint16_t status = request->_tempObject ? *(uint16_t*)request->_tempObject : 400;
+      if (status == 0)
+        request->send(202, "application/json", "{\"status\":\"running\"}");
+      else if (status == 409)
+        request->send(409, "application/json", "{\"error\":\"another database transfer is running\"}");
+      else if (status == 503)
+        request->send(503, "application/json", "{\"error\":\"sensor is busy\"}");
+      else
+        request->send(400, "application/json", "{\"error\":\"body must be a database file\"}");
+    }, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total){
+      if (index == 0 && request->_tempObject == NULL) {
+        uint16_t *status = (uint16_t*)malloc(sizeof(uint16_t));
+        if (status == NULL)
+          return;
+        *status = startDatabaseUpload(request, SensorCommandType::provisionDatabase);
+        request->_tempObject = status;
+        if (*status == 0)
+          notifyClients(LogCode::provisioningStarted, total);
+      }
+      writeDatabaseUpload(request, data, len, index + len == total);
+    });
+
+    webServer.on("/api/v1/provision", HTTP_GET, [](AsyncWebServerRequest *request){
+      sendApiProvisionReport(request);
+    });
+
+    webServer.on("/api/v1/status", HTTP_GET, [](AsyncWebServerRequest *request){
+      sendApiStatus(request);
+    });
+
+    webServer.on("/api/v1/events", HTTP_GET, [](AsyncWebServerRequest *request){
+      sendApiEvents(request);
+    });
+
+    // scan events of a time range from the access journal, ?from=<unix time>&to=<unix time>
+    webServer.on("/api/v1/journal", HTTP_GET, [](AsyncWebServerRequest *request){
+      JournalJsonState state;
+      uint32_t from = request->hasArg("from") ? strtoul(request->arg("from").c_str(), NULL, 10) : 0;
+      uint32_t to = request->hasArg("to") ? strtoul(request->arg("to").c_str(), NULL, 10) : UINT32_MAX;
+      state.cursor = accessJournal.query(from, to);
+      AsyncWebServerResponse *response = request->beginChunkedResponse("application/json", [state](uint8_t *buffer, size_t maxLen, size_t index) mutable -> size_t {
+        return readJournalJson(state, (char*)buffer, maxLen);
+      });
+      response->addHeader("Cache-Control", "no-store");
+      request->send(response);
+    });
+
+    // page load timing measured by the browser (see reportPageLoad() in the pages)
+    webServer.on("/pageload", HTTP_GET, [](AsyncWebServerRequest *request){
+      if (request->hasArg("ttfb") && request->hasArg("bytes")) {
+        pageTimeToFirstByte.record(max(0L, request->arg("ttfb").toInt()) * 1000);
+        pageBytes += request->arg("bytes").toInt();
+      }
+      request->send(204);
+    });
+
+    // runtime metrics in Prometheus text format
+    webServer.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request){
+      AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+      fingerManager.printMetrics(*response);
+      accessJournal.printMetrics(*response);
+      mqttQueue.printMetrics(*response);
+      sensorTask.printMetrics(*response);
+      printMetricHeader(*response, "doorbell_scan_handover_seconds", "histogram", "Scan event posted by the sensor task until handled by the main loop.");
+      scanHandoverLatency.print(*response, "doorbell_scan_handover_seconds", "");
+      printMetricHeader(*response, "doorbell_mqtt_publish_seconds", "histogram", "Publishing a scan result over MQTT.");
+      mqttPublishLatency.print(*response, "doorbell_mqtt_publish_seconds", "");
+      printMetricHeader(*response, "doorbell_loop_seconds_max", "gauge", "Longest loop() iteration since the last periodic report.");
+      response->printf("doorbell_loop_seconds_max %.6f\n", loopMaxMicros / 1e6);
+      printMetricHeader(*response, "doorbell_asset_responses_total", "counter", "Static files requested, not_modified ones were answered from the browser cache.");
+      printMetric(*response, "doorbell_asset_responses_total", "status=\"ok\"", assetResponses);
+      printMetric(*response, "doorbell_asset_responses_total", "status=\"not_modified\"", assetNotModifiedResponses);
+      printMetricHeader(*response, "doorbell_asset_bytes_total", "counter", "Bytes of static files sent (compressed).");
+      printMetric(*response, "doorbell_asset_bytes_total", "", assetBytes);
+      printMetricHeader(*response, "doorbell_page_ttfb_seconds", "histogram", "Time to first byte of page loads, reported by the browser.");
+      pageTimeToFirstByte.print(*response, "doorbell_page_ttfb_seconds", "");
+      printMetricHeader(*response, "doorbell_page_transfer_bytes_total", "counter", "Bytes transferred by page loads including all resources, reported by the browser.");
+      printMetric(*response, "doorbell_page_transfer_bytes_total", "", pageBytes);
+      printMetricHeader(*response, "doorbell_boot_phase_seconds", "gauge", "Time since boot at which a startup phase was finished.");
+      bootProfiler.printMetrics(*response, "doorbell_boot_phase_seconds");
+      IdleAllocations sensorIdleAllocations = sensorTask.getIdleScanAllocations();
+      printMetricHeader(*response, "doorbell_idle_scans_total", "counter", "Scan loop iterations without a finger on the sensor.");
+      printMetric(*response, "doorbell_idle_scans_total", "loop=\"sensor_task\"", sensorIdleAllocations.getIterations());
+      printMetric(*response, "doorbell_idle_scans_total", "loop=\"main\"", idleScanAllocations.getIterations());
+      #ifdef COUNT_HEAP_ALLOCATIONS // allocations are only counted by the diagnostics build
+      printMetricHeader(*response, "doorbell_idle_scan_heap_allocations_total", "counter", "Heap allocations during idle scan loop iterations, should be 0.");
+      printMetric(*response, "doorbell_idle_scan_heap_allocations_total", "loop=\"sensor_task\"", sensorIdleAllocations.getAllocations());
+      printMetric(*response, "doorbell_idle_scan_heap_allocations_total", "loop=\"main\"", idleScanAllocations.getAllocations());
+      #endif
+      printMetricHeader(*response, "doorbell_log_message_seconds", "histogram", "Adding a log message and sending it to the event source clients.");
+      logLatency.print(*response, "doorbell_log_message_seconds", "");
+      printMetricHeader(*response, "doorbell_log_messages_total", "counter", "Log messages added by the main loop and the sensor task.");
+      printMetric(*response, "doorbell_log_messages_total", "", loggedMessages);
+      #ifdef COUNT_HEAP_ALLOCATIONS
+      printMetricHeader(*response, "doorbell_log_heap_allocations_total", "counter", "Heap allocations while adding these log messages, sending events allocates per client.");
+      printMetric(*response, "doorbell_log_heap_allocations_total", "", logHeapAllocations);
+      #endif
+      printMetricHeader(*response, "doorbell_clock_syncs_total", "counter", "Times the wall clock was set or corrected from the NTP time.");
+      printMetric(*response, "doorbell_clock_syncs_total", "", wallClock.getSyncs());
+      request->send(response);
+    });
+
+#ifdef FINGERPRINT_SENSOR_EMULATOR
+    // load a finger script into the emulated sensor (see R503Emulator.h for the syntax) and show its per-command latencies
+    webServer.on("/emulator", HTTP_GET, [](AsyncWebServerRequest *request){
+      AsyncResponseStream *response = request->beginResponseStream("text/plain");
+      if (request->hasArg("store"))
+        sensorEmulator.storeTemplate(request->arg("page").toInt(), request->arg("store").toInt());
+      if (request->hasArg("script"))
+        response->println(sensorEmulator.loadScript(request->arg("script").c_str()) ? "Script loaded." : "Invalid script.");
+      if (request->hasArg("reset"))
+        sensorEmulator.resetStats();
+      sensorEmulator.printStats(*response);
+      request->send(response);
+    });
+#endif
+
     webServer.onNotFound([](AsyncWebServerRequest *request){
       request->send(404);
     });
@@ -417,7 +1090,11 @@ void startWebserver(){
   });
 
   webServer.on("/bootstrap.min.css", HTTP_GET, [](AsyncWebServerRequest *request){
-    request->send(SPIFFS, "/bootstrap.min.css", "text/css");
+    serveAsset(request, "/bootstrap.min.css");
+  });
+
+  webServer.on("/state", HTTP_GET, [](AsyncWebServerRequest *request){
+    sendState(request);
   });
 
 
@@ -427,89 +1104,105 @@ void startWebserver(){
   // Start server
   webServer.begin();
 
-  notifyClients("System booted successfully!");
+  notifyClients(LogCode::booted);
 
 }
 
-void updatePerson(String name, int confidence, int id) {
-    // Create JSON document for attributes
-    JsonDocument attributes;
-    attributes["confidence"] = confidence;
-    attributes["id"] = id;
-    
-    // Convert to string and set attributes
-    String attributesStr;
-    serializeJson(attributes, attributesStr);
-    person.setJsonAttributes(attributesStr.c_str());
-    person.setValue(name.c_str());
+bool publishMqttEvent(const MqttEvent &event) {
+  if (!mqtt.isConnected())
+    return false;
+  switch (event.type) {
+    case MqttEventType::person:
+      // formatted by hand into a fixed buffer, a JsonDocument would allocate on every scan result
+      snprintf(personAttributes, sizeof(personAttributes), "{\"confidence\":%d,\"id\":%d}", event.confidence, event.id);
+      return person.setJsonAttributes(personAttributes) && person.setValue(event.name);
+    case MqttEventType::wifiSignal:
+      return wifiSignal.setValue(event.value);
+  }
+  return false;
+}
+
+void updatePerson(const char *name, int confidence, int id) {
+  mqttQueue.push(MqttEvent::person(name, confidence, id));
+  mqttQueue.flush(); // sent at once if connected, otherwise written to flash
+}
+
+void releaseDoorbellButton(void *arg) {
+  digitalWrite(doorbellOutputPin, LOW);
 }
 
 void ring(HAButton *sender = NULL) {
+  // press the button and let a timer release it, so the loop keeps running while the bell rings
   digitalWrite(doorbellOutputPin, HIGH);
-  delay(DOORBELL_BUTTON_PRESS_MS);
-  digitalWrite(doorbellOutputPin, LOW);
+  esp_timer_stop(doorbellTimer); // ring again while still pressed -> extend press
+  esp_timer_start_once(doorbellTimer, DOORBELL_BUTTON_PRESS_MS * 1000ull);
 }
 
-void doScan()
+void handleScanEvent(const ScanEvent &match)
 {
-  Match match = fingerManager.scanFingerprint();
+  scanHandoverLatency.record(micros() - match.postedMicros);
   switch(match.scanResult)
   {
     case ScanResult::noFinger:
-      // standard case, occurs every iteration when no finger touchs the sensor
-      if (match.scanResult != lastMatch.scanResult) {
+      // sensor task only reports the transition back to "no finger"
+      if (match.scanResult != lastScanResult) {
         Serial.println("no finger");
         updatePerson("Nobody", -1, -1);
       }
       break; 
-    case ScanResult::matchFound:
-      notifyClients( String("Match Found: ") + match.matchId + " - " + match.matchName  + " with confidence of " + match.matchConfidence );
-      if (match.scanResult != lastMatch.scanResult) {
-        if (checkPairingValid()) {
-          updatePerson(match.matchName, match.matchConfidence, match.matchId);
+    case ScanResult::matchFound: {
+      fingerManager.copyFingerName(match.matchId, matchName, sizeof(matchName));
+      notifyClients(LogCode::matchFound, match.matchId, match.matchConfidence, matchName);
+      if (match.scanResult != lastScanResult) {
+        if (checkPairingValid(String(match.pairingCode))) {
+          StageTimer publishTimer(mqttPublishLatency);
+          updatePerson(matchName, match.matchConfidence, match.matchId);
+          publishTimer.stop();
           Serial.println("MQTT message sent: Open the door!");
         } else {
-          notifyClients("Security issue! Match was not sent by MQTT because of invalid sensor pairing! This could potentially be an attack! If the sensor is new or has been replaced by you do a (re)pairing in settings page.");
+          notifyClients(LogCode::pairingInvalidMatch);
         }
       }
-      delay(3000); // wait some time before next scan to let the LED blink
       break;
+    }
     case ScanResult::noMatchFound:
-      notifyClients(String("No Match Found (Code ") + match.returnCode + ")");
-      if (match.scanResult != lastMatch.scanResult) {
+      notifyClients(LogCode::noMatchFound, match.returnCode);
+      if (match.scanResult != lastScanResult) {
         Serial.println("MQTT message sent: ring the bell!");
         ring();
+        StageTimer publishTimer(mqttPublishLatency);
         updatePerson("Unknown", -1, -1);
       } 
-      delay(3000); // wait some time before next scan to let the LED blink
       break;
     case ScanResult::error:
-      notifyClients(String("ScanResult Error (Code ") + match.returnCode + ")");
+      notifyClients(LogCode::scanError, match.returnCode);
       break;
   };
-  lastMatch = match;
+  // after MQTT, writing to flash must not delay opening the door. Only the decisions are journaled: scan errors
+  // (e.g. raindrops) repeat with every poll and would wear the flash and push the door history out of the journal.
+  bool decision = (match.scanResult == ScanResult::matchFound || match.scanResult == ScanResult::noMatchFound);
+  if (decision && match.scanResult != lastScanResult) {
+    accessJournal.append(wallClock.now(), wallClock.isSet(), match.scanResult, match.matchId, match.matchConfidence, match.returnCode);
+  }
+  lastScanResult = match.scanResult;
 }
 
-void doEnroll()
+void doScan()
 {
-  int id = enrollId.toInt();
-  if (id < 1 || id > 200) {
-    notifyClients("Invalid memory slot id '" + enrollId + "'");
-    return;
-  }
-
-  NewFinger finger = fingerManager.enrollFinger(id, enrollName);
-  if (finger.enrollResult == EnrollResult::ok) {
-    notifyClients("Enrollment successfull. You can now use your new finger for scanning.");
-    updateClientsFingerlist(fingerManager.getFingerListAsHtmlOptionList());
-  }  else if (finger.enrollResult == EnrollResult::error) {
-    notifyClients(String("Enrollment failed. (Code ") + finger.returnCode + ")");
+  // scanning itself is done by the sensor task, here we only publish its results
+  idleScanAllocations.start();
+  ScanEvent event;
+  bool idle = true;
+  while (sensorTask.nextScanEvent(&event)) {
+    handleScanEvent(event);
+    idle = false;
   }
+  idleScanAllocations.stop(idle);
 }
 
 void reboot()
 {
-  notifyClients("System is rebooting now...");
+  notifyClients(LogCode::rebooting);
   delay(1000);
     
   mqtt.disconnect();
@@ -540,6 +1233,11 @@ void setupHA() {
     person.setIcon("mdi:account");
 }
 
+// Keep WiFi associated but let the modem sleep between beacons
+void initPowerManagement() {
+  WiFi.setSleep(true);
+}
+
 void setup()
 {
   // open serial monitor for debug infos
@@ -547,59 +1245,121 @@ void setup()
   while (!Serial);  // For Yun/Leo/Micro/Zero/...
   delay(100);
 
+  trackHeapAllocations(); // setup() and loop() run in the same task
+  bootProfiler.mark("serial");
+
   setupHA();
 
   // initialize GPIOs
   pinMode(doorbellOutputPin, OUTPUT); 
+  esp_timer_create_args_t doorbellTimerArgs = {};
+  doorbellTimerArgs.callback = releaseDoorbellButton;
+  doorbellTimerArgs.name = "doorbell";
+  esp_timer_create(&doorbellTimerArgs, &doorbellTimer);
 
   settingsManager.loadWifiSettings();
   settingsManager.loadAppSettings();
+  bootProfiler.mark("settings");
+
+  // WiFi association and SPIFFS mount proceed in the background while the sensor is probed
+  bool wifiConfigured = settingsManager.isWifiConfigured();
+  if (wifiConfigured)
+    startWifi();
+  startSpiffsMount();
 
   fingerManager.connect();
+  bootProfiler.mark("sensor");
+  fingerManager.setSearchStrategy((SearchStrategy)settingsManager.getAppSettings().searchStrategy);
+  ScanPolicy scanPolicy;
+  scanPolicy.ringImagingPasses = settingsManager.getAppSettings().ringImagingPasses;
+  scanPolicy.matchScanPasses = settingsManager.getAppSettings().matchScanPasses;
+  scanPolicy.timeBudgetMs = settingsManager.getAppSettings().scanTimeBudgetMs;
+  scanPolicy.ringNoFingerExit = settingsManager.getAppSettings().ringNoFingerExit;
+  fingerManager.setScanPolicy(scanPolicy);
+  fingerManager.setSleepWhenIdle(settingsManager.getAppSettings().sensorSleepWhenIdle);
+#ifdef FINGERPRINT_SENSOR_EMULATOR
+  fingerManager.setIgnoreTouchRing(true); // there is no touch ring signal without a real sensor, poll the emulator instead
+#endif
   
-  if (!checkPairingValid())
-    notifyClients("Security issue! Pairing with sensor is invalid. This could potentially be an attack! If the sensor is new or has been replaced by you do a (re)pairing in settings page. MQTT messages regarding matching fingerprints will not been sent until pairing is valid again.");
-
-  if (fingerManager.isFingerOnSensor() || !settingsManager.isWifiConfigured())
+  if (fingerManager.isFingerOnSensor() || !wifiConfigured)
   {
     // ring touched during startup or no wifi settings stored -> wifi config mode
     currentMode = Mode::wificonfig;
     Serial.println("Started WiFi-Config mode");
     fingerManager.setLedRingWifiConfig();
+    if (wifiConfigured)
+      WiFi.disconnect(true); // stop the association started above
     initWiFiAccessPointForConfiguration();
     startWebserver();
 
   } else {
     Serial.println("Started normal operating mode");
     currentMode = Mode::scan;
-    if (initWifi()) {
+
+    // from now on the sensor task owns the sensor, don't call fingerManager functions talking to the sensor anymore
+    sensorTask.begin();
+
+    if (!checkPairingValid(readSensorPairingCode()))
+      notifyClients(LogCode::pairingInvalid);
+    bootProfiler.mark("pairing");
+
+    if (waitForWifi()) {
+      bootProfiler.mark("wifi");
+      initPowerManagement();
       mqtt.begin(MQTT_BROKER_ADDR, MQTT_PORT, MQTT_USER, MQTT_PASSWORD);
       startWebserver();
+      if (spiffsOk)
+        mqttQueue.begin(SPIFFS, "/mqttqueue");
+      bootProfiler.mark("webserver");
       // TODO connect MQTT
       if (fingerManager.connected)
-        fingerManager.setLedRingReady();
+        runSensorCommand(SensorCommandType::setLedRingReady);
       else
-        fingerManager.setLedRingError();
+        runSensorCommand(SensorCommandType::setLedRingError);
     }  else {
-      fingerManager.setLedRingError();
+      runSensorCommand(SensorCommandType::setLedRingError);
       shouldReboot = true;
     }
 
   }
-  
+
+  bootProfiler.mark("ready");
+  bootProfiler.print(Serial);
 }
 
 void updateHADevices() {
     // Update WiFi signal strength every 5 minutes
     unsigned long currentMillis = millis();
     if (currentMillis - lastWifiSignalUpdate >= WIFI_SIGNAL_INTERVAL) {
-        wifiSignal.setValue(WiFi.RSSI());
+        mqttQueue.push(MqttEvent::wifiSignal(WiFi.RSSI()));
+        mqttQueue.flush();
         lastWifiSignalUpdate = currentMillis;
+        Serial.printf("Longest loop iteration since last report: %lu us\n", loopMaxMicros);
+        loopMaxMicros = 0;
+        WakeStats wakeStats = fingerManager.getWakeStats();
+        if (wakeStats.latencyCount)
+          Serial.printf("Touch ring wakeups: %u, wake to image latency avg/max: %u/%u us\n", wakeStats.wakeups,
+            (uint32_t)(wakeStats.totalLatencyMicros / wakeStats.latencyCount), wakeStats.maxLatencyMicros);
+        else
+          Serial.printf("Touch ring wakeups: %u\n", wakeStats.wakeups);
+        PollStats pollStats = fingerManager.getPollStats();
+        Serial.printf("Sensor polls: %u/min, UART transactions: %u/min, poll interval: %u ms\n", pollStats.pollsPerMinute,
+          pollStats.transactionsPerMinute, pollStats.intervalMs);
+        LedStats ledStats = fingerManager.getLedStats();
+        Serial.printf("LED commands sent: %u, suppressed: %u\n", ledStats.sent, ledStats.suppressed);
+        #ifdef COUNT_HEAP_ALLOCATIONS
+        IdleAllocations sensorIdleAllocations = sensorTask.getIdleScanAllocations();
+        Serial.printf("Idle scans with heap allocations: sensor task %u of %u, main loop %u of %u\n",
+          sensorIdleAllocations.getAllocatingIterations(), sensorIdleAllocations.getIterations(),
+          idleScanAllocations.getAllocatingIterations(), idleScanAllocations.getIterations());
+        #endif
     }
 }
 
 void loop()
 {
+  unsigned long loopStartMicros = micros();
+
   // shouldReboot flag for supporting reboot through webui
   if (shouldReboot) {
     reboot();
@@ -622,32 +1382,31 @@ void loop()
   switch (currentMode)
   {
   case Mode::scan:
-    if (fingerManager.connected)
-      doScan();
-    break;
-  
-  case Mode::enroll:
-    doEnroll();
-    currentMode = Mode::scan; // switch back to scan mode after enrollment is done
+    sensorTask.dispatchCompletedCommands();
+    pumpDatabaseUpload();
+    doScan();
     break;
   
   case Mode::wificonfig:
     dnsServer.processNextRequest(); // used for captive portal redirect
     break;
 
-  case Mode::maintenance:
-    // do nothing, give webserver exclusive access to sensor (not thread-safe for concurrent calls)
-    break;
-
   }
 
+  wallClock.update();
   mqtt.loop();
+  if (mqtt.isConnected() && mqttQueue.getDepth())
+    mqttQueue.flush(); // what was queued while the broker was not reachable
   ElegantOTA.loop();
 
   updateHADevices();  
 
-  // enter maintenance mode (no continous scanning) if requested
-  if (needMaintenanceMode)
-    currentMode = Mode::maintenance;
+  unsigned long loopMicros = micros() - loopStartMicros;
+  if (loopMicros > loopMaxMicros)
+    loopMaxMicros = loopMicros;
+
+  // nothing to do until the sensor task has something for us, this lets the CPU idle
+  if (currentMode == Mode::scan)
+    sensorTask.waitForActivity(LOOP_IDLE_TIMEOUT_MS);
 }
 
@@ -0,0 +1,124 @@
+#include <Arduino.h>
+#include <R503Emulator.h>
+#include <unity.h>
+#include "AccessJournal.h"
+#include "FingerNameTable.h"
+#include "FingersJson.h"
+
+// Benchmarks of code that has to stay fast on the ESP32, run with "pio test -e native -f test_benchmarks -v" to see the
+// numbers. Times are the ones of the PC and only good for comparing changes, sizes are the same as on the ESP32.
+
+void notifyClients(LogCode code, int32_t arg0, int32_t arg1, const char *text) {
+}
+
+void notifyClients(const String &message) {
+}
+
+void notifyEnrollProgress(const EnrollProgress &progress) {
+}
+
+size_t formatTimestamp(char *buffer, size_t size) {
+  return strlcpy(buffer, "", size);
+}
+
+// counts what would be sent without keeping it
+class CountingPrint : public Print {
+  public:
+    size_t bytes = 0;
+    size_t write(uint8_t c) override { bytes++; return 1; }
+    size_t write(const uint8_t *buffer, size_t size) override { bytes += size; return size; }
+};
+
+// runs body runs times and prints the average time of a run
+template <typename Body>
+uint32_t benchmark(const char *name, int runs, Body body) {
+  uint32_t start = micros();
+  for (int run=0; run<runs; run++)
+    body();
+  uint32_t average = (micros() - start) / runs;
+  printf("%s: %u us\n", name, average);
+  return average;
+}
+
+void setUp() {
+}
+
+void tearDown() {
+}
+
+// size and serialization time of all pages of /api/v1/fingers for a full database of names with quotes to escape
+void test_fingers_json_full_database() {
+  const uint16_t capacity = R503_MAX_CAPACITY; // like the R503
+  FingerNameTable table;
+  TEST_ASSERT_TRUE(table.begin(capacity)); // ids 1..capacity-1 like FingerprintManager
+  char name[FINGER_NAME_BUFFER_SIZE];
+  for (uint16_t id=1; id<capacity; id++) {
+    snprintf(name, sizeof(name), "Finger \"%u\"", id);
+    table.set(id, name);
+  }
+  auto next = [&table](int id, char *name, size_t size) {
+    int next = table.next(id);
+    table.copy(next, name, size);
+    return next;
+  };
+
+  CountingPrint counter;
+  size_t pageBytes = 0;
+  int pages = 0;
+  benchmark("/api/v1/fingers, all pages", 10, [&]() {
+    counter.bytes = 0;
+    pages = 0;
+    for (int offset=0; offset<table.getCount(); offset+=API_FINGERS_PAGE_SIZE) {
+      size_t length = printFingersJson(counter, next, table.getCount(), offset, API_FINGERS_PAGE_SIZE);
+      pageBytes = max(pageBytes, length);
+      pages++;
+    }
+  });
+  printf("/api/v1/fingers for %u fingers: %d pages, %u bytes (largest page %u bytes)\n",
+    (unsigned)table.getCount(), pages, (unsigned)counter.bytes, (unsigned)pageBytes);
+  TEST_ASSERT_EQUAL(capacity - 1, table.getCount());
+  TEST_ASSERT_EQUAL((capacity - 1 + API_FINGERS_PAGE_SIZE - 1) / API_FINGERS_PAGE_SIZE, pages);
+  TEST_ASSERT_TRUE(pageBytes < 4096); // a page fits a few TCP segments
+}
+
+// append rate and query latency of a full access journal, on a filesystem in RAM so no flash is worn
+void test_journal_full() {
+  FS fs;
+  AccessJournal journal(fs, "/jbench");
+  TEST_ASSERT_TRUE(journal.begin());
+  const uint32_t records = JOURNAL_SEGMENTS * JOURNAL_SEGMENT_RECORDS;
+  const uint32_t start = 1700000000;
+  uint32_t appendMicros = benchmark("journal append, all records", 1, [&]() {
+    for (uint32_t i=0; i<records; i++)
+      journal.append(start + i * 60, true, ScanResult::matchFound, i % R503_MAX_CAPACITY + 1, 100, 0);
+  });
+  printf("journal append: %.0f records/s\n", records * 1e6 / max(appendMicros, (uint32_t)1));
+  TEST_ASSERT_EQUAL(records, journal.getRecordCount());
+
+  // one hour (61 records, both ends are included) at different positions of the journal
+  JournalRecord batch[8];
+  for (int i=0; i<5; i++) {
+    uint32_t position = records / 5 * i + 17;
+    uint32_t from = start + position * 60;
+    size_t found = 0;
+    uint32_t firstTime = 0;
+    char name[48];
+    snprintf(name, sizeof(name), "journal query of an hour at record %u", position);
+    benchmark(name, 10, [&]() {
+      JournalCursor cursor = journal.query(from, from + 3600);
+      found = journal.read(cursor, batch, 8);
+      firstTime = batch[0].time;
+      while (!cursor.done)
+        found += journal.read(cursor, batch, 8);
+    });
+    TEST_ASSERT_EQUAL(61, found);
+    TEST_ASSERT_EQUAL(from, firstTime);
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_fingers_json_full_database);
+  RUN_TEST(test_journal_full);
+  return UNITY_END();
+}
@@ -0,0 +1,93 @@
+#include <Arduino.h>
+#include <unity.h>
+#include <string>
+#include "FingerprintManager.h"
+#include "FingerNameTable.h"
+
+void notifyClients(LogCode code, int32_t arg0, int32_t arg1, const char *text) {
+}
+
+void notifyClients(const String &message) {
+}
+
+void notifyEnrollProgress(const EnrollProgress &progress) {
+}
+
+size_t formatTimestamp(char *buffer, size_t size) {
+  return strlcpy(buffer, "", size);
+}
+
+FingerNameTable *table;
+
+void setUp() {
+  table = new FingerNameTable();
+  TEST_ASSERT_TRUE(table->begin(200));
+}
+
+void tearDown() {
+  delete table;
+}
+
+std::string nameOf(uint16_t id) {
+  char name[FINGER_NAME_BUFFER_SIZE];
+  table->copy(id, name, sizeof(name));
+  return name;
+}
+
+void test_names_up_to_the_limit_are_kept() {
+  std::string name(FINGER_NAME_MAX_LENGTH, 'a');
+  TEST_ASSERT_TRUE(table->set(3, name.c_str()));
+  TEST_ASSERT_EQUAL_STRING(name.c_str(), nameOf(3).c_str());
+  TEST_ASSERT_TRUE(table->set(4, ""));
+  TEST_ASSERT_TRUE(table->isOccupied(4));
+  TEST_ASSERT_EQUAL(2, table->getCount());
+}
+
+void test_long_name_is_shortened_and_reported() {
+  std::string name(FINGER_NAME_MAX_LENGTH + 10, 'b');
+  TEST_ASSERT_FALSE(table->set(5, name.c_str()));
+  TEST_ASSERT_EQUAL_STRING(name.substr(0, FINGER_NAME_MAX_LENGTH).c_str(), nameOf(5).c_str());
+}
+
+void test_long_name_is_cut_between_utf8_characters() {
+  // 63 bytes, then "ä" (2 bytes) would end one byte beyond the limit
+  std::string name = std::string(FINGER_NAME_MAX_LENGTH - 1, 'c') + "\xC3\xA4" + "d";
+  TEST_ASSERT_FALSE(table->set(6, name.c_str()));
+  TEST_ASSERT_EQUAL_STRING(std::string(FINGER_NAME_MAX_LENGTH - 1, 'c').c_str(), nameOf(6).c_str());
+
+  // a 4 byte emoji across the limit
+  name = std::string(FINGER_NAME_MAX_LENGTH - 2, 'e') + "\xF0\x9F\x94\x94";
+  TEST_ASSERT_FALSE(table->set(7, name.c_str()));
+  TEST_ASSERT_EQUAL(FINGER_NAME_MAX_LENGTH - 2, nameOf(7).length());
+}
+
+void test_arena_grows_for_long_names() {
+  std::string name(FINGER_NAME_MAX_LENGTH, 'f');
+  for (uint16_t id=1; id<table->getSlots(); id++)
+    TEST_ASSERT_TRUE(table->set(id, name.c_str()));
+  TEST_ASSERT_EQUAL(table->getSlots() - 1, table->getCount());
+  TEST_ASSERT_EQUAL_STRING(name.c_str(), nameOf(table->getSlots() - 1).c_str());
+}
+
+void test_serialized_names_are_restored() {
+  table->set(1, "Alice");
+  table->set(12, "Jürgen");
+  std::string data(table->getSerializedSize(), '\0');
+  TEST_ASSERT_EQUAL(data.size(), table->serialize((uint8_t*)&data[0]));
+
+  FingerNameTable restored;
+  TEST_ASSERT_TRUE(restored.begin(10)); // a smaller sensor, #12 has no slot
+  TEST_ASSERT_TRUE(restored.deserialize((const uint8_t*)data.data(), data.size()));
+  TEST_ASSERT_EQUAL(1, restored.getCount());
+  TEST_ASSERT_EQUAL(1, restored.next(-1));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_names_up_to_the_limit_are_kept);
+  RUN_TEST(test_long_name_is_shortened_and_reported);
+  RUN_TEST(test_long_name_is_cut_between_utf8_characters);
+  RUN_TEST(test_arena_grows_for_long_names);
+  RUN_TEST(test_serialized_names_are_restored);
+  return UNITY_END();
+}
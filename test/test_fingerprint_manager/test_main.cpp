@@ -0,0 +1,278 @@
+#include <Arduino.h>
+#include <FS.h>
+#include <NativeArduino.h>
+#include <Preferences.h>
+#include <R503Emulator.h>
+#include <unity.h>
+#include <string>
+#include "FingerprintManager.h"
+
+// FingerprintManager against the R503 emulator, run with "pio test -e native"
+
+R503Emulator *sensor;
+FingerprintManager *fingerManager;
+
+void notifyClients(LogCode code, int32_t arg0, int32_t arg1, const char *text) {
+}
+
+void notifyClients(const String &message) {
+}
+
+void notifyEnrollProgress(const EnrollProgress &progress) {
+}
+
+size_t formatTimestamp(char *buffer, size_t size) {
+  return strlcpy(buffer, "", size);
+}
+
+void setUp() {
+  nativeClearPreferences();
+  nativeSetPinLevel(touchRingPin, HIGH); // ring not touched
+  sensor = new R503Emulator();
+  fingerManager = new FingerprintManager(sensor);
+}
+
+void tearDown() {
+  delete fingerManager;
+  delete sensor;
+}
+
+void connectSensor() {
+  TEST_ASSERT_TRUE(fingerManager->connect());
+  fingerManager->setIgnoreTouchRing(true); // scan like in rain mode, without waiting for the ring
+}
+
+// steps an enrollment like the sensor task does, returns the state it ended with
+EnrollState enroll(int id, const char *name, uint16_t fingerId) {
+  char script[64];
+  snprintf(script, sizeof(script), "F%u N F%u N F%u N F%u N F%u", fingerId, fingerId, fingerId, fingerId, fingerId);
+  sensor->loadScript(script);
+  if (!fingerManager->startEnroll(id, name))
+    return EnrollState::failed;
+  while (fingerManager->stepEnroll())
+    ;
+  return fingerManager->getEnrollProgress().state;
+}
+
+void test_connect_reads_sensor_parameters() {
+  connectSensor();
+  TEST_ASSERT_TRUE(fingerManager->connected);
+  TEST_ASSERT_EQUAL(R503_MAX_CAPACITY, fingerManager->getCapacity());
+  TEST_ASSERT_EQUAL(0, fingerManager->getFingerCount());
+}
+
+void test_scan_without_ring_touch_skips_the_sensor() {
+  connectSensor();
+  fingerManager->setIgnoreTouchRing(false);
+  sensor->loadScript("F3");
+  Match match = fingerManager->scanFingerprint();
+  TEST_ASSERT_TRUE(match.scanResult == ScanResult::noFinger);
+}
+
+void test_scan_finds_stored_finger() {
+  connectSensor();
+  sensor->storeTemplate(5, 42);
+  sensor->loadScript("F42");
+  Match match = fingerManager->scanFingerprint();
+  TEST_ASSERT_TRUE(match.scanResult == ScanResult::matchFound);
+  TEST_ASSERT_EQUAL(5, match.matchId);
+}
+
+void test_scan_unknown_finger_is_no_match() {
+  connectSensor();
+  sensor->storeTemplate(5, 42);
+  sensor->loadScript("F7*10");
+  Match match = fingerManager->scanFingerprint();
+  TEST_ASSERT_TRUE(match.scanResult == ScanResult::noMatchFound);
+}
+
+void test_ring_touch_without_finger_rings() {
+  connectSensor();
+  fingerManager->setIgnoreTouchRing(false);
+  nativeSetPinLevel(touchRingPin, LOW);
+  sensor->loadScript("N*20");
+  Match match = fingerManager->scanFingerprint();
+  TEST_ASSERT_TRUE(match.scanResult == ScanResult::noMatchFound);
+}
+
+void test_sensor_wakes_up_after_sleep() {
+  connectSensor();
+  fingerManager->setSleepWhenIdle(true);
+  TEST_ASSERT_TRUE(fingerManager->isSleepWhenIdle());
+  sensor->storeTemplate(5, 42);
+  fingerManager->sleepSensor(); // like the sensor task while waiting for a touch
+  TEST_ASSERT_TRUE(fingerManager->wakeSensor());
+  sensor->loadScript("F42");
+  Match match = fingerManager->scanFingerprint();
+  TEST_ASSERT_TRUE(match.scanResult == ScanResult::matchFound);
+  TEST_ASSERT_EQUAL(5, match.matchId);
+}
+
+void test_enroll_stores_finger_and_name() {
+  connectSensor();
+  TEST_ASSERT_TRUE(enroll(3, "Alice", 9) == EnrollState::done);
+  TEST_ASSERT_EQUAL(1, fingerManager->getFingerCount());
+  char name[FINGER_NAME_BUFFER_SIZE];
+  TEST_ASSERT_TRUE(fingerManager->copyFingerName(3, name, sizeof(name)));
+  TEST_ASSERT_EQUAL_STRING("Alice", name);
+
+  sensor->loadScript("F9");
+  Match match = fingerManager->scanFingerprint();
+  TEST_ASSERT_TRUE(match.scanResult == ScanResult::matchFound);
+  TEST_ASSERT_EQUAL(3, match.matchId);
+}
+
+void test_enroll_checks_id_against_capacity() {
+  connectSensor();
+  TEST_ASSERT_FALSE(fingerManager->startEnroll(0, "Zero"));
+  TEST_ASSERT_FALSE(fingerManager->startEnroll(1, String(std::string(FINGER_NAME_MAX_LENGTH + 1, 'x').c_str())));
+  TEST_ASSERT_FALSE(fingerManager->startEnroll(fingerManager->getCapacity(), "Beyond")); // the sensor has pages 0..capacity-1
+  TEST_ASSERT_TRUE(fingerManager->startEnroll(fingerManager->getCapacity() - 1, "Last"));
+  TEST_ASSERT_TRUE(fingerManager->cancelEnroll());
+  TEST_ASSERT_FALSE(fingerManager->stepEnroll());
+  TEST_ASSERT_TRUE(fingerManager->getEnrollProgress().state == EnrollState::cancelled);
+}
+
+void test_last_slot_is_stored() {
+  connectSensor();
+  int last = fingerManager->getCapacity() - 1;
+  TEST_ASSERT_TRUE(enroll(last, "Last", 30) == EnrollState::done);
+  sensor->loadScript("F30");
+  Match match = fingerManager->scanFingerprint();
+  TEST_ASSERT_TRUE(match.scanResult == ScanResult::matchFound);
+  TEST_ASSERT_EQUAL(last, match.matchId);
+}
+
+void test_enroll_fails_on_raindrop() {
+  connectSensor();
+  sensor->loadScript("R");
+  TEST_ASSERT_TRUE(fingerManager->startEnroll(4, "Rain"));
+  while (fingerManager->stepEnroll())
+    ;
+  TEST_ASSERT_TRUE(fingerManager->getEnrollProgress().state == EnrollState::failed);
+  TEST_ASSERT_EQUAL(0, fingerManager->getFingerCount());
+}
+
+void test_names_are_loaded_after_restart() {
+  connectSensor();
+  TEST_ASSERT_TRUE(enroll(7, "Bob", 11) == EnrollState::done);
+  fingerManager->renameFinger(7, "Robert");
+
+  FingerprintManager restarted(sensor);
+  TEST_ASSERT_TRUE(restarted.connect());
+  char name[FINGER_NAME_BUFFER_SIZE];
+  TEST_ASSERT_TRUE(restarted.copyFingerName(7, name, sizeof(name)));
+  TEST_ASSERT_EQUAL_STRING("Robert", name);
+  TEST_ASSERT_EQUAL(1, restarted.getFingerCount());
+}
+
+void test_legacy_names_are_migrated() {
+  Preferences preferences;
+  preferences.begin("fingerList", false);
+  preferences.putString("1", "Carol");
+  preferences.putString("12", "Dave");
+  preferences.end();
+
+  connectSensor();
+  char name[FINGER_NAME_BUFFER_SIZE];
+  TEST_ASSERT_TRUE(fingerManager->copyFingerName(12, name, sizeof(name)));
+  TEST_ASSERT_EQUAL_STRING("Dave", name);
+  TEST_ASSERT_EQUAL(2, fingerManager->getFingerCount());
+
+  preferences.begin("fingerList", true);
+  TEST_ASSERT_FALSE(preferences.isKey("1")); // moved into the name blob
+  preferences.end();
+}
+
+void test_database_export_import() {
+  connectSensor();
+  TEST_ASSERT_TRUE(enroll(2, "Erin", 21) == EnrollState::done);
+  TEST_ASSERT_TRUE(enroll(9, "Frank", 22) == EnrollState::done);
+  FS flash;
+  File file = flash.open("/fingerprints.fpdb", FILE_WRITE);
+  DatabaseTransfer exported = fingerManager->exportSensorDB(file);
+  file.close();
+  TEST_ASSERT_TRUE(exported.ok);
+  TEST_ASSERT_EQUAL(2, exported.templates);
+
+  // into an empty sensor, like after replacing it
+  R503Emulator replacement;
+  FingerprintManager replaced(&replacement);
+  TEST_ASSERT_TRUE(replaced.connect());
+  replaced.setIgnoreTouchRing(true);
+  file = flash.open("/fingerprints.fpdb");
+  DatabaseTransfer imported = replaced.importSensorDB(file);
+  file.close();
+  TEST_ASSERT_TRUE(imported.ok);
+  TEST_ASSERT_EQUAL(2, imported.templates);
+  replacement.loadScript("F22");
+  Match match = replaced.scanFingerprint();
+  TEST_ASSERT_TRUE(match.scanResult == ScanResult::matchFound);
+  TEST_ASSERT_EQUAL(9, match.matchId);
+}
+
+void test_database_import_skips_ids_without_slot() {
+  connectSensor();
+  sensor->storeTemplate(0, 40); // page 0 is never used by the doorbell
+  TEST_ASSERT_TRUE(enroll(5, "Gina", 41) == EnrollState::done);
+  TEST_ASSERT_TRUE(enroll(150, "Hank", 42) == EnrollState::done);
+  FS flash;
+  File file = flash.open("/fingerprints.fpdb", FILE_WRITE);
+  TEST_ASSERT_TRUE(fingerManager->exportSensorDB(file).ok);
+  file.close();
+
+  R503Emulator smaller(100);
+  FingerprintManager replaced(&smaller);
+  TEST_ASSERT_TRUE(replaced.connect());
+  file = flash.open("/fingerprints.fpdb");
+  DatabaseTransfer imported = replaced.importSensorDB(file);
+  file.close();
+  TEST_ASSERT_TRUE(imported.ok);
+  TEST_ASSERT_EQUAL(1, imported.templates);
+  TEST_ASSERT_EQUAL(2, imported.skipped);
+  TEST_ASSERT_EQUAL(0, imported.skippedIds[0]);
+  TEST_ASSERT_EQUAL(150, imported.skippedIds[1]);
+  TEST_ASSERT_EQUAL(1, replaced.getFingerCount());
+  char name[FINGER_NAME_BUFFER_SIZE];
+  TEST_ASSERT_FALSE(replaced.copyFingerName(0, name, sizeof(name)));
+  TEST_ASSERT_TRUE(replaced.copyFingerName(5, name, sizeof(name)));
+}
+
+void test_database_import_rejects_unknown_versions() {
+  connectSensor();
+  FS flash;
+  const uint8_t versions[] = { 0, SENSOR_DB_VERSION + 1 };
+  for (uint8_t version : versions) {
+    File file = flash.open("/fingerprints.fpdb", FILE_WRITE);
+    file.write((const uint8_t*)SENSOR_DB_MAGIC, 4);
+    file.write(version);
+    file.write((uint8_t)0); // no templates
+    file.write((uint8_t)0);
+    file.close();
+    file = flash.open("/fingerprints.fpdb");
+    DatabaseTransfer imported = fingerManager->importSensorDB(file);
+    file.close();
+    TEST_ASSERT_FALSE(imported.ok);
+    TEST_ASSERT_TRUE(imported.error.startsWith("Unsupported database version"));
+  }
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_connect_reads_sensor_parameters);
+  RUN_TEST(test_scan_without_ring_touch_skips_the_sensor);
+  RUN_TEST(test_scan_finds_stored_finger);
+  RUN_TEST(test_scan_unknown_finger_is_no_match);
+  RUN_TEST(test_ring_touch_without_finger_rings);
+  RUN_TEST(test_sensor_wakes_up_after_sleep);
+  RUN_TEST(test_enroll_stores_finger_and_name);
+  RUN_TEST(test_enroll_checks_id_against_capacity);
+  RUN_TEST(test_last_slot_is_stored);
+  RUN_TEST(test_enroll_fails_on_raindrop);
+  RUN_TEST(test_names_are_loaded_after_restart);
+  RUN_TEST(test_legacy_names_are_migrated);
+  RUN_TEST(test_database_export_import);
+  RUN_TEST(test_database_import_skips_ids_without_slot);
+  RUN_TEST(test_database_import_rejects_unknown_versions);
+  return UNITY_END();
+}
@@ -0,0 +1,180 @@
+#include <Arduino.h>
+#include <NativeArduino.h>
+#include <FS.h>
+#include <unity.h>
+#include <string>
+#include <vector>
+#include "FingerprintManager.h"
+#include "MqttQueue.h"
+
+// MqttQueue against a stand-in broker that can be taken offline
+
+#define QUEUE_PATH "/mqttqueue"
+
+bool brokerOnline;
+std::vector<std::string> received; // "person:<name>/<id>" or "wifi:<value>"
+
+bool publishToBroker(const MqttEvent &event) {
+  if (!brokerOnline)
+    return false;
+  char message[96];
+  if (event.type == MqttEventType::person)
+    snprintf(message, sizeof(message), "person:%s/%d", event.name, event.id);
+  else
+    snprintf(message, sizeof(message), "wifi:%d", (int)event.value);
+  received.push_back(message);
+  return true;
+}
+
+// received messages separated by spaces, cleared afterwards
+std::string takeReceived() {
+  std::string messages;
+  for (const std::string &message : received)
+    messages += (messages.empty() ? "" : " ") + message;
+  received.clear();
+  return messages;
+}
+
+void notifyClients(LogCode code, int32_t arg0, int32_t arg1, const char *text) {
+}
+
+void notifyClients(const String &message) {
+}
+
+void notifyEnrollProgress(const EnrollProgress &progress) {
+}
+
+size_t formatTimestamp(char *buffer, size_t size) {
+  return strlcpy(buffer, "", size);
+}
+
+FS *flash; // stands in for SPIFFS
+MqttQueue *queue;
+
+void setUp() {
+  brokerOnline = true;
+  received.clear();
+  flash = new FS();
+  queue = new MqttQueue(publishToBroker);
+  queue->begin(*flash, QUEUE_PATH);
+}
+
+void tearDown() {
+  delete queue;
+  delete flash;
+}
+
+void pushAndFlush(const MqttEvent &event) {
+  queue->push(event);
+  queue->flush();
+}
+
+void test_online_events_are_sent_at_once() {
+  pushAndFlush(MqttEvent::person("Alice", 90, 1));
+  pushAndFlush(MqttEvent::person("Nobody", -1, -1));
+  TEST_ASSERT_EQUAL_STRING("person:Alice/1 person:Nobody/-1", takeReceived().c_str());
+  TEST_ASSERT_EQUAL(0, queue->getDepth());
+  TEST_ASSERT_FALSE(flash->exists(QUEUE_PATH));
+}
+
+void test_offline_states_are_coalesced() {
+  brokerOnline = false;
+  pushAndFlush(MqttEvent::person("Bob", 80, 2));
+  pushAndFlush(MqttEvent::wifiSignal(-60));
+  pushAndFlush(MqttEvent::person("Nobody", -1, -1));
+  pushAndFlush(MqttEvent::wifiSignal(-61)); // replaces -60
+  pushAndFlush(MqttEvent::person("Unknown", -1, -1)); // a ring stays an event of its own
+  pushAndFlush(MqttEvent::person("Nobody", -1, -1));
+  pushAndFlush(MqttEvent::person("Nobody", -1, -1)); // replaces the one before
+  TEST_ASSERT_EQUAL(5, queue->getDepth());
+
+  brokerOnline = true;
+  TEST_ASSERT_EQUAL(5, queue->flush());
+  TEST_ASSERT_EQUAL_STRING("person:Bob/2 person:Nobody/-1 wifi:-61 person:Unknown/-1 person:Nobody/-1",
+    takeReceived().c_str());
+}
+
+void test_offline_events_are_kept_on_flash() {
+  brokerOnline = false;
+  pushAndFlush(MqttEvent::person("Unknown", -1, -1));
+  pushAndFlush(MqttEvent::wifiSignal(-70));
+  TEST_ASSERT_TRUE(flash->exists(QUEUE_PATH));
+
+  brokerOnline = true;
+  queue->flush();
+  TEST_ASSERT_FALSE(flash->exists(QUEUE_PATH)); // the file only exists while events are waiting
+}
+
+void test_offline_events_survive_reboot() {
+  brokerOnline = false;
+  pushAndFlush(MqttEvent::person("Bob", 80, 2));
+  pushAndFlush(MqttEvent::person("Unknown", -1, -1));
+  pushAndFlush(MqttEvent::wifiSignal(-65));
+
+  MqttQueue rebooted(publishToBroker);
+  rebooted.begin(*flash, QUEUE_PATH);
+  TEST_ASSERT_EQUAL(3, rebooted.getDepth());
+  brokerOnline = true;
+  rebooted.flush();
+  // a match from before the reboot could be any age, so it is dropped
+  TEST_ASSERT_EQUAL_STRING("person:Unknown/-1 wifi:-65", takeReceived().c_str());
+  TEST_ASSERT_FALSE(flash->exists(QUEUE_PATH));
+}
+
+void test_corrupt_queue_file_is_ignored() {
+  File file = flash->open(QUEUE_PATH, FILE_WRITE);
+  file.write((const uint8_t*)"garbage", 7);
+  file.close();
+
+  MqttQueue rebooted(publishToBroker);
+  rebooted.begin(*flash, QUEUE_PATH);
+  TEST_ASSERT_EQUAL(0, rebooted.getDepth());
+  rebooted.flush();
+  TEST_ASSERT_FALSE(flash->exists(QUEUE_PATH));
+}
+
+void test_matches_expire_after_30_seconds() {
+  brokerOnline = false;
+  pushAndFlush(MqttEvent::person("Carol", 70, 3));
+  pushAndFlush(MqttEvent::person("Unknown", -1, -1));
+  nativeAdvanceClock(MQTT_MATCH_MAX_AGE_MS + 1);
+  brokerOnline = true;
+  queue->flush();
+  TEST_ASSERT_EQUAL_STRING("person:Unknown/-1", takeReceived().c_str()); // a ring is still worth knowing
+}
+
+void test_matches_are_sent_within_30_seconds() {
+  brokerOnline = false;
+  pushAndFlush(MqttEvent::person("Carol", 70, 3));
+  nativeAdvanceClock(MQTT_MATCH_MAX_AGE_MS - 1000);
+  brokerOnline = true;
+  queue->flush();
+  TEST_ASSERT_EQUAL_STRING("person:Carol/3", takeReceived().c_str());
+}
+
+void test_full_queue_drops_oldest() {
+  brokerOnline = false;
+  char name[16];
+  for (int i=0; i<MQTT_QUEUE_SIZE + 8; i++) {
+    snprintf(name, sizeof(name), "Ring%d", i);
+    pushAndFlush(MqttEvent::person(name, -1, -1));
+  }
+  TEST_ASSERT_EQUAL(MQTT_QUEUE_SIZE, queue->getDepth());
+  brokerOnline = true;
+  TEST_ASSERT_EQUAL(MQTT_QUEUE_SIZE, queue->flush());
+  TEST_ASSERT_EQUAL_STRING("person:Ring8/-1", received.front().c_str());
+  TEST_ASSERT_EQUAL_STRING("person:Ring39/-1", received.back().c_str());
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_online_events_are_sent_at_once);
+  RUN_TEST(test_offline_states_are_coalesced);
+  RUN_TEST(test_offline_events_are_kept_on_flash);
+  RUN_TEST(test_offline_events_survive_reboot);
+  RUN_TEST(test_corrupt_queue_file_is_ignored);
+  RUN_TEST(test_matches_expire_after_30_seconds);
+  RUN_TEST(test_matches_are_sent_within_30_seconds);
+  RUN_TEST(test_full_queue_drops_oldest);
+  return UNITY_END();
+}